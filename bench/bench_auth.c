@@ -0,0 +1,486 @@
+/*
+ * Micro-benchmark of the nginx-dlg-auth request pipeline, run outside of NGINX.
+ *
+ * The stages measured are the ones ngx_dlg_auth_authenticate runs for every
+ * request:
+ *
+ *   parse     hawkc_parse_authorization_header
+ *   unseal    ciron_unseal
+ *   ticket    ticket_from_string
+ *   hmac      hawkc_validate_hmac
+ *   hmac-evp  hawkmac_validate, the OpenSSL signature validation of the module
+ *             built with DLG_AUTH_CRYPTO=openssl, one HawkMac per thread
+ *   realm     ticket_has_realm_hash
+ *   pipeline  all of the above, in the order the module runs them
+ *
+ * The input is a corpus of requests, one per line: method, path and Authorization
+ * header, separated by tabs. make_corpus.sh creates one.
+ *
+ * For every stage, ns/op, allocations/op and ops/s are reported. With -t, the
+ * stage runs in that many threads at the same time and ops/s is the overall
+ * throughput. Allocations are counted by wrapping malloc() and friends at link
+ * time (see Makefile), which covers this program, ticket.c and the ciron and hawkc
+ * libraries, but not shared libraries such as libcrypto.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <hawkc.h>
+#include <ciron.h>
+#include "ticket.h"
+#include "pwdindex.h"
+#include "hawkmac.h"
+
+#define MAX_SAMPLES 100000
+#define MAX_LINE 8192
+#define MAX_PASSWORDS 100
+#define MAX_THREADS 256
+
+/* Same as in nginx_dlg_auth.h */
+#define ENCRYPTION_BUFFER_SIZE 8192
+#define OUTPUT_BUFFER_SIZE 4096
+
+#define ARENA_SIZE (64 * 1024)
+
+/*
+ * A request of the corpus. The ticket is unsealed once when loading so that
+ * the ticket and realm stages have input to work on.
+ */
+typedef struct Sample {
+	char *method;
+	char *path;
+	char *authorization;
+	size_t authorization_len;
+	unsigned char *ticket_json;
+	size_t ticket_json_len;
+	struct Ticket ticket;
+	struct HawkcContext hawkc_ctx;
+} Sample;
+
+/*
+ * Per thread state, the buffers correspond to the on-stack buffers of the module.
+ */
+typedef struct Worker {
+	pthread_t thread;
+	int stage;
+	unsigned long ops;
+	unsigned long allocs;
+	int errors;
+	unsigned char encryption_buffer[ENCRYPTION_BUFFER_SIZE];
+	unsigned char output_buffer[OUTPUT_BUFFER_SIZE];
+	/* Realm arrays of tickets with many realms, reset for every operation like a request pool */
+	unsigned char arena[ARENA_SIZE];
+	size_t arena_used;
+	/* HMAC contexts of the thread, like the per worker contexts of the module */
+	struct HawkMac hawkmac;
+} Worker;
+
+typedef int (*StageFunc)(Worker *w, Sample *s);
+
+static Sample *samples;
+static size_t nsamples;
+static struct CironPwdTableEntry pwd_entries[MAX_PASSWORDS];
+static struct CironPwdTable pwd_table = { 0, pwd_entries };
+static struct PwdIndex pwd_index;
+static unsigned char *password = NULL;
+static size_t password_len = 0;
+static unsigned char *realm = (unsigned char *)"test";
+static size_t realm_len = 4;
+static uint32_t realm_hash;
+static char *host = "localhost";
+static char *port = "80";
+static unsigned long iterations = 100;
+static pthread_barrier_t start_barrier;
+
+/*
+ * Allocation counting, see Makefile for the --wrap linker options.
+ */
+static __thread unsigned long allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	allocs++;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t n, size_t size) {
+	allocs++;
+	return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *p, size_t size) {
+	allocs++;
+	return __real_realloc(p, size);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void init_hawkc(HawkcContext ctx, Sample *s) {
+	hawkc_context_init(ctx);
+	hawkc_context_set_method(ctx, (unsigned char *)s->method, strlen(s->method));
+	hawkc_context_set_path(ctx, (unsigned char *)s->path, strlen(s->path));
+	hawkc_context_set_host(ctx, (unsigned char *)host, strlen(host));
+	hawkc_context_set_port(ctx, (unsigned char *)port, strlen(port));
+}
+
+static void *arena_alloc(void *ctx, size_t size) {
+	Worker *w = ctx;
+	void *p;
+	size = (size + 15) & ~(size_t)15;
+	if(ARENA_SIZE - w->arena_used < size) {
+		return NULL;
+	}
+	p = w->arena + w->arena_used;
+	w->arena_used += size;
+	return p;
+}
+
+static void *heap_alloc(void *ctx, size_t size) {
+	return malloc(size);
+}
+
+static int unseal(Worker *w, HawkcString *id, unsigned char *out, size_t *out_len) {
+	struct CironContext ciron_ctx;
+	struct CironPwdTable single_entry_table;
+	CironPwdTable table = &pwd_table;
+	CironPwdTableEntry entry;
+	const unsigned char *pwd_id;
+	size_t pwd_id_len;
+
+	/* Same password id lookup as ngx_dlg_auth_unseal_ticket */
+	if(pwd_index_sealed_id(id->data, id->len, &pwd_id, &pwd_id_len) == 0 && pwd_id_len > 0
+			&& (entry = pwd_index_lookup(&pwd_index, pwd_id, pwd_id_len)) != NULL) {
+		single_entry_table.nentries = 1;
+		single_entry_table.entries = entry;
+		table = &single_entry_table;
+	}
+	ciron_context_init(&ciron_ctx, CIRON_DEFAULT_ENCRYPTION_OPTIONS, CIRON_DEFAULT_INTEGRITY_OPTIONS);
+	if(ciron_unseal(&ciron_ctx, id->data, id->len, table, password, password_len,
+			w->encryption_buffer, out, out_len) != CIRON_OK) {
+		return -1;
+	}
+	return 0;
+}
+
+static int stage_parse(Worker *w, Sample *s) {
+	struct HawkcContext ctx;
+	init_hawkc(&ctx, s);
+	return hawkc_parse_authorization_header(&ctx, (unsigned char *)s->authorization, s->authorization_len) == HAWKC_OK ? 0 : -1;
+}
+
+static int stage_unseal(Worker *w, Sample *s) {
+	size_t len;
+	return unseal(w, &(s->hawkc_ctx.header_in.id), w->output_buffer, &len);
+}
+
+static int stage_ticket(Worker *w, Sample *s) {
+	struct Ticket ticket;
+	w->arena_used = 0;
+	ticket_init(&ticket, arena_alloc, w);
+	return ticket_from_string(&ticket, (char *)s->ticket_json, s->ticket_json_len) == OK ? 0 : -1;
+}
+
+static int stage_hmac(Worker *w, Sample *s) {
+	struct HawkcContext ctx;
+	int valid;
+	ctx = s->hawkc_ctx;
+	if(hawkc_validate_hmac(&ctx, &valid) != HAWKC_OK || !valid) {
+		return -1;
+	}
+	return 0;
+}
+
+static int stage_hmac_evp(Worker *w, Sample *s) {
+	struct HawkMacRequest request;
+	int valid;
+	request.method.data = (unsigned char *)s->method;
+	request.method.len = strlen(s->method);
+	request.path.data = (unsigned char *)s->path;
+	request.path.len = strlen(s->path);
+	request.host.data = (unsigned char *)host;
+	request.host.len = strlen(host);
+	request.port.data = (unsigned char *)port;
+	request.port.len = strlen(port);
+	if(hawkmac_validate(&(w->hawkmac), s->ticket.hawkAlgorithm, s->ticket.pwd.data, s->ticket.pwd.len, &request,
+			&(s->hawkc_ctx.header_in), &valid) != HAWKMAC_OK || !valid) {
+		return -1;
+	}
+	return 0;
+}
+
+static int stage_realm(Worker *w, Sample *s) {
+	return ticket_has_realm_hash(&(s->ticket), realm, realm_len, realm_hash) ? 0 : -1;
+}
+
+static int stage_pipeline(Worker *w, Sample *s) {
+	struct HawkcContext ctx;
+	struct Ticket ticket;
+	size_t len;
+	int valid;
+
+	w->arena_used = 0;
+	ticket_init(&ticket, arena_alloc, w);
+	init_hawkc(&ctx, s);
+	if(hawkc_parse_authorization_header(&ctx, (unsigned char *)s->authorization, s->authorization_len) != HAWKC_OK) {
+		return -1;
+	}
+	if(unseal(w, &(ctx.header_in.id), w->output_buffer, &len) != 0) {
+		return -1;
+	}
+	if(ticket_from_string(&ticket, (char *)w->output_buffer, len) != OK) {
+		return -1;
+	}
+	hawkc_context_set_password(&ctx, ticket.pwd.data, ticket.pwd.len);
+	hawkc_context_set_algorithm(&ctx, ticket.hawkAlgorithm);
+	if(hawkc_validate_hmac(&ctx, &valid) != HAWKC_OK || !valid) {
+		return -1;
+	}
+	return ticket_has_realm_hash(&ticket, realm, realm_len, realm_hash) ? 0 : -1;
+}
+
+static struct {
+	char *name;
+	StageFunc func;
+} stages[] = {
+	{ "parse", stage_parse },
+	{ "unseal", stage_unseal },
+	{ "ticket", stage_ticket },
+	{ "hmac", stage_hmac },
+	{ "hmac-evp", stage_hmac_evp },
+	{ "realm", stage_realm },
+	{ "pipeline", stage_pipeline },
+	{ NULL, NULL }
+};
+
+static void *run_stage(void *arg) {
+	Worker *w = arg;
+	StageFunc f = stages[w->stage].func;
+	unsigned long i;
+	size_t j;
+
+	if(hawkmac_init(&(w->hawkmac)) != 0) {
+		fprintf(stderr, "Unable to set up OpenSSL HMAC contexts\n");
+		exit(1);
+	}
+	pthread_barrier_wait(&start_barrier);
+	allocs = 0;
+	for(i = 0; i < iterations; i++) {
+		for(j = 0; j < nsamples; j++) {
+			if(f(w, &samples[j]) != 0) {
+				w->errors++;
+			}
+		}
+	}
+	w->ops = iterations * nsamples;
+	w->allocs = allocs;
+	pthread_barrier_wait(&start_barrier);
+	hawkmac_free(&(w->hawkmac));
+	return NULL;
+}
+
+static void bench_stage(int stage, int nthreads) {
+	Worker *workers;
+	unsigned long ops = 0, nallocs = 0;
+	int errors = 0;
+	double start, elapsed;
+	int i;
+
+	if( (workers = calloc(nthreads, sizeof(Worker))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for(i = 0; i < nthreads; i++) {
+		workers[i].stage = stage;
+		pthread_create(&(workers[i].thread), NULL, run_stage, &workers[i]);
+	}
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	elapsed = now_ns() - start;
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		nallocs += workers[i].allocs;
+		errors += workers[i].errors;
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	/* ns/op is per thread, ops/s is the overall throughput */
+	printf("%-10s %7d %12lu %10.1f %10.2f %14.0f%s\n", stages[stage].name, nthreads, ops,
+			elapsed * nthreads / (double)ops, (double)nallocs / (double)ops, (double)ops / (elapsed / 1e9),
+			errors ? "  (errors!)" : "");
+	free(workers);
+}
+
+/*
+ * Load the corpus and prepare every sample: parse the header, unseal and parse
+ * the ticket and set up the Hawk context for the hmac stage.
+ */
+static void load_corpus(char *file) {
+	FILE *f;
+	char line[MAX_LINE];
+	Worker *w;
+	Sample *s;
+	const char *msg;
+	char *p;
+	int valid;
+
+	if( (f = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+	if( (w = calloc(1, sizeof(Worker))) == NULL || (samples = calloc(MAX_SAMPLES, sizeof(Sample))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	if(hawkmac_init(&(w->hawkmac)) != 0) {
+		fprintf(stderr, "Unable to set up OpenSSL HMAC contexts\n");
+		exit(1);
+	}
+	if( (msg = hawkmac_self_test(&(w->hawkmac))) != NULL) {
+		fprintf(stderr, "OpenSSL HMAC self-test failed: %s\n", msg);
+		exit(1);
+	}
+	while(nsamples < MAX_SAMPLES && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+		s = &samples[nsamples];
+		s->method = strdup(strtok(line, "\t"));
+		s->path = strdup((p = strtok(NULL, "\t")) ? p : "/");
+		if( (p = strtok(NULL, "\t")) == NULL) {
+			fprintf(stderr, "Corpus line %zu has no Authorization header\n", nsamples + 1);
+			exit(1);
+		}
+		if(strncmp(p, "Authorization: ", 15) == 0) {
+			p += 15;
+		}
+		s->authorization = strdup(p);
+		s->authorization_len = strlen(p);
+
+		init_hawkc(&(s->hawkc_ctx), s);
+		if(hawkc_parse_authorization_header(&(s->hawkc_ctx), (unsigned char *)s->authorization, s->authorization_len) != HAWKC_OK) {
+			fprintf(stderr, "Unable to parse Authorization header of corpus line %zu: %s\n", nsamples + 1,
+					hawkc_get_error(&(s->hawkc_ctx)));
+			exit(1);
+		}
+		if(unseal(w, &(s->hawkc_ctx.header_in.id), w->output_buffer, &(s->ticket_json_len)) != 0) {
+			fprintf(stderr, "Unable to unseal ticket of corpus line %zu, check passwords\n", nsamples + 1);
+			exit(1);
+		}
+		if( (s->ticket_json = malloc(s->ticket_json_len)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(s->ticket_json, w->output_buffer, s->ticket_json_len);
+		ticket_init(&(s->ticket), heap_alloc, NULL);
+		if(ticket_from_string(&(s->ticket), (char *)s->ticket_json, s->ticket_json_len) != OK) {
+			fprintf(stderr, "Unable to parse ticket of corpus line %zu\n", nsamples + 1);
+			exit(1);
+		}
+		hawkc_context_set_password(&(s->hawkc_ctx), s->ticket.pwd.data, s->ticket.pwd.len);
+		hawkc_context_set_algorithm(&(s->hawkc_ctx), s->ticket.hawkAlgorithm);
+		if(hawkc_validate_hmac(&(s->hawkc_ctx), &valid) != HAWKC_OK || !valid) {
+			fprintf(stderr, "Invalid signature in corpus line %zu, check host and port\n", nsamples + 1);
+			exit(1);
+		}
+		if(stage_hmac_evp(w, s) != 0) {
+			fprintf(stderr, "OpenSSL HMAC does not match hawkc in corpus line %zu\n", nsamples + 1);
+			exit(1);
+		}
+		nsamples++;
+	}
+	fclose(f);
+	hawkmac_free(&(w->hawkmac));
+	free(w);
+	if(nsamples == 0) {
+		fprintf(stderr, "Corpus %s is empty\n", file);
+		exit(1);
+	}
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s -f corpus (-p password | -P id:password ...) [-r realm] [-H host] [-O port]\n"
+			"          [-n iterations] [-t threads] [-s stage]\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	char *corpus = NULL;
+	char *only = NULL;
+	char *sep;
+	int nthreads = 1;
+	int c;
+	int i;
+
+	while( (c = getopt(argc, argv, "f:p:P:r:H:O:n:t:s:")) != -1) {
+		switch(c) {
+		case 'f':
+			corpus = optarg;
+			break;
+		case 'p':
+			password = (unsigned char *)optarg;
+			password_len = strlen(optarg);
+			break;
+		case 'P':
+			if( (sep = strchr(optarg, ':')) == NULL || pwd_table.nentries == MAX_PASSWORDS) {
+				usage(argv[0]);
+			}
+			pwd_entries[pwd_table.nentries].password_id = (unsigned char *)optarg;
+			pwd_entries[pwd_table.nentries].password_id_len = sep - optarg;
+			pwd_entries[pwd_table.nentries].password = (unsigned char *)sep + 1;
+			pwd_entries[pwd_table.nentries].password_len = strlen(sep + 1);
+			pwd_table.nentries++;
+			break;
+		case 'r':
+			realm = (unsigned char *)optarg;
+			realm_len = strlen(optarg);
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'O':
+			port = optarg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(corpus == NULL || (password == NULL && pwd_table.nentries == 0) || nthreads < 1 || nthreads > MAX_THREADS) {
+		usage(argv[0]);
+	}
+
+	realm_hash = ticket_realm_hash(realm, realm_len);
+	if(pwd_index_build(&pwd_index, &pwd_table, heap_alloc, NULL) != 0) {
+		perror("pwd_index_build");
+		exit(1);
+	}
+	load_corpus(corpus);
+
+	printf("%zu samples, %lu iterations\n\n", nsamples, iterations);
+	printf("%-10s %7s %12s %10s %10s %14s\n", "stage", "threads", "ops", "ns/op", "allocs/op", "ops/s");
+	for(i = 0; stages[i].name != NULL; i++) {
+		if(only == NULL || strcmp(only, stages[i].name) == 0) {
+			bench_stage(i, nthreads);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Micro-benchmark of the password id lookup for iron password tables with
+ * 10 up to 100000 entries, comparing a linear scan of the table (what
+ * ciron_unseal does) with the hash index of pwdindex.c.
+ *
+ *   ./bench_pwdindex [-n lookups]
+ *
+ * Lookups use sealed ticket prefixes with ids spread evenly over the table,
+ * so the linear scan inspects half of the table on average.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pwdindex.h"
+
+#define NIDS 1024
+
+static void *heap_alloc(void *ctx, size_t size) {
+	return malloc(size);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static CironPwdTableEntry linear_lookup(CironPwdTable table, const unsigned char *id, size_t id_len) {
+	size_t i;
+	for(i = 0; i < table->nentries; i++) {
+		if(table->entries[i].password_id_len == id_len && memcmp(table->entries[i].password_id, id, id_len) == 0) {
+			return &(table->entries[i]);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	static const size_t sizes[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned long lookups = 1000000, k;
+	size_t s, i, n, id_len;
+	struct CironPwdTable table;
+	struct PwdIndex index;
+	char (*sealed)[64];
+	const unsigned char *id;
+	unsigned long found;
+	double t0, linear_ns, index_ns;
+	int c;
+
+	while( (c = getopt(argc, argv, "n:")) != -1) {
+		switch(c) {
+		case 'n':
+			lookups = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n lookups]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if( (sealed = malloc(NIDS * sizeof(*sealed))) == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	printf("%8s %14s %14s\n", "entries", "linear ns/op", "index ns/op");
+	for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		n = sizes[s];
+		table.nentries = n;
+		if( (table.entries = calloc(n, sizeof(struct CironPwdTableEntry))) == NULL) {
+			perror("calloc");
+			return 1;
+		}
+		for(i = 0; i < n; i++) {
+			char *b = malloc(32);
+			table.entries[i].password_id_len = snprintf(b, 32, "tenant-%zu", i);
+			table.entries[i].password_id = (unsigned char *)b;
+			table.entries[i].password = (unsigned char *)"some-iron-password-of-32-bytes-x";
+			table.entries[i].password_len = 32;
+		}
+		for(i = 0; i < NIDS; i++) {
+			snprintf(sealed[i], sizeof(sealed[i]), "Fe26.2*tenant-%zu*c5bbd4ebb1c8e6f4*", (i * 7919) % n);
+		}
+		if(pwd_index_build(&index, &table, heap_alloc, NULL) != 0) {
+			perror("pwd_index_build");
+			return 1;
+		}
+
+		/* Fewer iterations for the scan, it does not need many to get stable */
+		found = 0;
+		t0 = now_ns();
+		for(k = 0; k < lookups / (n / 10 + 1) + 1; k++) {
+			const char *t = sealed[k % NIDS];
+			pwd_index_sealed_id((const unsigned char *)t, strlen(t), &id, &id_len);
+			found += linear_lookup(&table, id, id_len) != NULL;
+		}
+		linear_ns = (now_ns() - t0) / k;
+
+		t0 = now_ns();
+		for(k = 0; k < lookups; k++) {
+			const char *t = sealed[k % NIDS];
+			pwd_index_sealed_id((const unsigned char *)t, strlen(t), &id, &id_len);
+			found += pwd_index_lookup(&index, id, id_len) != NULL;
+		}
+		index_ns = (now_ns() - t0) / k;
+
+		printf("%8zu %14.1f %14.1f\n", n, linear_ns, index_ns);
+		if(found == 0) {
+			return 1;
+		}
+		for(i = 0; i < n; i++) {
+			free(table.entries[i].password_id);
+		}
+		free(table.entries);
+		free(index.slots);
+	}
+	free(sealed);
+	return 0;
+}
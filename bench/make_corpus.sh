@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Create a benchmark corpus of N requests (default 100) on stdout, using the
+# iron and hawk command line tools like the tests do. Tickets vary in client,
+# number of realms and algorithm so the corpus resembles real traffic.
+#
+# With BINARY=1, tickets are sealed in binary format (see ticket.h), which
+# requires ticket_encode to be built.
+#
+# Usage: IRON_PASSWORD_1=... [BINARY=1] ./make_corpus.sh [N] > corpus.txt
+
+N=${1:-100}
+HOST=${HOST:-localhost}
+PORT=${PORT:-80}
+
+if [ -z "$IRON_PASSWORD_1" ] ; then
+        echo "IRON_PASSWORD_1 must be set" >&2
+        exit 1
+fi
+
+ALGORITHMS=(sha256 sha1)
+METHODS=(GET GET GET POST DELETE)
+
+for i in $(seq 1 $N); do
+        ALG=${ALGORITHMS[$((i % 2))]}
+        METHOD=${METHODS[$((i % 5))]}
+        PWD="pwd-$RANDOM-$RANDOM-$i"
+        SCOPE='"test"'
+        for r in $(seq 1 $((i % 8))); do
+                SCOPE="$SCOPE,\"realm$r\""
+        done
+        RW=$([ $((i % 3)) -eq 0 ] && echo true || echo false)
+        TICKET="{\"client\":\"client$i\",\"user\":\"user$i\",\"owner\":\"owner$((i % 10))\",\"pwd\":\"$PWD\",\"scope\":[$SCOPE],\"rw\":$RW,\"exp\":4405688331,\"hawkAlgorithm\":\"$ALG\"}"
+        if [ -n "$BINARY" ] ; then
+                TOKEN=`echo -n "$TICKET" | ./ticket_encode | iron -i 1 -p $IRON_PASSWORD_1`
+        else
+                TOKEN=`echo -n "$TICKET" | iron -i 1 -p $IRON_PASSWORD_1`
+        fi
+        URLPATH="/protected/item/$i?page=$((i % 7))"
+        AUTHORIZATION=$(hawk -i $TOKEN -p "$PWD" -H $HOST -P "$URLPATH" -O $PORT -M $METHOD -a $ALG -m header)
+        printf '%s\t%s\t%s\n' "$METHOD" "$URLPATH" "$AUTHORIZATION"
+done
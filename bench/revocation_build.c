@@ -0,0 +1,88 @@
+/*
+ * Build a revocation file for dlg_auth_revocation_file (see revocation.h) from
+ * lines read from stdin:
+ *
+ *   client <client id>
+ *   ticket <sealed ticket, as sent in the Hawk id>
+ *
+ * Empty lines and lines starting with '#' are ignored. The file is written next
+ * to the target and renamed over it, so workers never see a partial file:
+ *
+ *   ./revocation_build /etc/nginx/revoked.bin < revoked.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "revocation.h"
+
+static int add(uint64_t **hashes, size_t *n, size_t *size, uint64_t h) {
+	uint64_t *p;
+
+	if(*n == *size) {
+		*size = (*size == 0) ? 1024 : *size * 2;
+		if( (p = realloc(*hashes, *size * sizeof(uint64_t))) == NULL) {
+			return -1;
+		}
+		*hashes = p;
+	}
+	(*hashes)[(*n)++] = h;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char line[16384];
+	char tmp[4096];
+	uint64_t *clients = NULL, *tickets = NULL, *buf;
+	size_t nclients = 0, ntickets = 0, sclients = 0, stickets = 0, len, lineno = 0;
+	FILE *out;
+	int rc;
+
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s <revocation file> < revoked.txt\n", argv[0]);
+		return 2;
+	}
+
+	while(fgets(line, sizeof(line), stdin) != NULL) {
+		lineno++;
+		len = strlen(line);
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if(len == 0 || line[0] == '#') {
+			continue;
+		}
+		if(strncmp(line, "client ", 7) == 0) {
+			rc = add(&clients, &nclients, &sclients, revocation_hash(REVOCATION_CLIENT, (unsigned char *) line + 7, len - 7));
+		} else if(strncmp(line, "ticket ", 7) == 0) {
+			rc = add(&tickets, &ntickets, &stickets, revocation_hash(REVOCATION_TICKET, (unsigned char *) line + 7, len - 7));
+		} else {
+			fprintf(stderr, "Line %zu: expected 'client <id>' or 'ticket <sealed ticket>'\n", lineno);
+			return 1;
+		}
+		if(rc != 0) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+	}
+
+	if( (buf = malloc(revocation_file_size(nclients, ntickets))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	len = revocation_build((unsigned char *) buf, clients, nclients, tickets, ntickets);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", argv[1]);
+	if( (out = fopen(tmp, "wb")) == NULL) {
+		perror(tmp);
+		return 1;
+	}
+	if(fwrite(buf, 1, len, out) != len || fclose(out) != 0) {
+		perror(tmp);
+		return 1;
+	}
+	if(rename(tmp, argv[1]) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	return 0;
+}
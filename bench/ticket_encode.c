@@ -0,0 +1,36 @@
+/*
+ * Convert a JSON ticket read from stdin to the binary ticket format (see ticket.h)
+ * and write it to stdout, e.g. to seal it with iron:
+ *
+ *   echo -n '{"client":"c","pwd":"p","scope":["test"],"exp":4405688331,"hawkAlgorithm":"sha256"}' | \
+ *       ./ticket_encode | iron -i 1 -p $IRON_PASSWORD_1
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <hawkc.h>
+#include "ticket.h"
+
+static void *heap_alloc(void *ctx, size_t size) {
+	return malloc(size);
+}
+
+int main(int argc, char **argv) {
+	char json[4096];
+	unsigned char bin[4096];
+	struct Ticket ticket;
+	TicketError e;
+	size_t len;
+
+	ticket_init(&ticket, heap_alloc, NULL);
+	len = fread(json, 1, sizeof(json), stdin);
+	if( (e = ticket_from_string(&ticket, json, len)) != OK) {
+		fprintf(stderr, "Unable to parse ticket: %s\n", ticket_strerror(e));
+		return 1;
+	}
+	if( (len = ticket_to_binary(&ticket, bin, sizeof(bin))) == 0) {
+		fprintf(stderr, "Unable to encode ticket\n");
+		return 1;
+	}
+	fwrite(bin, 1, len, stdout);
+	return 0;
+}
@@ -0,0 +1,267 @@
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include "hawkmac.h"
+
+#define HEADER_VERSION "hawk.1.header\n"
+
+/*
+ * Room for the base64 encoded HMAC of the largest digest, SHA-256.
+ */
+#define MAC_BUFFER_SIZE 64
+
+static void *mac_new(int sha256);
+static void mac_free(void *ctx);
+static int mac_init(void *ctx, int sha256, const unsigned char *key, size_t key_len);
+static int mac_update(void *ctx, const unsigned char *data, size_t len);
+static int mac_final(void *ctx, unsigned char *md, size_t *md_len);
+static int update_line(void *ctx, const unsigned char *data, size_t len);
+static int update_ext(void *ctx, const unsigned char *data, size_t len);
+static const char *check(HawkMac mac, HawkcAlgorithm algorithm, char *expected);
+
+int hawkmac_init(HawkMac mac) {
+	mac->sha1_algorithm = hawkc_algorithm_by_name("sha1", 4);
+	mac->sha256_algorithm = hawkc_algorithm_by_name("sha256", 6);
+	mac->sha1 = mac_new(0);
+	mac->sha256 = mac_new(1);
+	if(mac->sha1 == NULL || mac->sha256 == NULL) {
+		hawkmac_free(mac);
+		return -1;
+	}
+	return 0;
+}
+
+void hawkmac_free(HawkMac mac) {
+	if(mac->sha1 != NULL) {
+		mac_free(mac->sha1);
+		mac->sha1 = NULL;
+	}
+	if(mac->sha256 != NULL) {
+		mac_free(mac->sha256);
+		mac->sha256 = NULL;
+	}
+}
+
+HawkMacError hawkmac_validate(HawkMac mac, HawkcAlgorithm algorithm, const unsigned char *key, size_t key_len,
+		HawkMacRequest request, struct AuthorizationHeader *header, int *valid) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned char encoded[MAC_BUFFER_SIZE];
+	unsigned char ts[32];
+	size_t md_len;
+	size_t encoded_len;
+	void *ctx;
+	int sha256;
+
+	if(algorithm == NULL || key_len == 0) {
+		return HAWKMAC_UNSUPPORTED;
+	}
+	if(algorithm == mac->sha256_algorithm) {
+		ctx = mac->sha256;
+		sha256 = 1;
+	} else if(algorithm == mac->sha1_algorithm) {
+		ctx = mac->sha1;
+		sha256 = 0;
+	} else {
+		return HAWKMAC_UNSUPPORTED;
+	}
+
+	/*
+	 * Normalized request string, see the Hawk specification. Empty lines for the
+	 * payload hash and ext if the header has none.
+	 */
+	if(!mac_init(ctx, sha256, key, key_len)
+			|| !mac_update(ctx, (unsigned char *) HEADER_VERSION, sizeof(HEADER_VERSION) - 1)
+			|| !update_line(ctx, ts, hawkc_ttoa(ts, header->ts))
+			|| !update_line(ctx, header->nonce.data, header->nonce.len)
+			|| !update_line(ctx, request->method.data, request->method.len)
+			|| !update_line(ctx, request->path.data, request->path.len)
+			|| !update_line(ctx, request->host.data, request->host.len)
+			|| !update_line(ctx, request->port.data, request->port.len)
+			|| !update_line(ctx, header->hash.data, header->hash.len)
+			|| !update_ext(ctx, header->ext.data, header->ext.len)
+			|| !mac_final(ctx, md, &md_len)) {
+		return HAWKMAC_ERROR;
+	}
+
+	encoded_len = (size_t) EVP_EncodeBlock(encoded, md, (int) md_len);
+	*valid = header->mac.len == encoded_len && CRYPTO_memcmp(header->mac.data, encoded, encoded_len) == 0;
+	return HAWKMAC_OK;
+}
+
+const char *hawkmac_self_test(HawkMac mac) {
+	const char *msg;
+
+	if( (msg = check(mac, mac->sha256_algorithm, "6R4rV5iE+NPoym+WwjeHzjAGXUtLNIxmo1vpMofpLAE=")) != NULL) {
+		return msg;
+	}
+	return check(mac, mac->sha1_algorithm, "KqOejc9yo2NAQlM29iSeYQEzwmE=");
+}
+
+/*
+ * Validate the request of the Hawk specification example with the expected mac
+ * and with the mac altered in its first character.
+ */
+static const char *check(HawkMac mac, HawkcAlgorithm algorithm, char *expected) {
+	static char *key = "werxhqb98rpaxn39848xrunpaw3489ruxnpa98w4rxn";
+	struct HawkMacRequest request;
+	struct AuthorizationHeader header;
+	char wrong[MAC_BUFFER_SIZE];
+	int valid;
+
+	request.method.data = (unsigned char *) "GET";
+	request.method.len = 3;
+	request.path.data = (unsigned char *) "/resource/1?b=1&a=2";
+	request.path.len = 19;
+	request.host.data = (unsigned char *) "example.com";
+	request.host.len = 11;
+	request.port.data = (unsigned char *) "8000";
+	request.port.len = 4;
+
+	memset(&header, 0, sizeof(header));
+	header.ts = 1353832234;
+	header.nonce.data = (unsigned char *) "j4h3g2";
+	header.nonce.len = 6;
+	header.ext.data = (unsigned char *) "some-app-ext-data";
+	header.ext.len = 17;
+	header.mac.data = (unsigned char *) expected;
+	header.mac.len = strlen(expected);
+
+	if(hawkmac_validate(mac, algorithm, (unsigned char *) key, strlen(key), &request, &header, &valid) != HAWKMAC_OK) {
+		return "unable to calculate HMAC";
+	}
+	if(!valid) {
+		return "HMAC of the Hawk example does not match";
+	}
+
+	strcpy(wrong, expected);
+	wrong[0] = (wrong[0] == 'A') ? 'B' : 'A';
+	header.mac.data = (unsigned char *) wrong;
+	if(hawkmac_validate(mac, algorithm, (unsigned char *) key, strlen(key), &request, &header, &valid) != HAWKMAC_OK) {
+		return "unable to calculate HMAC";
+	}
+	if(valid) {
+		return "altered mac of the Hawk example is accepted";
+	}
+	return NULL;
+}
+
+static int update_line(void *ctx, const unsigned char *data, size_t len) {
+	return (len == 0 || mac_update(ctx, data, len)) && mac_update(ctx, (unsigned char *) "\n", 1);
+}
+
+/*
+ * Like update_line, but with backslashes and newlines escaped.
+ */
+static int update_ext(void *ctx, const unsigned char *data, size_t len) {
+	size_t i;
+	size_t start;
+
+	start = 0;
+	for(i = 0; i < len; i++) {
+		if(data[i] != '\\' && data[i] != '\n') {
+			continue;
+		}
+		if(i > start && !mac_update(ctx, data + start, i - start)) {
+			return 0;
+		}
+		if(!mac_update(ctx, (unsigned char *) ((data[i] == '\\') ? "\\\\" : "\\n"), 2)) {
+			return 0;
+		}
+		start = i + 1;
+	}
+	return update_line(ctx, data + start, len - start);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+/*
+ * The digest is set once here, mac_init then only sets the key.
+ */
+static void *mac_new(int sha256) {
+	OSSL_PARAM params[2];
+	EVP_MAC *mac;
+	EVP_MAC_CTX *ctx;
+
+	if( (mac = EVP_MAC_fetch(NULL, "HMAC", NULL)) == NULL) {
+		return NULL;
+	}
+	ctx = EVP_MAC_CTX_new(mac);
+	/* The context keeps its own reference */
+	EVP_MAC_free(mac);
+	if(ctx == NULL) {
+		return NULL;
+	}
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, sha256 ? "SHA256" : "SHA1", 0);
+	params[1] = OSSL_PARAM_construct_end();
+	if(!EVP_MAC_CTX_set_params(ctx, params)) {
+		EVP_MAC_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void mac_free(void *ctx) {
+	EVP_MAC_CTX_free(ctx);
+}
+
+static int mac_init(void *ctx, int sha256, const unsigned char *key, size_t key_len) {
+	return EVP_MAC_init(ctx, key, key_len, NULL);
+}
+
+static int mac_update(void *ctx, const unsigned char *data, size_t len) {
+	return EVP_MAC_update(ctx, data, len);
+}
+
+static int mac_final(void *ctx, unsigned char *md, size_t *md_len) {
+	return EVP_MAC_final(ctx, md, md_len, EVP_MAX_MD_SIZE);
+}
+
+#else
+
+static void *mac_new(int sha256) {
+	HMAC_CTX *ctx;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ctx = HMAC_CTX_new();
+#else
+	if( (ctx = OPENSSL_malloc(sizeof(HMAC_CTX))) != NULL) {
+		HMAC_CTX_init(ctx);
+	}
+#endif
+	return ctx;
+}
+
+static void mac_free(void *ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	HMAC_CTX_free(ctx);
+#else
+	HMAC_CTX_cleanup(ctx);
+	OPENSSL_free(ctx);
+#endif
+}
+
+static int mac_init(void *ctx, int sha256, const unsigned char *key, size_t key_len) {
+	return HMAC_Init_ex(ctx, key, (int) key_len, sha256 ? EVP_sha256() : EVP_sha1(), NULL);
+}
+
+static int mac_update(void *ctx, const unsigned char *data, size_t len) {
+	return HMAC_Update(ctx, data, len);
+}
+
+static int mac_final(void *ctx, unsigned char *md, size_t *md_len) {
+	unsigned int len;
+
+	if(!HMAC_Final(ctx, md, &len)) {
+		return 0;
+	}
+	*md_len = len;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef NGX_DLG_AUTH_HAWKMAC_H
+#define NGX_DLG_AUTH_HAWKMAC_H
+
+#include <stddef.h>
+#include <hawkc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Validation of Hawk request signatures through OpenSSL, an alternative to
+ * hawkc_validate_hmac.
+ *
+ * hawkc sets up a new HMAC context for every signature, which with OpenSSL 3
+ * also means fetching the digest implementation. A HawkMac keeps one HMAC
+ * context per algorithm and only sets the key for every request, so what is
+ * left is the hashing itself, done by libcrypto with the SHA extensions of the
+ * CPU where available. The normalized request string is fed to the HMAC piece
+ * by piece instead of being built in a buffer.
+ *
+ * A HawkMac must not be used by several threads at once.
+ */
+typedef struct HawkMac {
+	/* HMAC contexts, EVP_MAC_CTX with OpenSSL 3 and HMAC_CTX before */
+	void *sha1;
+	void *sha256;
+	/* Algorithms as returned by hawkc_algorithm_by_name */
+	HawkcAlgorithm sha1_algorithm;
+	HawkcAlgorithm sha256_algorithm;
+} *HawkMac;
+
+/*
+ * Request data that goes into the signature besides the Authorization header.
+ */
+typedef struct HawkMacRequest {
+	HawkcString method;
+	HawkcString path;
+	HawkcString host;
+	HawkcString port;
+} *HawkMacRequest;
+
+typedef enum {
+	HAWKMAC_OK,
+	/* Algorithm or key not handled here, use hawkc_validate_hmac */
+	HAWKMAC_UNSUPPORTED,
+	/* libcrypto failed */
+	HAWKMAC_ERROR
+} HawkMacError;
+
+/*
+ * Allocate the HMAC contexts. Returns 0 on success, -1 if libcrypto fails, in
+ * which case nothing needs to be freed.
+ */
+int hawkmac_init(HawkMac mac);
+
+void hawkmac_free(HawkMac mac);
+
+/*
+ * Validate the mac of the parsed Authorization header against the HMAC of
+ * the request, keyed with the password of the ticket. Sets valid to 1 or 0.
+ */
+HawkMacError hawkmac_validate(HawkMac mac, HawkcAlgorithm algorithm, const unsigned char *key, size_t key_len,
+		HawkMacRequest request, struct AuthorizationHeader *header, int *valid);
+
+/*
+ * Check the contexts against the example of the Hawk specification and its
+ * SHA-1 counterpart, including that a wrong mac is rejected. Returns NULL if
+ * all is well, a message describing the failure otherwise.
+ */
+const char *hawkmac_self_test(HawkMac mac);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
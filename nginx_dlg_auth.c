@@ -9,23 +9,23 @@
 #include <hawkc.h>
 #include <ciron.h>
 #include "ticket.h"
+#include "pwdindex.h"
+#if (NGX_DLG_AUTH_OPENSSL)
+#include "hawkmac.h"
+#endif
 
 #include "nginx_dlg_auth.h"
 #include "nginx_dlg_auth_var.h"
+#include "nginx_dlg_auth_cache.h"
+#include "nginx_dlg_auth_nonce.h"
+#include "nginx_dlg_auth_negative.h"
+#include "nginx_dlg_auth_stats.h"
+#include "nginx_dlg_auth_pwd.h"
+#include "nginx_dlg_auth_revocation.h"
+#include "nginx_dlg_auth_limit.h"
+#include "nginx_dlg_auth_rejection.h"
 
 
-/*
- * ciron user-provided buffer sizes. The size has been determined by using
- * some usual tickets, observing the required sizes and then adding a fair amount of
- * space. E.g. Having seen 350 bytes required I choose 1024 for the buffer.
- *
- * We do size checking before using the buffer and report an error if the buffer
- * sizes below are exceeded. More requirement for space rather indicates an attack,
- * than normal use.
- */
-#define ENCRYPTION_BUFFER_SIZE 1024
-#define OUTPUT_BUFFER_SIZE 512
-
 /*
  * We differentiate tickets that grant access to only-safe and safe and
  * unsafe HTTP methods.
@@ -38,59 +38,143 @@
 		((m) == NGX_HTTP_PROPFIND) \
 		))
 
-#define MAX_PWD_TAB_ENTRIES 100
-
 /*
- * Module per-location configuration.
+ * Size of the error message buffer of ngx_http_dlg_auth_state_t.
  */
-typedef struct {
-	/* Authentication realm a given ticket must grant access to */
-    ngx_str_t realm;
-
-    /* iron password to unseal received access tickets. */
-    ngx_str_t iron_password;
-
-    /* iron password table for password rotation */
-    struct CironPwdTableEntry pwd_table_entries[MAX_PWD_TAB_ENTRIES];
-    struct CironPwdTable pwd_table;
+#define ERROR_MESSAGE_SIZE 512
 
-    /* Allowed skew when comparing request timestamp with our own clock */
-    ngx_uint_t allowed_clock_skew;
-
-    /* Host to use for signature validation instead of request host */
-    ngx_str_t  host;
-
-    /* Port to use for signature validation instead of request port */
-    ngx_str_t  port;
-
-} ngx_http_dlg_auth_loc_conf_t;
+/*
+ * Upper limit of dlg_auth_connection_ticket_cache. Connection caches are
+ * searched linearly.
+ */
+#define MAX_CONNECTION_CACHE_SIZE 64
 
+/*
+ * State of the authentication of a request, from the parsed Authorization header
+ * to the unsealed ticket. It lives on the stack of the access handler or, if the
+ * ticket is unsealed in a thread pool, in the context of the thread task.
+ *
+ * Unsealing and signature validation only use this state, never the request
+ * (other than reading its headers), so they can run in a thread. They leave
+ * their error messages here to be logged by ngx_dlg_auth_finish.
+ */
+struct ngx_http_dlg_auth_state_s {
+	ngx_http_dlg_auth_loc_conf_t *conf;
+	ngx_http_request_t *request;
+	ngx_http_dlg_auth_timer_t *timer;
+	struct HawkcContext hawkc_ctx;
+	struct Ticket ticket;
+	time_t now;
+	/* Key of the passwords in the ticket and negative caches */
+	uint32_t pwd_key;
+	/* Passwords of the location's table, read once per request */
+	ngx_http_dlg_auth_pwds_t *pwds;
+	/* Revoked clients and tickets, read once per request, NULL if none */
+	ngx_http_dlg_auth_revocations_t *revocations;
+	/* Rejection counters, NULL to log every rejection */
+	ngx_http_dlg_auth_rejection_log_t *rejection_log;
+#if (NGX_DLG_AUTH_OPENSSL)
+	/* HMAC contexts of the worker, NULL to validate signatures with hawkc */
+	HawkMac hawkmac;
+#endif
+	/* Result of unsealing, NGX_DECLINED if the ticket came from the cache */
+	ngx_int_t unseal_rc;
+	/* Result of the early grants check, NGX_DECLINED if not done yet */
+	ngx_int_t grants_rc;
+	/* Result of signature validation, NGX_DECLINED if not done yet */
+	ngx_int_t hmac_rc;
+	/* Whether the request method needs a ticket granting rw */
+	ngx_flag_t unsafe;
+	/* Error message to log, none if error_len is 0 */
+	u_char error[ERROR_MESSAGE_SIZE];
+	size_t error_len;
+#if (NGX_THREADS)
+	/* Whether the thread task has not completed yet */
+	ngx_flag_t posted;
+	/* Pool for the realms of tickets unsealed in a thread, created on demand */
+	ngx_pool_t *pool;
+	ngx_http_dlg_auth_timer_t task_timer;
+#endif
+	/* Buffer for the unsealed (or cached) ticket */
+	unsigned char output_buffer[TICKET_BUFFER_SIZE];
+};
 
 /*
  * Functions for configuration handling
  */
+static char * ngx_http_dlg_auth_realm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char * ngx_http_dlg_auth_iron_passwd(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_http_dlg_auth_iron_pwd_table(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char * ngx_http_dlg_auth_iron_pwd_table_entry(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
 static ngx_int_t ngx_http_dlg_auth_init(ngx_conf_t *cf);
+static void *ngx_http_dlg_auth_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_dlg_auth_init_main_conf(ngx_conf_t *cf, void *conf);
+static ngx_int_t ngx_http_dlg_auth_init_process(ngx_cycle_t *cycle);
+static void ngx_http_dlg_auth_exit_process(ngx_cycle_t *cycle);
 static void *ngx_http_dlg_auth_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static int is_digits_only(ngx_str_t *str);
+static uint32_t pwd_fingerprint(ngx_http_dlg_auth_loc_conf_t *conf);
+static ngx_http_dlg_auth_pwd_table_t *add_pwd_table(ngx_conf_t *cf, ngx_http_dlg_auth_main_conf_t *mcf, ngx_str_t *name, ngx_array_t *entries);
+static ngx_int_t resolve_pwd_table(ngx_conf_t *cf, ngx_http_dlg_auth_loc_conf_t *conf);
+static char * ngx_http_dlg_auth_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_http_dlg_auth_realms_t *compile_realms(ngx_conf_t *cf, ngx_array_t *args);
+static ngx_int_t cmp_realm_hash(const void *a, const void *b);
 /*
  * Functions for request processing
  */
 static ngx_int_t ngx_dlg_auth_handler(ngx_http_request_t *r);
-static ngx_int_t ngx_dlg_auth_authenticate(ngx_http_request_t *r,ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_dlg_auth_ctx_t *ctx);
+static ngx_int_t ngx_dlg_auth_authenticate(ngx_http_request_t *r,ngx_http_dlg_auth_loc_conf_t *conf,
+		ngx_http_dlg_auth_timer_t *timer);
+static ngx_int_t ngx_dlg_auth_finish(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_authorize(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_dlg_auth_ctx_t *ctx,
+		time_t now);
+static ngx_int_t ngx_dlg_auth_limit(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_dlg_auth_ctx_t *ctx);
+static ngx_http_dlg_auth_ctx_t *ngx_dlg_auth_retain_ticket(ngx_http_request_t *r, Ticket ticket);
+static ngx_http_dlg_auth_ctx_t *ngx_dlg_auth_find_verdict(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf);
+static void ngx_dlg_auth_ctx_cleanup(void *data);
+static ngx_int_t ngx_dlg_auth_parse_header(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, HawkcContext hawkc_ctx);
+static void ngx_dlg_auth_unseal_and_validate(ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_check_length(ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_unseal_ticket(ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_check_grants(ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_validate_hmac(ngx_http_dlg_auth_state_t *st);
+static ngx_int_t ngx_dlg_auth_hawkc(ngx_http_dlg_auth_state_t *st, int *valid);
+#if (NGX_DLG_AUTH_OPENSSL)
+static ngx_int_t ngx_dlg_auth_hawkmac(ngx_http_dlg_auth_state_t *st, int *valid);
+#endif
+static ngx_int_t ngx_dlg_auth_error(ngx_http_dlg_auth_state_t *st, ngx_int_t rc, ngx_uint_t reason, const char *fmt, ...);
+static void ngx_dlg_auth_log_error(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st);
+static void ngx_dlg_auth_reject(ngx_http_request_t *r, ngx_uint_t reason, const char *fmt, ...);
+#if (NGX_THREADS)
+static ngx_int_t ngx_dlg_auth_post_task(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st);
+static void ngx_dlg_auth_task_handler(void *data, ngx_log_t *log);
+static void ngx_dlg_auth_task_done(ngx_event_t *ev);
+static void *ngx_dlg_auth_task_alloc(void *data, size_t size);
+static void ngx_dlg_auth_task_cleanup(void *data);
+#endif
 static void ngx_dlg_auth_rename_authorization_header(ngx_http_request_t *r);
 static ngx_int_t ngx_dlg_auth_send_simple_401(ngx_http_request_t *r, ngx_str_t *realm);
 static ngx_int_t ngx_dlg_auth_send_401(ngx_http_request_t *r, HawkcContext hawkc_ctx);
 static void determine_host_and_port(ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_request_t *r,ngx_str_t *host, ngx_str_t *port);
 static void get_host_and_port(ngx_http_request_t *r,ngx_str_t host_header, ngx_str_t *host, ngx_str_t *port);
+static void *ngx_dlg_auth_pool_alloc(void *pool, size_t size);
+static int ngx_dlg_auth_has_realm(ngx_http_dlg_auth_realms_t *realms, HawkcString *ticket_realms, uint32_t *hashes,
+		size_t nrealms);
 
 /*
- * Functions for variable setting.
+ * Password table passed to ciron for locations with a single password.
  */
-ngx_int_t store_client(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx,Ticket ticket);
-ngx_int_t store_expires(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx,Ticket ticket);
-ngx_int_t store_clockskew(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx, time_t clockskew);
+static struct CironPwdTable no_pwd_table = { 0, NULL };
+
+#if (NGX_DLG_AUTH_OPENSSL)
+/*
+ * HMAC contexts of the worker process, NULL if they could not be set up or
+ * failed the self-test.
+ */
+static struct HawkMac worker_hawkmac_ctx;
+static HawkMac worker_hawkmac = NULL;
+#endif
 
 /*
  * The configuration directives
@@ -99,10 +183,10 @@ static ngx_command_t ngx_dlg_auth_commands[] = {
 
 	{ ngx_string("dlg_auth"),
 	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LMT_CONF
-	                       |NGX_CONF_TAKE1,
-      ngx_conf_set_str_slot,
+	                       |NGX_CONF_1MORE,
+	  ngx_http_dlg_auth_realm,
 	  NGX_HTTP_LOC_CONF_OFFSET,
-	  offsetof(ngx_http_dlg_auth_loc_conf_t, realm),
+	  0,
 	  NULL },
 
 	{ ngx_string("dlg_auth_iron_pwd"),
@@ -113,6 +197,34 @@ static ngx_command_t ngx_dlg_auth_commands[] = {
 	  0,
 	  NULL },
 
+	{ ngx_string("dlg_auth_iron_pwd_table"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+	  ngx_http_dlg_auth_iron_pwd_table,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dlg_auth_iron_pwd_file"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE23,
+	  ngx_http_dlg_auth_iron_pwd_file,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dlg_auth_revocation_file"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	  ngx_http_dlg_auth_revocation_file,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
+	{ ngx_string("dlg_auth_rejection_log"),
+	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+	  ngx_http_dlg_auth_rejection_log,
+	  NGX_HTTP_MAIN_CONF_OFFSET,
+	  0,
+	  NULL },
+
 	  { ngx_string("dlg_auth_allowed_clock_skew"),
 	        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
 	        ngx_conf_set_num_slot,
@@ -136,6 +248,68 @@ static ngx_command_t ngx_dlg_auth_commands[] = {
     	  offsetof(ngx_http_dlg_auth_loc_conf_t, port),
     	  NULL },
 
+    { ngx_string("dlg_auth_worker_ticket_cache"),
+    	  NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    	  ngx_conf_set_num_slot,
+    	  NGX_HTTP_MAIN_CONF_OFFSET,
+    	  offsetof(ngx_http_dlg_auth_main_conf_t, worker_ticket_cache_size),
+    	  NULL },
+
+    { ngx_string("dlg_auth_ticket_cache"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_TAKE12,
+    	  ngx_http_dlg_auth_ticket_cache,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  0,
+    	  NULL },
+
+    { ngx_string("dlg_auth_connection_ticket_cache"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_TAKE1,
+    	  ngx_conf_set_num_slot,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  offsetof(ngx_http_dlg_auth_loc_conf_t, connection_cache_size),
+    	  NULL },
+
+    { ngx_string("dlg_auth_nonce_cache"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_TAKE1,
+    	  ngx_http_dlg_auth_nonce_cache,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  offsetof(ngx_http_dlg_auth_loc_conf_t, nonce_cache),
+    	  NULL },
+
+    { ngx_string("dlg_auth_negative_cache"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_TAKE12,
+    	  ngx_http_dlg_auth_negative_cache,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  offsetof(ngx_http_dlg_auth_loc_conf_t, negative_cache),
+    	  NULL },
+
+    { ngx_string("dlg_auth_limit"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_1MORE,
+    	  ngx_http_dlg_auth_limit,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  0,
+    	  NULL },
+
+    { ngx_string("dlg_auth_thread_pool"),
+    	  NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+    	                       |NGX_CONF_TAKE1,
+    	  ngx_http_dlg_auth_thread_pool,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  0,
+    	  NULL },
+
+    { ngx_string("dlg_auth_status"),
+    	  NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    	  ngx_http_dlg_auth_status,
+    	  NGX_HTTP_LOC_CONF_OFFSET,
+    	  0,
+    	  NULL },
+
     ngx_null_command /* command termination */
 };
 
@@ -146,8 +320,8 @@ static ngx_http_module_t  nginx_dlg_auth_module_ctx = {
 	ngx_http_auth_dlg_add_variables,     /* preconfiguration */
     ngx_http_dlg_auth_init,              /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_dlg_auth_create_main_conf,  /* create main configuration */
+    ngx_http_dlg_auth_init_main_conf,    /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -166,15 +340,56 @@ ngx_module_t  nginx_dlg_auth_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_dlg_auth_init_process,        /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_dlg_auth_exit_process,        /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
 
+/*
+ * Parse the dlg_auth directive: 'off' or one or more realms, where a trailing
+ * '*' makes a realm a prefix pattern. The realms are compiled during merge.
+ */
+static char * ngx_http_dlg_auth_realm(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_loc_conf_t  *lcf;
+	ngx_str_t *value, *arg;
+	ngx_uint_t i;
+
+	lcf = conf;
+	value = cf->args->elts;
+
+	if(lcf->realm.data != NULL) {
+		return "is duplicate";
+	}
+	lcf->realm = value[1];
+
+	if(value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		if(cf->args->nelts > 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth off must not be combined with realms");
+			return NGX_CONF_ERROR;
+		}
+		return NGX_CONF_OK;
+	}
+
+	if( (lcf->realm_args = ngx_array_create(cf->pool, cf->args->nelts - 1, sizeof(ngx_str_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	for(i = 1; i < cf->args->nelts; i++) {
+		if(value[i].len == 0 || ngx_strlchr(value[i].data, value[i].data + value[i].len - 1, '*') != NULL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid realm \"%V\", '*' is only allowed at the end of a realm", &(value[i]));
+			return NGX_CONF_ERROR;
+		}
+		if( (arg = ngx_array_push(lcf->realm_args)) == NULL) {
+			return NGX_CONF_ERROR;
+		}
+		*arg = value[i];
+	}
+	return NGX_CONF_OK;
+}
+
 /*
  * This function handles the dlg_auth_iron_pwd directive. If a single value
  * is supplied, it is interpreted as the single password used for sealing,
@@ -186,19 +401,31 @@ ngx_module_t  nginx_dlg_auth_module = {
 static char * ngx_http_dlg_auth_iron_passwd(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
 	ngx_http_dlg_auth_loc_conf_t  *lcf;
     ngx_str_t *value;
+    struct CironPwdTableEntry *entry;
 
 	lcf = conf;
     value = cf->args->elts;
 
+    /*
+     * Named password table case.
+     */
+    if(cf->args->nelts == 2 && value[1].len > 6 && ngx_strncmp(value[1].data, "table=", 6) == 0) {
+    	if(lcf->iron_password.len != 0 || lcf->pwd_entries != NULL || lcf->pwd_table_name.len != 0) {
+    		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd directive does not allow mixed use of password tables and single password");
+    		return NGX_CONF_ERROR;
+    	}
+    	/* Resolved during merge, tables may be defined after their use */
+    	lcf->pwd_table_name.data = value[1].data + 6;
+    	lcf->pwd_table_name.len = value[1].len - 6;
     /*
      * Single password case.
      */
-    if(cf->args->nelts == 2) {
+    } else if(cf->args->nelts == 2) {
     	if(lcf->iron_password.len != 0) {
     		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd directive must not be used more than once for setting single password");
     		return NGX_CONF_ERROR;
     	}
-    	if(lcf->pwd_table.nentries != 0) {
+    	if(lcf->pwd_entries != NULL || lcf->pwd_table_name.len != 0) {
     		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd directive does not allow mixed use of password table and single password");
     		return NGX_CONF_ERROR;
     	}
@@ -208,22 +435,23 @@ static char * ngx_http_dlg_auth_iron_passwd(ngx_conf_t *cf, ngx_command_t *cmd,
      * Password table entry case.
      */
     } else if(cf->args->nelts == 3) {
-    	int i;
-    	if(lcf->iron_password.len != 0) {
+    	if(lcf->iron_password.len != 0 || lcf->pwd_table_name.len != 0) {
     		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd directive does not allow mixed use of password table and single password");
     		return NGX_CONF_ERROR;
     	}
-    	if(lcf->pwd_table.nentries == MAX_PWD_TAB_ENTRIES) {
-    		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Too many dlg_auth_iron_pwd directives, please use less id/password pairs");
+    	if(lcf->pwd_entries == NULL) {
+    		if( (lcf->pwd_entries = ngx_array_create(cf->pool, 4, sizeof(struct CironPwdTableEntry))) == NULL) {
+    			return NGX_CONF_ERROR;
+    		}
+    	}
+    	if( (entry = ngx_array_push(lcf->pwd_entries)) == NULL) {
     		return NGX_CONF_ERROR;
     	}
-    	i = lcf->pwd_table.nentries;
     	/* value[1] is password ID, value[2] is password */
-    	lcf->pwd_table.entries[i].password_id_len = value[1].len;
-    	lcf->pwd_table.entries[i].password_id = value[1].data;
-    	lcf->pwd_table.entries[i].password_len = value[2].len;
-    	lcf->pwd_table.entries[i].password = value[2].data;
-    	lcf->pwd_table.nentries++;
+    	entry->password_id_len = value[1].len;
+    	entry->password_id = value[1].data;
+    	entry->password_len = value[2].len;
+    	entry->password = value[2].data;
     } else {
     	/* Should never be here because nginx enforces NGX_CONF_TAKE12 */
    		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd directive takes only one or two arguments");
@@ -232,6 +460,103 @@ static char * ngx_http_dlg_auth_iron_passwd(ngx_conf_t *cf, ngx_command_t *cmd,
     return NGX_CONF_OK;
 }
 
+/*
+ * Parse a named password table:
+ *
+ *     dlg_auth_iron_pwd_table <name> {
+ *         <passwordID> <password>;
+ *         ...
+ *     }
+ */
+static char * ngx_http_dlg_auth_iron_pwd_table(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_main_conf_t  *mcf;
+	ngx_array_t *entries;
+	ngx_str_t *value;
+	ngx_conf_t save;
+	char *rv;
+
+	mcf = conf;
+	value = cf->args->elts;
+
+	if(ngx_http_dlg_auth_find_pwd_table(mcf, &(value[1])) != NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Duplicate password table \"%V\"", &(value[1]));
+		return NGX_CONF_ERROR;
+	}
+
+	if( (entries = ngx_array_create(cf->pool, 8, sizeof(struct CironPwdTableEntry))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	save = *cf;
+	cf->handler = ngx_http_dlg_auth_iron_pwd_table_entry;
+	cf->handler_conf = (char *) entries;
+	rv = ngx_conf_parse(cf, NULL);
+	*cf = save;
+	if(rv != NGX_CONF_OK) {
+		return rv;
+	}
+
+	if(entries->nelts == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd_table \"%V\" is empty", &(value[1]));
+		return NGX_CONF_ERROR;
+	}
+	if(add_pwd_table(cf, mcf, &(value[1]), entries) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	return NGX_CONF_OK;
+}
+
+/*
+ * Parse a <passwordID> <password> line of a dlg_auth_iron_pwd_table block.
+ */
+static char * ngx_http_dlg_auth_iron_pwd_table_entry(ngx_conf_t *cf, ngx_command_t *dummy, void *conf) {
+	ngx_array_t *entries = conf;
+	struct CironPwdTableEntry *entry;
+	ngx_str_t *value;
+
+	value = cf->args->elts;
+	if(cf->args->nelts != 2) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_iron_pwd_table entries must be <passwordID> <password>");
+		return NGX_CONF_ERROR;
+	}
+	if( (entry = ngx_array_push(entries)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	entry->password_id_len = value[0].len;
+	entry->password_id = value[0].data;
+	entry->password_len = value[1].len;
+	entry->password = value[1].data;
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Parse 'dlg_auth_thread_pool <name> | off'. The pool is defined by the
+ * thread_pool directive, or is nginx's 'default' pool.
+ */
+static char * ngx_http_dlg_auth_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+#if (NGX_THREADS)
+	ngx_http_dlg_auth_loc_conf_t *alcf = conf;
+	ngx_str_t *value;
+
+	if(alcf->thread_pool != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+	if(value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		alcf->thread_pool = NULL;
+		return NGX_CONF_OK;
+	}
+	if( (alcf->thread_pool = ngx_thread_pool_add(cf, &value[1])) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	return NGX_CONF_OK;
+#else
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_thread_pool requires nginx to be built with --with-threads");
+	return NGX_CONF_ERROR;
+#endif
+}
+
 /*
  * Initialization function to register handler to
  * nginx access phase.
@@ -241,15 +566,114 @@ static ngx_int_t ngx_http_dlg_auth_init(ngx_conf_t *cf) {
     ngx_http_handler_pt        *h;
     ngx_http_core_main_conf_t  *cmcf;
 
-    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
-    if( (h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers)) == NULL) {
+    ngx_http_dlg_auth_main_conf_t  *mcf;
+
+    /*
+     * Only add the handler if some location enables dlg_auth, so that
+     * servers not using it do not pay for it on every request.
+     */
+    mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+    if(mcf->enabled) {
+        cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+        if( (h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers)) == NULL) {
+            return NGX_ERROR;
+        }
+        *h = ngx_dlg_auth_handler;
+    }
+
+    return ngx_http_dlg_auth_stats_init(cf);
+}
+
+/*
+ * Allocate main config
+ */
+static void *ngx_http_dlg_auth_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_dlg_auth_main_conf_t  *conf;
+
+    if( (conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_main_conf_t))) == NULL) {
+        return NULL;
+    }
+    conf->worker_ticket_cache_size = NGX_CONF_UNSET_UINT;
+    if(ngx_array_init(&conf->realms, cf->pool, 4, sizeof(ngx_str_t)) != NGX_OK) {
+        return NULL;
+    }
+    if(ngx_array_init(&conf->pwd_tables, cf->pool, 4, sizeof(ngx_http_dlg_auth_pwd_table_t *)) != NGX_OK) {
+        return NULL;
+    }
+
+    return conf;
+}
+
+/*
+ * Set main config defaults.
+ */
+static char *ngx_http_dlg_auth_init_main_conf(ngx_conf_t *cf, void *vconf) {
+    ngx_http_dlg_auth_main_conf_t  *conf = (ngx_http_dlg_auth_main_conf_t*)vconf;
+
+    /* Default to 256 per worker cache entries */
+    ngx_conf_init_uint_value(conf->worker_ticket_cache_size, 256);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Set up per worker process state.
+ */
+static ngx_int_t ngx_http_dlg_auth_init_process(ngx_cycle_t *cycle) {
+    ngx_http_dlg_auth_main_conf_t  *conf;
+#if (NGX_DLG_AUTH_OPENSSL)
+    const char *msg;
+#endif
+
+    if( (conf = ngx_http_cycle_get_module_main_conf(cycle, nginx_dlg_auth_module)) == NULL) {
+        return NGX_OK;
+    }
+#if (NGX_DLG_AUTH_OPENSSL)
+    /*
+     * Never validate signatures with contexts that get the Hawk example wrong,
+     * hawkc still does the job.
+     */
+    if(hawkmac_init(&worker_hawkmac_ctx) != 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0, "Unable to set up OpenSSL HMAC contexts, validating signatures with hawkc");
+    } else if( (msg = hawkmac_self_test(&worker_hawkmac_ctx)) != NULL) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0, "OpenSSL HMAC self-test failed: %s, validating signatures with hawkc", msg);
+        hawkmac_free(&worker_hawkmac_ctx);
+    } else {
+        worker_hawkmac = &worker_hawkmac_ctx;
+    }
+#endif
+    if(ngx_http_dlg_auth_cache_init_worker(cycle, conf->worker_ticket_cache_size) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Unable to allocate per worker ticket cache, continuing without it");
+    }
+    if(ngx_http_dlg_auth_pwd_file_init_worker(cycle, conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    if(ngx_http_dlg_auth_rejection_init_worker(cycle, conf->rejection_log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    if(ngx_http_dlg_auth_revocation_init_worker(cycle, conf->revocation_file) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    if(ngx_http_dlg_auth_cache_snapshot_init_worker(cycle) != NGX_OK) {
         return NGX_ERROR;
     }
-    *h = ngx_dlg_auth_handler;
 
     return NGX_OK;
 }
 
+/*
+ * Clean up per worker process state.
+ */
+static void ngx_http_dlg_auth_exit_process(ngx_cycle_t *cycle) {
+    ngx_http_dlg_auth_cache_snapshot_exit_worker(cycle);
+#if (NGX_DLG_AUTH_OPENSSL)
+    if(worker_hawkmac != NULL) {
+        hawkmac_free(worker_hawkmac);
+        worker_hawkmac = NULL;
+    }
+#endif
+}
+
 /*
  * Allocate new per-location config
  */
@@ -268,8 +692,10 @@ static void *ngx_http_dlg_auth_create_loc_conf(ngx_conf_t *cf) {
     conf->iron_password.data = NULL;
 
     /* Initialize password table */
-    conf->pwd_table.entries = conf->pwd_table_entries;
-    conf->pwd_table.nentries = 0;
+    conf->pwd_entries = NULL;
+    conf->pwd_table_name.len = 0;
+    conf->pwd_table_name.data = NULL;
+    conf->pwd_table = NULL;
 
     /* Initialize clock skew */
     conf->allowed_clock_skew = NGX_CONF_UNSET_UINT;
@@ -280,6 +706,27 @@ static void *ngx_http_dlg_auth_create_loc_conf(ngx_conf_t *cf) {
     conf->port.len = 0;
     conf->port.data = NULL;
 
+    /* Initialize ticket cache */
+    conf->cache_tickets = NGX_CONF_UNSET;
+    conf->ticket_cache = NULL;
+
+    /* Initialize connection ticket cache */
+    conf->connection_cache_size = NGX_CONF_UNSET_UINT;
+
+    /* Initialize nonce cache */
+    conf->nonce_cache = NGX_CONF_UNSET_PTR;
+
+    /* Initialize negative cache */
+    conf->negative_cache = NGX_CONF_UNSET_PTR;
+
+    /* Initialize rate limit */
+    conf->limit = NGX_CONF_UNSET_PTR;
+    conf->limit_burst = 0;
+
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
     return conf;
 }
 
@@ -290,11 +737,20 @@ static void *ngx_http_dlg_auth_create_loc_conf(ngx_conf_t *cf) {
 static char * ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *vparent, void *vchild) {
     ngx_http_dlg_auth_loc_conf_t  *parent = (ngx_http_dlg_auth_loc_conf_t*)vparent;
     ngx_http_dlg_auth_loc_conf_t  *child = (ngx_http_dlg_auth_loc_conf_t*)vchild;
+    ngx_http_dlg_auth_main_conf_t  *mcf;
+    ngx_int_t rc;
 
-    /* Merge realm */
+    /* Merge realm, locations inheriting realms share the compiled ones */
     if (child->realm.len == 0) {
         child->realm.len = parent->realm.len;
         child->realm.data = parent->realm.data;
+        child->realm_args = parent->realm_args;
+        child->realms = parent->realms;
+    }
+    if(child->realm_args != NULL && child->realms == NULL) {
+        if( (child->realms = compile_realms(cf, child->realm_args)) == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
     /* Merge single password, if any */
     if (child->iron_password.len == 0) {
@@ -302,16 +758,12 @@ static char * ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *vparent, vo
         child->iron_password.data = parent->iron_password.data;
     }
 
-    /* Merge password table if any */
-    if(child->pwd_table.nentries == 0) {
-    	size_t i;
-    	for(i=0;i<parent->pwd_table.nentries;i++) {
-    		child->pwd_table.entries[i].password_id_len = parent->pwd_table.entries[i].password_id_len;
-    		child->pwd_table.entries[i].password_id = parent->pwd_table.entries[i].password_id;
-    		child->pwd_table.entries[i].password_len = parent->pwd_table.entries[i].password_len;
-    		child->pwd_table.entries[i].password = parent->pwd_table.entries[i].password;
-    	}
-    	child->pwd_table.nentries = parent->pwd_table.nentries;
+    /* Merge password table if any, tables are shared and never copied */
+    if(resolve_pwd_table(cf, child) != NGX_OK || resolve_pwd_table(cf, parent) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+    if(child->pwd_table == NULL) {
+    	child->pwd_table = parent->pwd_table;
     }
 
     /*
@@ -331,13 +783,63 @@ static char * ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *vparent, vo
         child->port.data = parent->port.data;
     }
 
+    /*
+     * Inherit ticket cache, default is not to cache.
+     */
+    if(child->cache_tickets == NGX_CONF_UNSET) {
+        child->cache_tickets = (parent->cache_tickets == NGX_CONF_UNSET) ? 0 : parent->cache_tickets;
+        child->ticket_cache = parent->ticket_cache;
+    }
+
+    /*
+     * Inherit connection ticket cache, default is to remember 4 tickets per connection.
+     */
+    ngx_conf_merge_uint_value(child->connection_cache_size, parent->connection_cache_size, 4);
+    if(child->connection_cache_size > MAX_CONNECTION_CACHE_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_connection_ticket_cache must not exceed %d entries",
+                MAX_CONNECTION_CACHE_SIZE);
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * Inherit nonce cache, default is not to check nonces.
+     */
+    ngx_conf_merge_ptr_value(child->nonce_cache, parent->nonce_cache, NULL);
+
+    /*
+     * Inherit negative cache, default is to unseal every ticket that fails.
+     */
+    ngx_conf_merge_ptr_value(child->negative_cache, parent->negative_cache, NULL);
+
+    /*
+     * Inherit rate limit together with its burst, default is no limit.
+     */
+    if(child->limit == NGX_CONF_UNSET_PTR) {
+    	child->limit = (parent->limit == NGX_CONF_UNSET_PTR) ? NULL : parent->limit;
+    	child->limit_burst = parent->limit_burst;
+    }
+
+#if (NGX_THREADS)
+    /*
+     * Inherit thread pool, default is to unseal tickets in the event loop.
+     */
+    ngx_conf_merge_ptr_value(child->thread_pool, parent->thread_pool, NULL);
+#endif
+
     /*
      * If dlg_auth module applies to this location, perform some config sanity checks.
+     * Locations without dlg_auth or with 'dlg_auth off' (which terminates
+     * inheritance, but see https://github.com/algermissen/nginx-dlg-auth/issues/14)
+     * have no compiled realms.
      */
+    child->enabled = (child->realms != NULL);
+
+    if(child->enabled) {
+        mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+        mcf->enabled = 1;
 
-    if(child->realm.len != 0) {
         /* We need iron password or password table */
-        if(child->iron_password.len == 0 && child->pwd_table.nentries == 0) {
+        if(child->iron_password.len == 0 && child->pwd_table == NULL) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Neither iron password nor iron password table configured");
        	    return NGX_CONF_ERROR;
         }
@@ -350,6 +852,27 @@ static char * ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *vparent, vo
        	        return NGX_CONF_ERROR;
        	    }
         }
+        /* Nonces can only be aged out if the request timestamp is checked */
+        if(child->nonce_cache != NULL) {
+            if(child->allowed_clock_skew == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_nonce_cache requires dlg_auth_allowed_clock_skew to be greater than 0");
+                return NGX_CONF_ERROR;
+            }
+            ngx_http_dlg_auth_nonce_set_skew(child->nonce_cache, child->allowed_clock_skew);
+        }
+        child->pwd_fingerprint = pwd_fingerprint(child);
+
+        /* Ticket cache snapshots are sealed with and keyed by the passwords of the locations */
+        if(child->cache_tickets && child->ticket_cache != NULL) {
+            if(ngx_http_dlg_auth_cache_add_location(cf, child) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if( (rc = ngx_http_dlg_auth_stats_add_realm(cf, &(child->realm))) == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+        child->stats_realm = rc;
     }
 
     return NGX_CONF_OK;
@@ -377,48 +900,75 @@ static char * ngx_http_dlg_auth_merge_loc_conf(ngx_conf_t *cf, void *vparent, vo
 static ngx_int_t ngx_dlg_auth_handler(ngx_http_request_t *r) {
     ngx_http_dlg_auth_loc_conf_t  *conf;
     ngx_int_t rc;
+    ngx_http_dlg_auth_timer_t timer;
     ngx_http_dlg_auth_ctx_t *ctx;
+#if (NGX_THREADS)
+    ngx_http_dlg_auth_state_t *st;
+#endif
 
     /*
-     * Allocate and store our per request context (used to
-     * store the data to be made accessible as variable values).
+     * First, get the configuration and check whether we apply to
+     * the current location. This is resolved during configuration merge,
+     * including 'dlg_auth off'.
      */
-    if( (ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_dlg_auth_ctx_t))) == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to allocate memory for dlg_auth module context");
-    	return NGX_ERROR;
+    conf = ngx_http_get_module_loc_conf(r, nginx_dlg_auth_module);
+    if (!conf->enabled) {
+        return NGX_DECLINED;
     }
-    ngx_http_set_ctx(r, ctx, nginx_dlg_auth_module);
 
+#if (NGX_THREADS)
     /*
-     * First, get the configuration and check whether we apply to
-     * the current location.
+     * Continue an authentication that has been waiting for its thread task.
      */
-    conf = ngx_http_get_module_loc_conf(r, nginx_dlg_auth_module);
-    if (conf->realm.data == NULL) {
-        return NGX_DECLINED;
+    ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module);
+    if(ctx != NULL && ctx->state != NULL) {
+        st = ctx->state;
+        if(st->posted) {
+            return NGX_AGAIN;
+        }
+        ctx->state = NULL;
+        rc = ngx_dlg_auth_finish(r, st);
+        ngx_http_dlg_auth_timer_finish(st->timer, rc);
+        if(rc != NGX_OK) {
+            return rc;
+        }
+        ngx_dlg_auth_rename_authorization_header(r);
+        return NGX_OK;
     }
+#endif
 
     /*
-     * User can disable ourselves by setting the realm to 'off'. This includes
-     * terminating inheritance.
-     * But see https://github.com/algermissen/nginx-dlg-auth/issues/14
+     * Internal redirects and subrequests of a request that has been authenticated
+     * already only need the grants of the ticket checked for this location. The
+     * signature covers the original request and its Authorization header has
+     * been renamed, so it could not be checked again anyway.
      */
-    if (conf->realm.len == 3 && ngx_strncmp(conf->realm.data, "off", 3) == 0) {
-        return NGX_DECLINED;
+    if( (ctx = ngx_dlg_auth_find_verdict(r, conf)) != NULL) {
+        return ngx_dlg_auth_authorize(r, conf, ctx, ngx_time());
     }
 
+    ngx_http_dlg_auth_timer_start(r, conf->stats_realm, &timer);
+
     /*
      * Authorization header presence is required, of course.
      */
 
     if (r->headers_in.authorization == NULL) {
-    	return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+    	rc = ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+    	ngx_http_dlg_auth_timer_finish(&timer, rc);
+    	return rc;
     }
 
     /*
      * Authenticate and authorize and 'remove' (rename) authorization header if ok.
      */
-    if( (rc =  ngx_dlg_auth_authenticate(r,conf,ctx)) != NGX_OK) {
+    rc = ngx_dlg_auth_authenticate(r,conf,&timer);
+    if(rc == NGX_AGAIN) {
+    	/* The ticket is unsealed in a thread, the task took over the timer */
+    	return rc;
+    }
+    ngx_http_dlg_auth_timer_finish(&timer, rc);
+    if(rc != NGX_OK) {
     	return rc;
     }
 
@@ -432,66 +982,360 @@ static ngx_int_t ngx_dlg_auth_handler(ngx_http_request_t *r) {
  * This is the heart of the module, where authentication and authorization
  * takes place.
  *
+ * Tickets found in the ticket cache are checked right away. Other tickets are
+ * unsealed and the signature validated either here or, with dlg_auth_thread_pool,
+ * in a thread task, in which case NGX_AGAIN is returned and the checks are
+ * completed by ngx_dlg_auth_finish when the handler is called again.
  */
-static ngx_int_t ngx_dlg_auth_authenticate(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf,ngx_http_dlg_auth_ctx_t *ctx) {
+static ngx_int_t ngx_dlg_auth_authenticate(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf,
+		ngx_http_dlg_auth_timer_t *timer) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+	ngx_http_dlg_auth_state_t state;
+	ngx_http_dlg_auth_state_t *st = &state;
+	ngx_int_t rc;
+
+	st->conf = conf;
+	st->request = r;
+	st->timer = timer;
+	st->pwds = (conf->pwd_table != NULL) ? conf->pwd_table->pwds : NULL;
+	mcf = ngx_http_get_module_main_conf(r, nginx_dlg_auth_module);
+	st->revocations = (mcf->revocation_file != NULL) ? mcf->revocation_file->current : NULL;
+	st->rejection_log = mcf->rejection_log;
+#if (NGX_DLG_AUTH_OPENSSL)
+	st->hawkmac = worker_hawkmac;
+#endif
+	st->unseal_rc = NGX_DECLINED;
+	st->grants_rc = NGX_DECLINED;
+	st->hmac_rc = NGX_DECLINED;
+	st->unsafe = IS_UNSAFE_METHOD(r->method);
+	st->error_len = 0;
+#if (NGX_THREADS)
+	st->posted = 0;
+	st->pool = NULL;
+#endif
 
 	/*
-	 * Variables necessary for Hawk.
+	 * Tickets with many realms get their realm arrays from the request pool.
 	 */
-	HawkcError he;
-	struct HawkcContext hawkc_ctx;
-	int hmac_is_valid;
-	ngx_str_t host;
-	ngx_str_t port;
+	ticket_init(&(st->ticket), ngx_dlg_auth_pool_alloc, r->pool);
 
-	/*
-	 * Variables necessary for ciron.
-	 */
-    struct CironContext ciron_ctx;
-	CironError ce;
-	unsigned char encryption_buffer[ENCRYPTION_BUFFER_SIZE];
-	unsigned char output_buffer[OUTPUT_BUFFER_SIZE];
-	size_t check_len;
-	size_t output_len;
+	if( (rc = ngx_dlg_auth_parse_header(r, conf, &(st->hawkc_ctx))) != NGX_OK) {
+		return rc;
+	}
 
 	/*
-	 * Ticket processing and authorization checking.
+	 * Tickets too large to be unsealed are rejected before any cache is asked.
 	 */
-	TicketError te;
-	struct Ticket ticket;
-	time_t now;
-	time_t clock_skew;
-
-	ciron_context_init(&ciron_ctx,CIRON_DEFAULT_ENCRYPTION_OPTIONS,CIRON_DEFAULT_INTEGRITY_OPTIONS);
+	if( (rc = ngx_dlg_auth_check_length(st)) != NGX_OK) {
+		ngx_dlg_auth_log_error(r, st);
+		return rc;
+	}
+	ngx_http_dlg_auth_timer_stage(timer, DLG_AUTH_STAGE_PARSE);
 
-    /*
-     * Determine the host and port values to be used for signature validation.
-     */
-	determine_host_and_port(conf,r,&host,&port);
+	time(&(st->now));
 
 	/*
-	 * Initialize Hawkc context with original request data
+	 * Cached tickets of tables read from a file are keyed by the current
+	 * passwords, so that tickets sealed with a password removed from the
+	 * file are not taken from the cache anymore.
 	 */
-	hawkc_context_init(&hawkc_ctx);
-	hawkc_context_set_method(&hawkc_ctx,r->method_name.data, r->method_name.len);
-	hawkc_context_set_path(&hawkc_ctx,r->unparsed_uri.data, r->unparsed_uri.len);
-	hawkc_context_set_host(&hawkc_ctx,host.data,host.len);
-	hawkc_context_set_port(&hawkc_ctx,port.data,port.len);
+	st->pwd_key = conf->pwd_fingerprint;
+	if(conf->pwd_table != NULL && conf->pwd_table->file != NULL) {
+		st->pwd_key ^= st->pwds->fingerprint;
+	}
 
 	/*
-	 * Parse Hawk Authorization header.
+	 * Clients sending many requests per keep-alive or HTTP/2 connection use the
+	 * same ticket again and again. The connection remembers the last ones, which
+	 * needs neither locking nor unsealing.
 	 */
-	if( (he = hawkc_parse_authorization_header(&hawkc_ctx,r->headers_in.authorization->value.data, r->headers_in.authorization->value.len)) != HAWKC_OK) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to parse Authorization header %V, reason: %s" ,&(r->headers_in.authorization->value), hawkc_get_error(&hawkc_ctx));
-		if(he == HAWKC_BAD_SCHEME_ERROR) {
-			return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
-		}
-		if(he == HAWKC_PARSE_ERROR) {
+	rc = NGX_DECLINED;
+	if(conf->connection_cache_size > 0) {
+		rc = ngx_http_dlg_auth_conn_cache_lookup(r, st->pwd_key, &(st->hawkc_ctx.header_in.id), st->now,
+				st->output_buffer, sizeof(st->output_buffer), &(st->ticket));
+	}
+
+	if(rc != NGX_OK) {
+		/*
+		 * Sealed tickets that recently failed to unseal fail the same way again,
+		 * answer them without the work.
+		 */
+		if(conf->negative_cache != NULL
+				&& (rc = ngx_http_dlg_auth_negative_lookup(conf->negative_cache, st->pwd_key, &(st->hawkc_ctx.header_in.id), st->now)) != 0) {
+			ngx_http_dlg_auth_timer_count(timer, DLG_AUTH_COUNTER_NEGATIVE_HIT);
+			ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_NEGATIVE, "Ticket failed to unseal before, rejected by negative cache");
+			if(rc == NGX_HTTP_UNAUTHORIZED) {
+				return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+			}
+			return rc;
+		}
+
+		/*
+		 * The sealed ticket is the Hawk id parameter. If we have seen it before, the
+		 * ticket cache gives us the ticket without unsealing and parsing it again.
+		 * The Hawk signature is validated in any case.
+		 */
+		rc = NGX_DECLINED;
+		if(conf->cache_tickets) {
+			rc = ngx_http_dlg_auth_cache_lookup(conf->ticket_cache, st->pwd_key,
+					&(st->hawkc_ctx.header_in.id), st->now, st->output_buffer, sizeof(st->output_buffer), &(st->ticket));
+			if(rc == NGX_OK && conf->connection_cache_size > 0) {
+				ngx_http_dlg_auth_conn_cache_store(r, conf->connection_cache_size, st->pwd_key,
+						&(st->hawkc_ctx.header_in.id), &(st->ticket), st->now);
+			}
+		}
+	}
+	if(conf->connection_cache_size > 0 || conf->cache_tickets) {
+		ngx_http_dlg_auth_timer_stage(timer, DLG_AUTH_STAGE_CACHE);
+	}
+	if(rc != NGX_OK) {
+#if (NGX_THREADS)
+		if(conf->thread_pool != NULL) {
+			return ngx_dlg_auth_post_task(r, st);
+		}
+#endif
+		ngx_dlg_auth_unseal_and_validate(st);
+	}
+
+	return ngx_dlg_auth_finish(r, st);
+}
+
+/*
+ * Complete the authentication once the ticket is there, from the cache or
+ * unsealed: report unseal failures, cache the ticket and check signature,
+ * clock skew, nonce and the grants of the ticket.
+ */
+static ngx_int_t ngx_dlg_auth_finish(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st) {
+	ngx_http_dlg_auth_loc_conf_t *conf = st->conf;
+	ngx_http_dlg_auth_ctx_t *ctx;
+	time_t clock_skew;
+	ngx_int_t rc;
+
+	if(st->unseal_rc != NGX_DECLINED) {
+		if(st->unseal_rc != NGX_OK) {
+			ngx_dlg_auth_log_error(r, st);
+			if(conf->negative_cache != NULL) {
+				ngx_http_dlg_auth_negative_store(conf->negative_cache, st->pwd_key, &(st->hawkc_ctx.header_in.id), st->now,
+						st->unseal_rc);
+				ngx_http_dlg_auth_timer_count(st->timer, DLG_AUTH_COUNTER_NEGATIVE_STORE);
+			}
+			/* If password is not found, we consider that an authentication error, not a 400. */
+			if(st->unseal_rc == NGX_HTTP_UNAUTHORIZED) {
+				return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+			}
+			return st->unseal_rc;
+		}
+		if(conf->cache_tickets) {
+			ngx_http_dlg_auth_cache_store(conf->ticket_cache, st->pwd_key, &(st->hawkc_ctx.header_in.id), &(st->ticket), st->now,
+					r->connection->log);
+		}
+		if(conf->connection_cache_size > 0) {
+			ngx_http_dlg_auth_conn_cache_store(r, conf->connection_cache_size, st->pwd_key,
+					&(st->hawkc_ctx.header_in.id), &(st->ticket), st->now);
+		}
+	} else if(st->revocations != NULL && ngx_http_dlg_auth_revoked(st->revocations, &(st->ticket), &(st->hawkc_ctx.header_in.id))) {
+		/* Cached tickets may have been revoked since they were unsealed */
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_REVOKED, "Ticket has been revoked; client=%*s", st->ticket.client.len,
+				st->ticket.client.data);
+		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	}
+
+	/*
+	 * From here on the ticket is known, keep it for the variables.
+	 */
+	if( (ctx = ngx_dlg_auth_retain_ticket(r, &(st->ticket))) == NULL) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to allocate memory for dlg_auth module context");
+		return NGX_ERROR;
+	}
+
+	/*
+	 * Check expiry and realms of the ticket, then validate the HMAC signature of
+	 * the request, unless done together with unsealing.
+	 */
+	if(st->grants_rc == NGX_DECLINED) {
+		st->grants_rc = ngx_dlg_auth_check_grants(st);
+	}
+	if(st->grants_rc != NGX_OK) {
+		ngx_dlg_auth_log_error(r, st);
+		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	}
+	if(st->hmac_rc == NGX_DECLINED) {
+		st->hmac_rc = ngx_dlg_auth_validate_hmac(st);
+	}
+	if(st->hmac_rc != NGX_OK) {
+		ngx_dlg_auth_log_error(r, st);
+		if(st->hmac_rc == NGX_HTTP_UNAUTHORIZED) {
+			return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+		}
+		return st->hmac_rc;
+	}
+
+	clock_skew = st->now - st->hawkc_ctx.header_in.ts;
+	ctx->clockskew = clock_skew;
+	ctx->has_clockskew = 1;
+
+	/*
+	 * If clock skew checking isn't disabled, check request timestamp, allowing for some skew.
+	 * If the client's clock differs to much from the server's clock, we send the client a 401
+	 * and our current time so it understands the offset and can send the request again.
+	 * Configuring allowed clock skew to be 0 disables checking.
+	 */
+	if( (conf->allowed_clock_skew != 0)  && (abs(clock_skew) > (time_t)(conf->allowed_clock_skew))) {
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_SKEW, "Clock skew too large mine: %d, got %d ,skew is %d" , st->now , st->hawkc_ctx.header_in.ts,
+				clock_skew);
+		hawkc_www_authenticate_header_set_ts(&(st->hawkc_ctx),st->now);
+		st->timer->outcome = DLG_AUTH_OUTCOME_401_SKEW;
+		return ngx_dlg_auth_send_401(r, &(st->hawkc_ctx));
+	}
+
+	/*
+	 * Reject replayed requests. This is only possible with clock skew checking enabled,
+	 * because nonces must be remembered only as long as a request timestamp is acceptable.
+	 * See https://github.com/algermissen/nginx-dlg-auth/issues/1
+	 */
+	if(conf->nonce_cache != NULL) {
+		if(ngx_http_dlg_auth_nonce_check(conf->nonce_cache, &(st->hawkc_ctx.header_in.id), &(st->hawkc_ctx.header_in.nonce),
+				st->hawkc_ctx.header_in.ts, r->connection->log) != NGX_OK) {
+			ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_REPLAY, "Replayed request, nonce %*s has been used before",
+					st->hawkc_ctx.header_in.nonce.len, st->hawkc_ctx.header_in.nonce.data);
+			return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+		}
+		ngx_http_dlg_auth_timer_stage(st->timer, DLG_AUTH_STAGE_NONCE);
+	}
+
+	if( (rc = ngx_dlg_auth_authorize(r, conf, ctx, st->now)) != NGX_OK) {
+		return rc;
+	}
+	if( (rc = ngx_dlg_auth_limit(r, conf, ctx)) != NGX_OK) {
+		return rc;
+	}
+
+	/*
+	 * Now the request has been authenticated by way of Hawk and let through.
+	 * Internal redirects and subrequests can rely on that, see
+	 * ngx_dlg_auth_find_verdict. Rejected requests must not leave a verdict,
+	 * an error_page location would otherwise bypass the check that failed.
+	 */
+	ctx->pwd_fingerprint = conf->pwd_fingerprint;
+	ctx->verified = 1;
+	return NGX_OK;
+}
+
+/*
+ * Use the ticket itself to check access rights of an authenticated request.
+ */
+static ngx_int_t ngx_dlg_auth_authorize(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_dlg_auth_ctx_t *ctx,
+		time_t now) {
+
+	/*
+	 * Tickets contain a parameter rw which has to be set to true to grant
+	 * access using unsafe HTTP methods.
+	 */
+	if(IS_UNSAFE_METHOD(r->method)) {
+		if(ctx->rw == 0) {
+			ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_METHOD, "Ticket does not represent grant for unsafe methods; client=%V",
+			    &(ctx->client));
+			return NGX_HTTP_FORBIDDEN;
+		}
+	}
+
+	/*
+	 * Check whether ticket has expired.
+	 */
+	if(ctx->expires < now) {
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_EXPIRED, "Ticket has expired");
+		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	}
+
+	/*
+	 * Now we check whether the ticket applies to the necessary realm.
+	 */
+	if(!ngx_dlg_auth_has_realm(conf->realms, ctx->realms, ctx->realm_hashes, ctx->nrealms)) {
+	    /* Fixes https://github.com/algermissen/nginx-dlg-auth/issues/17 */
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_REALM, "Ticket does not represent grant for access to realm %V; client=%V" ,
+		    &(conf->realm),&(ctx->client) );
+		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Count an authenticated and authorized request against the rate of its
+ * client. Internal redirects and subrequests reuse the verdict and are not
+ * counted again.
+ */
+static ngx_int_t ngx_dlg_auth_limit(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, ngx_http_dlg_auth_ctx_t *ctx) {
+	if(conf->limit == NULL) {
+		return NGX_OK;
+	}
+	if(ngx_http_dlg_auth_limit_check(conf->limit, conf->limit_burst, &(ctx->client)) == NGX_BUSY) {
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_LIMIT, "Rate limit of client %V exceeded", &(ctx->client));
+		return NGX_HTTP_TOO_MANY_REQUESTS;
+	}
+	return NGX_OK;
+}
+
+/*
+ * Initialize the Hawk context with the original request data and parse the
+ * Authorization header.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_parse_header(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf, HawkcContext hawkc_ctx) {
+	HawkcError he;
+	ngx_str_t host;
+	ngx_str_t port;
+
+    /*
+     * Determine the host and port values to be used for signature validation.
+     */
+	determine_host_and_port(conf,r,&host,&port);
+
+	hawkc_context_init(hawkc_ctx);
+	hawkc_context_set_method(hawkc_ctx,r->method_name.data, r->method_name.len);
+	hawkc_context_set_path(hawkc_ctx,r->unparsed_uri.data, r->unparsed_uri.len);
+	hawkc_context_set_host(hawkc_ctx,host.data,host.len);
+	hawkc_context_set_port(hawkc_ctx,port.data,port.len);
+
+	if( (he = hawkc_parse_authorization_header(hawkc_ctx,r->headers_in.authorization->value.data, r->headers_in.authorization->value.len)) != HAWKC_OK) {
+		ngx_dlg_auth_reject(r, DLG_AUTH_REJECT_HEADER, "Unable to parse Authorization header %V, reason: %s" ,&(r->headers_in.authorization->value), hawkc_get_error(hawkc_ctx));
+		if(he == HAWKC_BAD_SCHEME_ERROR) {
+			return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+		}
+		if(he == HAWKC_PARSE_ERROR) {
 			return NGX_HTTP_BAD_REQUEST;
 		}
 		/* Fixes https://github.com/algermissen/nginx-dlg-auth/issues/18 */
 		return NGX_HTTP_BAD_REQUEST;
 	}
+	return NGX_OK;
+}
+
+/*
+ * Unseal the ticket and, if that worked and the ticket can grant access at all,
+ * validate the request signature.
+ * Does not touch the request, see ngx_http_dlg_auth_state_t.
+ */
+static void ngx_dlg_auth_unseal_and_validate(ngx_http_dlg_auth_state_t *st) {
+	if( (st->unseal_rc = ngx_dlg_auth_unseal_ticket(st)) != NGX_OK) {
+		return;
+	}
+	if( (st->grants_rc = ngx_dlg_auth_check_grants(st)) != NGX_OK) {
+		return;
+	}
+	st->hmac_rc = ngx_dlg_auth_validate_hmac(st);
+}
+
+/*
+ * Check the length of the sealed ticket against the unseal buffers.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_check_length(ngx_http_dlg_auth_state_t *st) {
+	struct CironContext ciron_ctx;
+	size_t check_len;
+	HawkcString *id = &(st->hawkc_ctx.header_in.id);
+
+	ciron_context_init(&ciron_ctx,CIRON_DEFAULT_ENCRYPTION_OPTIONS,CIRON_DEFAULT_INTEGRITY_OPTIONS);
 
 	/*
 	 * ciron requires the caller to provide buffers for the decryption process
@@ -504,147 +1348,406 @@ static ngx_int_t ngx_dlg_auth_authenticate(ngx_http_request_t *r, ngx_http_dlg_a
 	 * of ENCRYPTION_BUFFER_SIZE and OUTPUT_BUFFER_SIZE for how the size
 	 * is estimated.
 	 */
-
-
-	if( (ce = ciron_calculate_encryption_buffer_length(&ciron_ctx,hawkc_ctx.header_in.id.len,&check_len)) != CIRON_OK) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Encryption buffer length calculation for Hawk ID length %zu would cause overflow. This might indicate an attack",
-				hawkc_ctx.header_in.id.len);
-		return NGX_HTTP_BAD_REQUEST;
+	if(ciron_calculate_encryption_buffer_length(&ciron_ctx,id->len,&check_len) != CIRON_OK) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_LENGTH, "Encryption buffer length calculation for Hawk ID length %uz would cause overflow. This might indicate an attack",
+				id->len);
 	}
-	if( check_len > sizeof(encryption_buffer)) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Required encryption buffer length %zu too big. This might indicate an attack",
+	if( check_len > ENCRYPTION_BUFFER_SIZE) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_LENGTH, "Required encryption buffer length %uz too big. This might indicate an attack",
 				check_len);
-		return NGX_HTTP_BAD_REQUEST;
 	}
 
-	if( (ce = ciron_calculate_unseal_buffer_length(&ciron_ctx,hawkc_ctx.header_in.id.len,&check_len)) != CIRON_OK) {
-	    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unseal buffer length for Hawk ID length %zu would cause overflow. This might indicate an attack",
-    				hawkc_ctx.header_in.id.len);
-    		return NGX_HTTP_BAD_REQUEST;
+	if(ciron_calculate_unseal_buffer_length(&ciron_ctx,id->len,&check_len) != CIRON_OK) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_LENGTH, "Unseal buffer length for Hawk ID length %uz would cause overflow. This might indicate an attack",
+				id->len);
 	}
-	if( check_len > sizeof(output_buffer)) {
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Required unseal buffer length %zu too big. This might indicate an attack",
-					check_len);
-			return NGX_HTTP_BAD_REQUEST;
+	if( check_len > OUTPUT_BUFFER_SIZE) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_LENGTH, "Required unseal buffer length %uz too big. This might indicate an attack",
+				check_len);
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Unseal the ticket sent as Hawk id and parse it. The ticket's strings point
+ * into the output buffer of the state afterwards.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_unseal_ticket(ngx_http_dlg_auth_state_t *st) {
+    struct CironContext ciron_ctx;
+	CironError ce;
+	unsigned char encryption_buffer[ENCRYPTION_BUFFER_SIZE];
+	size_t output_len;
+	TicketError te;
+	struct CironPwdTable single_entry_table;
+	CironPwdTable pwd_table;
+	CironPwdTableEntry entry;
+	const unsigned char *pwd_id;
+	size_t pwd_id_len;
+	HawkcString *id = &(st->hawkc_ctx.header_in.id);
+	Ticket ticket = &(st->ticket);
+
+	ciron_context_init(&ciron_ctx,CIRON_DEFAULT_ENCRYPTION_OPTIONS,CIRON_DEFAULT_INTEGRITY_OPTIONS);
+
+	/*
+	 * The buffers are large enough, see ngx_dlg_auth_check_length.
+	 */
+
+	/*
+	 * ciron scans the password table for the password id of the ticket. We look the
+	 * id up in the table's index instead and hand ciron just the matching entry.
+	 * Unknown ids and malformed tickets go to ciron with the full table, to report
+	 * them as before.
+	 */
+	pwd_table = &no_pwd_table;
+	if(st->pwds != NULL) {
+		pwd_table = &(st->pwds->table);
+		if(pwd_index_sealed_id(id->data, id->len, &pwd_id, &pwd_id_len) == 0 && pwd_id_len > 0
+				&& (entry = pwd_index_lookup(&(st->pwds->index), pwd_id, pwd_id_len)) != NULL) {
+			single_entry_table.nentries = 1;
+			single_entry_table.entries = entry;
+			pwd_table = &single_entry_table;
+		}
 	}
 
 	/*
 	 * The sealed ticket is the Hawk id parameter. We unseal it, parse the ticket JSON
 	 * and extract password and algorithm to validate the Hawk signature.
 	 */
-	if( (ce =ciron_unseal(&ciron_ctx,hawkc_ctx.header_in.id.data, hawkc_ctx.header_in.id.len, &(conf->pwd_table),conf->iron_password.data, conf->iron_password.len,
-			encryption_buffer, output_buffer, &output_len)) != CIRON_OK) {
-			/* If password is not found, we consider that an authentication error, not a 405. */
+	if( (ce =ciron_unseal(&ciron_ctx,id->data, id->len, pwd_table,st->conf->iron_password.data, st->conf->iron_password.len,
+			encryption_buffer, st->output_buffer, &output_len)) != CIRON_OK) {
+			/* If password is not found, we consider that an authentication error, not a 400. */
 			if(ciron_get_error_code(&ciron_ctx) == CIRON_PASSWORD_ROTATION_ERROR) {
-			    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Password ID of ticket not found in configured iron passwords (%s)" , ciron_get_error(&ciron_ctx));
-		        return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+				return ngx_dlg_auth_error(st, NGX_HTTP_UNAUTHORIZED, DLG_AUTH_REJECT_PWD, "Password ID of ticket not found in configured iron passwords (%s)",
+						ciron_get_error(&ciron_ctx));
 			}
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to unseal ticket: %s" , ciron_get_error(&ciron_ctx));
-			return NGX_HTTP_BAD_REQUEST;
+			return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_UNSEAL, "Unable to unseal ticket: %s" , ciron_get_error(&ciron_ctx));
 	}
-	if( (te = ticket_from_string(&ticket , (char*)output_buffer,output_len)) != OK) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to parse ticket JSON, %s" , ticket_strerror(te));
-		return NGX_HTTP_BAD_REQUEST;
+	ngx_http_dlg_auth_timer_stage(st->timer, DLG_AUTH_STAGE_UNSEAL);
+
+	if( (te = ticket_from_string(ticket, (char*)st->output_buffer,output_len)) != OK) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_TICKET, "Unable to parse ticket, %s" , ticket_strerror(te));
 	}
+	if(st->revocations != NULL && ngx_http_dlg_auth_revoked(st->revocations, ticket, id)) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_UNAUTHORIZED, DLG_AUTH_REJECT_REVOKED, "Ticket has been revoked; client=%*s", ticket->client.len,
+				ticket->client.data);
+	}
+	ngx_http_dlg_auth_timer_stage(st->timer, DLG_AUTH_STAGE_TICKET);
 
-	if( ticket.hawkAlgorithm == NULL ) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Ticket does not contain hawkAlgorithm member");
-		return NGX_HTTP_BAD_REQUEST;
+	if( ticket->hawkAlgorithm == NULL ) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_TICKET, "Ticket does not contain hawkAlgorithm member");
 	}
-	if( ticket.pwd.len == 0 ) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Ticket does not contain password member");
-		return NGX_HTTP_BAD_REQUEST;
+	if( ticket->pwd.len == 0 ) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_BAD_REQUEST, DLG_AUTH_REJECT_TICKET, "Ticket does not contain password member");
 	}
 
-	if(store_client(r,ctx,&ticket) != NGX_OK ) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to store client variable, storage function returned error");
-		// We can still serve the request despite this error, so no error return
+	return NGX_OK;
+}
+
+/*
+ * Reject tickets that have expired or do not grant access to the realms of the
+ * location before spending an HMAC on the request. Both are answered with the
+ * same plain 401 as a bad signature.
+ *
+ * A correctly signed request whose timestamp is outside the allowed clock skew
+ * gets the 401 with our time instead, whatever its ticket grants, so that the
+ * client can resync. Such requests are left to the signature and clock skew
+ * checks, as are unsafe requests with a read-only ticket, which get a 403 if
+ * and only if the signature is valid. Expiry and realms of both are checked
+ * again by ngx_dlg_auth_authorize.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_check_grants(ngx_http_dlg_auth_state_t *st) {
+	Ticket ticket = &(st->ticket);
+	time_t clock_skew;
+
+	if(st->unsafe && !ticket->rw) {
+		return NGX_OK;
+	}
+	if(st->conf->allowed_clock_skew != 0) {
+		clock_skew = st->now - st->hawkc_ctx.header_in.ts;
+		if(clock_skew > (time_t) st->conf->allowed_clock_skew || -clock_skew > (time_t) st->conf->allowed_clock_skew) {
+			return NGX_OK;
+		}
+	}
+	if(ticket->exp < st->now) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_UNAUTHORIZED, DLG_AUTH_REJECT_EXPIRED, "Ticket has expired");
+	}
+	if(!ngx_dlg_auth_has_realm(st->conf->realms, ticket->realms, ticket->realm_hashes, ticket->nrealms)) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_UNAUTHORIZED, DLG_AUTH_REJECT_REALM, "Ticket does not represent grant for access to realm %V; client=%*s",
+				&(st->conf->realm), ticket->client.len, ticket->client.data);
 	}
+	ngx_http_dlg_auth_timer_stage(st->timer, DLG_AUTH_STAGE_GRANTS);
+	return NGX_OK;
+}
+
+/*
+ * Take password and algorithm from the ticket and validate the HMAC signature
+ * of the request, with the OpenSSL contexts of the worker if there are any.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_validate_hmac(ngx_http_dlg_auth_state_t *st) {
+	ngx_int_t rc;
+	int hmac_is_valid;
 
-	if(store_expires(r,ctx,&ticket) != NGX_OK ) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to store expires variable, storage function returned error");
-		// We can still serve the request despite this error, so no error return
+#if (NGX_DLG_AUTH_OPENSSL)
+	rc = (st->hawkmac != NULL) ? ngx_dlg_auth_hawkmac(st, &hmac_is_valid) : NGX_DECLINED;
+	if(rc == NGX_DECLINED) {
+		rc = ngx_dlg_auth_hawkc(st, &hmac_is_valid);
 	}
+#else
+	rc = ngx_dlg_auth_hawkc(st, &hmac_is_valid);
+#endif
+	if(rc != NGX_OK) {
+		return rc;
+	}
+	if(!hmac_is_valid) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_UNAUTHORIZED, DLG_AUTH_REJECT_SIGNATURE, "Invalid signature in %V" ,
+				&(st->request->headers_in.authorization->value));
+	}
+	ngx_http_dlg_auth_timer_stage(st->timer, DLG_AUTH_STAGE_HMAC);
+	return NGX_OK;
+}
 
-	/*
-	 * Now we can take password and algorithm from ticket and store them in Hawkc context.
-	 */
+/*
+ * Compute the signature with hawkc.
+ * Returns NGX_OK or the HTTP status to respond with.
+ */
+static ngx_int_t ngx_dlg_auth_hawkc(ngx_http_dlg_auth_state_t *st, int *valid) {
+	hawkc_context_set_password(&(st->hawkc_ctx),st->ticket.pwd.data,st->ticket.pwd.len);
+	hawkc_context_set_algorithm(&(st->hawkc_ctx),st->ticket.hawkAlgorithm);
+
+	if(hawkc_validate_hmac(&(st->hawkc_ctx), valid) != HAWKC_OK) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_INTERNAL_SERVER_ERROR, DLG_AUTH_REJECT_SIGNATURE, "Unable to validate request signature: %s" ,
+				hawkc_get_error(&(st->hawkc_ctx)));
+	}
+	return NGX_OK;
+}
 
-	hawkc_context_set_password(&hawkc_ctx,ticket.pwd.data,ticket.pwd.len);
-	hawkc_context_set_algorithm(&hawkc_ctx,ticket.hawkAlgorithm);
+#if (NGX_DLG_AUTH_OPENSSL)
 
-	/*
-	 * Validate the HMAC signature of the request.
-	 */
+/*
+ * Compute the signature with the OpenSSL contexts of the worker, see hawkmac.h.
+ * Returns NGX_OK, NGX_DECLINED if it is up to hawkc or the HTTP status to
+ * respond with.
+ */
+static ngx_int_t ngx_dlg_auth_hawkmac(ngx_http_dlg_auth_state_t *st, int *valid) {
+	struct HawkMacRequest request;
+	HawkMacError me;
+	ngx_str_t host;
+	ngx_str_t port;
 
-	if( (he = hawkc_validate_hmac(&hawkc_ctx, &hmac_is_valid)) != HAWKC_OK) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to validate request signature: %s" , hawkc_get_error(&hawkc_ctx));
-		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	determine_host_and_port(st->conf, st->request, &host, &port);
+	request.method.data = st->request->method_name.data;
+	request.method.len = st->request->method_name.len;
+	request.path.data = st->request->unparsed_uri.data;
+	request.path.len = st->request->unparsed_uri.len;
+	request.host.data = host.data;
+	request.host.len = host.len;
+	request.port.data = port.data;
+	request.port.len = port.len;
+
+	me = hawkmac_validate(st->hawkmac, st->ticket.hawkAlgorithm, st->ticket.pwd.data, st->ticket.pwd.len, &request,
+			&(st->hawkc_ctx.header_in), valid);
+	if(me == HAWKMAC_UNSUPPORTED) {
+		return NGX_DECLINED;
 	}
-	if(!hmac_is_valid) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Invalid signature in %V" ,&(r->headers_in.authorization->value) );
-		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	if(me != HAWKMAC_OK) {
+		return ngx_dlg_auth_error(st, NGX_HTTP_INTERNAL_SERVER_ERROR, DLG_AUTH_REJECT_SIGNATURE,
+				"Unable to validate request signature: OpenSSL HMAC failed");
 	}
-	time(&now);
-	clock_skew = now - hawkc_ctx.header_in.ts;
-	if(store_clockskew(r,ctx,clock_skew) != NGX_OK) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Unable to store clock_skew variable, storage function returned error");
-		// We can still serve the request, so no error return
+	return NGX_OK;
+}
+
+#endif
+
+/*
+ * Count a rejection and keep its error message, if sampled, to be logged by
+ * ngx_dlg_auth_finish. Returns rc.
+ */
+static ngx_int_t ngx_dlg_auth_error(ngx_http_dlg_auth_state_t *st, ngx_int_t rc, ngx_uint_t reason, const char *fmt, ...) {
+	va_list args;
+
+	st->error_len = 0;
+	if(!ngx_http_dlg_auth_rejection(st->rejection_log, reason) || st->request->connection->log->log_level < NGX_LOG_ERR) {
+		return rc;
 	}
+	va_start(args, fmt);
+	st->error_len = ngx_vslprintf(st->error, st->error + sizeof(st->error), fmt, args) - st->error;
+	va_end(args);
+	return rc;
+}
 
-	/*
-	 * If clock skew checking isn't disabled, check request timestamp, allowing for some skew.
-	 * If the client's clock differs to much from the server's clock, we send the client a 401
-	 * and our current time so it understands the offset and can send the request again.
-	 * Configuring allowed clock skew to be 0 disables checking.
-	 */
-	if( (conf->allowed_clock_skew != 0)  && (abs(clock_skew) > (time_t)(conf->allowed_clock_skew))) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Clock skew too large mine: %d, got %d ,skew is %d" , now , hawkc_ctx.header_in.ts,
-				clock_skew);
-		hawkc_www_authenticate_header_set_ts(&hawkc_ctx,now);
-		return ngx_dlg_auth_send_401(r, &hawkc_ctx);
+/*
+ * Log the error message kept by ngx_dlg_auth_error, if any.
+ */
+static void ngx_dlg_auth_log_error(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st) {
+	if(st->error_len > 0) {
+		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "%*s", st->error_len, st->error);
 	}
+}
+
+/*
+ * Count a rejection and log its error message, if sampled.
+ */
+static void ngx_dlg_auth_reject(ngx_http_request_t *r, ngx_uint_t reason, const char *fmt, ...) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+	u_char error[ERROR_MESSAGE_SIZE];
+	u_char *p;
+	va_list args;
+
+	mcf = ngx_http_get_module_main_conf(r, nginx_dlg_auth_module);
+	if(!ngx_http_dlg_auth_rejection(mcf->rejection_log, reason) || r->connection->log->log_level < NGX_LOG_ERR) {
+		return;
+	}
+	va_start(args, fmt);
+	p = ngx_vslprintf(error, error + sizeof(error), fmt, args);
+	va_end(args);
+	ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "%*s", p - error, error);
+}
 
-	/* FIXME Check nonce, see https://github.com/algermissen/nginx-dlg-auth/issues/1 */
+#if (NGX_THREADS)
+
+/*
+ * Hand unsealing and signature validation to the thread pool of the location.
+ * The task gets its own copy of the state, allocated from the request pool
+ * because the request waits for it. The request is blocked until the task is
+ * done, then ngx_dlg_auth_handler runs again and finishes the authentication.
+ */
+static ngx_int_t ngx_dlg_auth_post_task(ngx_http_request_t *r, ngx_http_dlg_auth_state_t *st) {
+	ngx_http_dlg_auth_ctx_t *ctx;
+	ngx_thread_task_t *task;
+	ngx_pool_cleanup_t *cln;
+	ngx_http_dlg_auth_state_t *t;
+	ngx_int_t rc;
+
+	if( (task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_dlg_auth_state_t))) == NULL) {
+		return NGX_ERROR;
+	}
+	if( (cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL) {
+		return NGX_ERROR;
+	}
+	if( (ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_dlg_auth_ctx_t))) == NULL) {
+		return NGX_ERROR;
+	}
+	t = task->ctx;
+	t->conf = st->conf;
+	t->request = r;
+	t->task_timer = *(st->timer);
+	t->timer = &(t->task_timer);
+	t->now = st->now;
+	t->pwd_key = st->pwd_key;
+	t->pwds = st->pwds;
+	t->revocations = st->revocations;
+	t->rejection_log = st->rejection_log;
+#if (NGX_DLG_AUTH_OPENSSL)
+	/* The HMAC contexts of the worker are not shared with the pool threads */
+	t->hawkmac = NULL;
+#endif
+	t->unseal_rc = NGX_DECLINED;
+	t->grants_rc = NGX_DECLINED;
+	t->hmac_rc = NGX_DECLINED;
+	t->unsafe = st->unsafe;
+	t->error_len = 0;
+	t->pool = NULL;
 
 	/*
-	 * Now the request has been authenticated by way of Hawk and we use the ticket
-	 * itself to check access rights.
+	 * The request pool must not be used from the thread, tickets with many realms
+	 * get a pool of their own, destroyed with the request.
 	 */
+	ticket_init(&(t->ticket), ngx_dlg_auth_task_alloc, t);
+	cln->handler = ngx_dlg_auth_task_cleanup;
+	cln->data = t;
 
 	/*
-	 * Tickets contain a parameter rw which has to be set to true to grant
-	 * access using unsafe HTTP methods.
+	 * The Hawk context may point into itself, parse the header again rather than
+	 * copying it.
 	 */
-	if(IS_UNSAFE_METHOD(r->method)) {
-		if(ticket.rw == 0) {
-			ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Ticket does not represent grant for unsafe methods; client=%V",
-			    &(ctx->client));
-			return NGX_HTTP_FORBIDDEN;
-		}
+	if( (rc = ngx_dlg_auth_parse_header(r, t->conf, &(t->hawkc_ctx))) != NGX_OK) {
+		return rc;
 	}
 
-	/*
-	 * Check whether ticket has expired.
-	 */
-	if(ticket.exp < now) {
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Ticket has expired");
-		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	task->handler = ngx_dlg_auth_task_handler;
+	task->event.data = t;
+	task->event.handler = ngx_dlg_auth_task_done;
+
+	if(ngx_thread_task_post(t->conf->thread_pool, task) != NGX_OK) {
+		return NGX_ERROR;
 	}
 
-	/*
-	 * Now we check whether the ticket applies to the necessary realm.
-	 */
-	if(!ticket_has_realm(&ticket,conf->realm.data,conf->realm.len)) {
-	    /* Fixes https://github.com/algermissen/nginx-dlg-auth/issues/17 */
-		ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Ticket does not represent grant for access to realm %V; client=%V" ,
-		    &(conf->realm),&(ctx->client) );
-		return ngx_dlg_auth_send_simple_401(r,&(conf->realm));
+	t->posted = 1;
+	/* Keep the passwords from being freed by a reload of the password file */
+	if(t->pwds != NULL) {
+		t->pwds->busy++;
+	}
+	if(t->revocations != NULL) {
+		t->revocations->busy++;
 	}
+	r->main->blocked++;
+	r->aio = 1;
+	ctx->state = t;
+	ngx_http_set_ctx(r, ctx, nginx_dlg_auth_module);
 
-	return NGX_OK;
+	return NGX_AGAIN;
 }
 
+/*
+ * Thread pool task, runs in a thread.
+ */
+static void ngx_dlg_auth_task_handler(void *data, ngx_log_t *log) {
+	ngx_dlg_auth_unseal_and_validate(data);
+}
+
+/*
+ * Completion of the thread pool task, back in the event loop. Unblock the
+ * request and run the access phase again.
+ */
+static void ngx_dlg_auth_task_done(ngx_event_t *ev) {
+	ngx_http_dlg_auth_state_t *st = ev->data;
+	ngx_http_request_t *r = st->request;
+	ngx_connection_t *c = r->connection;
+
+	ngx_http_set_log_request(c->log, r);
+
+	st->posted = 0;
+	if(st->pwds != NULL) {
+		st->pwds->busy--;
+	}
+	if(st->revocations != NULL) {
+		st->revocations->busy--;
+	}
+	r->main->blocked--;
+	r->aio = 0;
+
+	r->write_event_handler(r);
+	ngx_http_run_posted_requests(c);
+}
+
+/*
+ * Ticket allocator of thread pool tasks.
+ */
+static void *ngx_dlg_auth_task_alloc(void *data, size_t size) {
+	ngx_http_dlg_auth_state_t *st = data;
+
+	if(st->pool == NULL) {
+		if( (st->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, st->request->connection->log)) == NULL) {
+			return NULL;
+		}
+	}
+	return ngx_palloc(st->pool, size);
+}
+
+static void ngx_dlg_auth_task_cleanup(void *data) {
+	ngx_http_dlg_auth_state_t *st = data;
+
+	if(st->pool != NULL) {
+		ngx_destroy_pool(st->pool);
+	}
+}
+
+#endif
+
 /*
  * Removing request headers is next to impossible in NGINX because
  * they come as an array. Removing would invalidate various pointers
@@ -883,44 +1986,210 @@ static void get_host_and_port(ngx_http_request_t *r,ngx_str_t host_header, ngx_s
 
 
 /*
- * Store the requesting client name in a variable.
+ * Keep what the variables and the checks of internal redirects and subrequests
+ * need of the ticket in the request context. Client, user, owner and the realms,
+ * separated by commas, are copied to the allocation of the context, followed by
+ * the realm strings and hashes for the realm check. Variables are formatted when
+ * used, see nginx_dlg_auth_var.c.
+ *
+ * The context is allocated as pool cleanup, so that it can be found again after
+ * the module context has been lost, see ngx_dlg_auth_find_verdict.
  */
-ngx_int_t store_client(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx,Ticket ticket) {
+static ngx_http_dlg_auth_ctx_t *ngx_dlg_auth_retain_ticket(ngx_http_request_t *r, Ticket ticket) {
+	ngx_http_dlg_auth_ctx_t *ctx;
+	ngx_pool_cleanup_t *cln;
+	size_t len;
+	size_t i;
+	u_char *p;
+
+	len = sizeof(ngx_http_dlg_auth_ctx_t) + ticket->nrealms * (sizeof(HawkcString) + sizeof(uint32_t));
+	len += ticket->client.len + ticket->user.len + ticket->owner.len;
+	for(i = 0; i < ticket->nrealms; i++) {
+		len += ticket->realms[i].len + 1;
+	}
+
+	if( (cln = ngx_pool_cleanup_add(r->pool, len)) == NULL) {
+		return NULL;
+	}
+	cln->handler = ngx_dlg_auth_ctx_cleanup;
+	ctx = cln->data;
+	ngx_memzero(ctx, sizeof(ngx_http_dlg_auth_ctx_t));
+	ngx_http_set_ctx(r, ctx, nginx_dlg_auth_module);
+
+	p = (u_char *) ctx + sizeof(ngx_http_dlg_auth_ctx_t);
+	ctx->realms = (HawkcString *) p;
+	p += ticket->nrealms * sizeof(HawkcString);
+	ctx->realm_hashes = (uint32_t *) p;
+	p = ngx_cpymem(p, ticket->realm_hashes, ticket->nrealms * sizeof(uint32_t));
+	ctx->nrealms = ticket->nrealms;
+
+	ctx->client.data = p;
+	ctx->client.len = ticket->client.len;
+	p = ngx_cpymem(p, ticket->client.data, ticket->client.len);
+	ctx->user.data = p;
+	ctx->user.len = ticket->user.len;
+	p = ngx_cpymem(p, ticket->user.data, ticket->user.len);
+	ctx->owner.data = p;
+	ctx->owner.len = ticket->owner.len;
+	p = ngx_cpymem(p, ticket->owner.data, ticket->owner.len);
+
+	ctx->scopes.data = p;
+	for(i = 0; i < ticket->nrealms; i++) {
+		if(i > 0) {
+			*p++ = ',';
+		}
+		ctx->realms[i].data = p;
+		ctx->realms[i].len = ticket->realms[i].len;
+		p = ngx_cpymem(p, ticket->realms[i].data, ticket->realms[i].len);
+	}
+	ctx->scopes.len = p - ctx->scopes.data;
 
-    if( ticket->client.len > 0) {
-	    if( (ctx->client.data = ngx_pcalloc(r->pool, ticket->client.len)) == NULL) {
-		    return NGX_ERROR;
-	    }
-	    memcpy(ctx->client.data,ticket->client.data,ticket->client.len);
-     }
-	 ctx->client.len = ticket->client.len;
-	 return NGX_OK;
+	ctx->expires = ticket->exp;
+	ctx->rw = ticket->rw;
+	ctx->has_ticket = 1;
+
+	return ctx;
 }
 
 /*
- * Store the expiry seconds of the ticket in a variable.
+ * Find the context of an authenticated request this request has been internally
+ * redirected from or is a subrequest of. The module context is cleared by
+ * internal redirects (including those to named locations) and subrequests start
+ * without one, but they share the pool of the main request, where the context is
+ * found among the cleanups. The list is short, a request has few cleanups.
+ *
+ * The ticket must have been unsealed with the passwords of the location.
  */
-ngx_int_t store_expires(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx,Ticket ticket) {
+static ngx_http_dlg_auth_ctx_t *ngx_dlg_auth_find_verdict(ngx_http_request_t *r, ngx_http_dlg_auth_loc_conf_t *conf) {
+	ngx_http_dlg_auth_ctx_t *ctx;
+	ngx_pool_cleanup_t *cln;
+
+	ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module);
+	if(ctx != NULL && ctx->verified && ctx->pwd_fingerprint == conf->pwd_fingerprint) {
+		return ctx;
+	}
+	for(cln = r->pool->cleanup; cln != NULL; cln = cln->next) {
+		if(cln->handler != ngx_dlg_auth_ctx_cleanup) {
+			continue;
+		}
+		ctx = cln->data;
+		if(ctx->verified && ctx->pwd_fingerprint == conf->pwd_fingerprint) {
+			ngx_http_set_ctx(r, ctx, nginx_dlg_auth_module);
+			return ctx;
+		}
+	}
+	return NULL;
+}
 
-	 /* 20 bytes is plenty for time_t value */
-	 if( (ctx->expires.data = ngx_pcalloc(r->pool, 20)) == NULL) {
-		 return NGX_ERROR;
-	 }
-	 ctx->expires.len = hawkc_ttoa(ctx->expires.data,ticket->exp);
-	 return NGX_OK;
+/*
+ * Marks the pool cleanups holding request contexts, there is nothing to clean up.
+ */
+static void ngx_dlg_auth_ctx_cleanup(void *data) {
 }
 
 /*
- * Store the clock skew in a variable.
+ * Add the shared memory zone given as directive value 'zone=name:size'. The size can
+ * be omitted to refer to a zone defined by another directive. A zone name must only be
+ * used by directives of one kind, identified by the zone init function.
+ *
+ * The init function is set by this function. If the zone is new, its data is NULL
+ * and must be set by the caller.
  */
-ngx_int_t store_clockskew(ngx_http_request_t *r, ngx_http_dlg_auth_ctx_t *ctx, time_t clockskew) {
+ngx_shm_zone_t *ngx_http_dlg_auth_add_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_shm_zone_init_pt init, size_t min_size) {
+	ngx_shm_zone_t *shm_zone;
+	ngx_str_t name;
+	ngx_str_t s;
+	ssize_t size;
+	u_char *p;
+
+	if(value->len <= 5 || ngx_strncmp(value->data, "zone=", 5) != 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", value);
+		return NULL;
+	}
+
+	name.data = value->data + 5;
+	name.len = value->len - 5;
+	size = 0;
+
+	if( (p = (u_char *) ngx_strlchr(name.data, name.data + name.len, ':')) != NULL) {
+		s.data = p + 1;
+		s.len = name.data + name.len - s.data;
+		name.len = p - name.data;
+
+		if( (size = ngx_parse_size(&s)) == NGX_ERROR) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", value);
+			return NULL;
+		}
+		if(size < (ssize_t) min_size) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small", value);
+			return NULL;
+		}
+	}
 
-	 /* 20 bytes is plenty for time_t value */
-	 if( (ctx->clockskew.data = ngx_pcalloc(r->pool, 20)) == NULL) {
-		 return NGX_ERROR;
-	 }
-	 ctx->clockskew.len = hawkc_ttoa(ctx->clockskew.data,clockskew);
-	 return NGX_OK;
+	if(name.len == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone name \"%V\"", value);
+		return NULL;
+	}
+
+	if( (shm_zone = ngx_shared_memory_add(cf, &name, size, &nginx_dlg_auth_module)) == NULL) {
+		return NULL;
+	}
+
+	if(shm_zone->data != NULL && shm_zone->init != init) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already used by another dlg_auth directive", &name);
+		return NULL;
+	}
+	shm_zone->init = init;
+
+	return shm_zone;
+}
+
+/*
+ * Allocator for the realm arrays of tickets with many realms and for password
+ * table indexes.
+ */
+static void *ngx_dlg_auth_pool_alloc(void *pool, size_t size) {
+	return ngx_palloc((ngx_pool_t *) pool, size);
+}
+
+/*
+ * Returns 1 if one of the ticket's realms is accepted by the location's realms.
+ * Exact realms are found by binary search on the realm hashes of the ticket,
+ * prefix patterns are compared byte-wise.
+ */
+static int ngx_dlg_auth_has_realm(ngx_http_dlg_auth_realms_t *realms, HawkcString *ticket_realms, uint32_t *hashes,
+		size_t nrealms) {
+	ngx_uint_t i, lo, hi, mid, k;
+	uint32_t h;
+	HawkcString *realm;
+
+	for(i = 0; i < nrealms; i++) {
+		realm = &(ticket_realms[i]);
+		h = hashes[i];
+		lo = 0;
+		hi = realms->nexact;
+		while(lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if(realms->exact[mid].hash < h) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		/* Different realms may share a hash, check all of them */
+		for(k = lo; k < realms->nexact && realms->exact[k].hash == h; k++) {
+			if(realms->exact[k].name.len == realm->len && ngx_memcmp(realms->exact[k].name.data, realm->data, realm->len) == 0) {
+				return 1;
+			}
+		}
+		for(k = 0; k < realms->nprefixes; k++) {
+			if(realm->len >= realms->prefixes[k].name.len
+					&& ngx_memcmp(realms->prefixes[k].name.data, realm->data, realms->prefixes[k].name.len) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
 }
 
 /*
@@ -939,6 +2208,161 @@ static int is_digits_only(ngx_str_t *str) {
     return 1;
 }
 
+/*
+ * Compute a fingerprint of the iron password(s) of a location. Tickets are cached
+ * together with the fingerprint so that a ticket unsealed in one location is never
+ * taken from the cache by a location that uses different passwords.
+ */
+static uint32_t pwd_fingerprint(ngx_http_dlg_auth_loc_conf_t *conf) {
+	uint32_t crc;
+
+	ngx_crc32_init(crc);
+	ngx_crc32_update(&crc, (u_char *) &(conf->iron_password.len), sizeof(conf->iron_password.len));
+	ngx_crc32_update(&crc, conf->iron_password.data, conf->iron_password.len);
+	if(conf->pwd_table != NULL && conf->pwd_table->file != NULL) {
+		/* Passwords change at runtime, see ngx_dlg_auth_authenticate */
+		ngx_crc32_update(&crc, conf->pwd_table->file->path.data, conf->pwd_table->file->path.len);
+	} else if(conf->pwd_table != NULL) {
+		ngx_crc32_update(&crc, (u_char *) &(conf->pwd_table->pwds->fingerprint), sizeof(uint32_t));
+	}
+	ngx_crc32_final(crc);
+
+	return crc;
+}
+
+/*
+ * Store a password table in the main configuration. Tables made of the
+ * dlg_auth_iron_pwd pairs of a location (name is NULL) are deduplicated, so
+ * that locations listing the same pairs share one table.
+ */
+static ngx_http_dlg_auth_pwd_table_t *add_pwd_table(ngx_conf_t *cf, ngx_http_dlg_auth_main_conf_t *mcf, ngx_str_t *name, ngx_array_t *entries) {
+	ngx_http_dlg_auth_pwd_table_t *table, **tables;
+	ngx_http_dlg_auth_pwds_t *pwds;
+	struct CironPwdTableEntry *e, *o;
+	ngx_uint_t i, k;
+
+	if( (pwds = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_pwds_t))) == NULL) {
+		return NULL;
+	}
+	if(ngx_http_dlg_auth_pwds_init(pwds, entries->elts, entries->nelts, ngx_dlg_auth_pool_alloc, cf->pool) != NGX_OK) {
+		return NULL;
+	}
+
+	e = entries->elts;
+	tables = mcf->pwd_tables.elts;
+	for(i = 0; name == NULL && i < mcf->pwd_tables.nelts; i++) {
+		table = tables[i];
+		if(table->name.len != 0 || table->pwds->fingerprint != pwds->fingerprint || table->pwds->table.nentries != entries->nelts) {
+			continue;
+		}
+		o = table->pwds->table.entries;
+		for(k = 0; k < entries->nelts; k++) {
+			if(o[k].password_id_len != e[k].password_id_len || o[k].password_len != e[k].password_len
+					|| ngx_memcmp(o[k].password_id, e[k].password_id, e[k].password_id_len) != 0
+					|| ngx_memcmp(o[k].password, e[k].password, e[k].password_len) != 0) {
+				break;
+			}
+		}
+		if(k == entries->nelts) {
+			return table;
+		}
+	}
+
+	if( (table = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_pwd_table_t))) == NULL) {
+		return NULL;
+	}
+	if( (tables = ngx_array_push(&(mcf->pwd_tables))) == NULL) {
+		return NULL;
+	}
+	*tables = table;
+	if(name != NULL) {
+		table->name = *name;
+	}
+	table->pwds = pwds;
+
+	return table;
+}
 
+ngx_http_dlg_auth_pwd_table_t *ngx_http_dlg_auth_find_pwd_table(ngx_http_dlg_auth_main_conf_t *mcf, ngx_str_t *name) {
+	ngx_http_dlg_auth_pwd_table_t **tables;
+	ngx_uint_t i;
 
+	tables = mcf->pwd_tables.elts;
+	for(i = 0; i < mcf->pwd_tables.nelts; i++) {
+		if(tables[i]->name.len == name->len && ngx_strncmp(tables[i]->name.data, name->data, name->len) == 0) {
+			return tables[i];
+		}
+	}
+	return NULL;
+}
 
+/*
+ * Set the password table of a location from its dlg_auth_iron_pwd directives,
+ * unless already done.
+ */
+static ngx_int_t resolve_pwd_table(ngx_conf_t *cf, ngx_http_dlg_auth_loc_conf_t *conf) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+
+	if(conf->pwd_table != NULL) {
+		return NGX_OK;
+	}
+	mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+
+	if(conf->pwd_table_name.len != 0) {
+		if( (conf->pwd_table = ngx_http_dlg_auth_find_pwd_table(mcf, &(conf->pwd_table_name))) != NULL) {
+			return NGX_OK;
+		}
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Unknown password table \"%V\"", &(conf->pwd_table_name));
+		return NGX_ERROR;
+	}
+	if(conf->pwd_entries != NULL) {
+		if( (conf->pwd_table = add_pwd_table(cf, mcf, NULL, conf->pwd_entries)) == NULL) {
+			return NGX_ERROR;
+		}
+	}
+	return NGX_OK;
+}
+
+/*
+ * Compile the dlg_auth arguments of a location into exact realms, sorted by
+ * hash, and prefix patterns.
+ */
+static ngx_http_dlg_auth_realms_t *compile_realms(ngx_conf_t *cf, ngx_array_t *args) {
+	ngx_http_dlg_auth_realms_t *realms;
+	ngx_http_dlg_auth_realm_t *realm;
+	ngx_str_t *arg;
+	ngx_uint_t i;
+
+	if( (realms = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_realms_t))) == NULL) {
+		return NULL;
+	}
+	if( (realms->exact = ngx_palloc(cf->pool, args->nelts * sizeof(ngx_http_dlg_auth_realm_t))) == NULL) {
+		return NULL;
+	}
+	if( (realms->prefixes = ngx_palloc(cf->pool, args->nelts * sizeof(ngx_http_dlg_auth_realm_t))) == NULL) {
+		return NULL;
+	}
+	arg = args->elts;
+	for(i = 0; i < args->nelts; i++) {
+		if(arg[i].data[arg[i].len - 1] == '*') {
+			realm = &(realms->prefixes[realms->nprefixes++]);
+			realm->name.data = arg[i].data;
+			realm->name.len = arg[i].len - 1;
+			realm->hash = 0;
+		} else {
+			realm = &(realms->exact[realms->nexact++]);
+			realm->name = arg[i];
+			realm->hash = ticket_realm_hash(arg[i].data, arg[i].len);
+		}
+	}
+	ngx_sort(realms->exact, realms->nexact, sizeof(ngx_http_dlg_auth_realm_t), cmp_realm_hash);
+
+	return realms;
+}
+
+static ngx_int_t cmp_realm_hash(const void *a, const void *b) {
+	uint32_t ha = ((const ngx_http_dlg_auth_realm_t *) a)->hash;
+	uint32_t hb = ((const ngx_http_dlg_auth_realm_t *) b)->hash;
+
+	return (ha < hb) ? -1 : (ha > hb);
+}
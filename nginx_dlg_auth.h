@@ -7,22 +7,247 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#include <nginx.h>
 #include <ngx_palloc.h>
 #include <ngx_crypt.h>
 #include <hawkc.h>
 #include <ciron.h>
 #include "ticket.h"
+#include "pwdindex.h"
 
+/*
+ * ciron user-provided buffer sizes. The size has been determined by using
+ * some usual tickets, observing the required sizes and then adding a fair amount of
+ * space. E.g. Having seen 350 bytes required I choose 1024 for the buffer. The sizes
+ * have since been raised to make room for tickets with a few hundred realms.
+ *
+ * We do size checking before using the buffer and report an error if the buffer
+ * sizes below are exceeded. More requirement for space rather indicates an attack,
+ * than normal use.
+ */
+#define ENCRYPTION_BUFFER_SIZE 8192
+#define OUTPUT_BUFFER_SIZE 4096
+
+/*
+ * Keep the periodic timers of the module from holding up worker exit on
+ * shutdown. Versions of nginx without cancelable timers wait for all timers,
+ * there the handlers stop rearming once the worker is exiting. Timers whose
+ * interval can be long are armed with ngx_http_dlg_auth_timer_poll instead,
+ * which caps it at a second on those versions. Their handlers must then check
+ * themselves whether the interval has passed.
+ */
+#if (nginx_version >= 1009001)
+#define ngx_http_dlg_auth_timer_cancelable(ev) (ev)->cancelable = 1
+#define ngx_http_dlg_auth_timer_poll(msec) (msec)
+#else
+#define ngx_http_dlg_auth_timer_cancelable(ev)
+#define ngx_http_dlg_auth_timer_poll(msec) ngx_min((ngx_msec_t) (msec), 1000)
+#endif
+
+/*
+ * Buffer size for unsealed and for cached tickets. Cached tickets carry a hash
+ * per realm and need more space than the unsealed ticket they are made from.
+ */
+#define TICKET_BUFFER_SIZE (2 * OUTPUT_BUFFER_SIZE + 256)
+
+/*
+ * A realm accepted by a location, either exact or a prefix pattern like 'NEWS:*'.
+ */
+typedef struct {
+    /* Hash of an exact realm, see ticket_realm_hash */
+    uint32_t hash;
+    /* The realm or, for prefix patterns, the prefix without the '*' */
+    ngx_str_t name;
+} ngx_http_dlg_auth_realm_t;
+
+/*
+ * Realms accepted by a location, compiled from the dlg_auth arguments during
+ * configuration merge and shared by all locations inheriting them. Exact realms
+ * are sorted by hash, so a ticket realm is looked up by binary search over the
+ * precomputed ticket realm hashes.
+ */
+typedef struct {
+    ngx_http_dlg_auth_realm_t *exact;
+    ngx_uint_t nexact;
+    ngx_http_dlg_auth_realm_t *prefixes;
+    ngx_uint_t nprefixes;
+} ngx_http_dlg_auth_realms_t;
+
+/*
+ * A set of iron passwords with an index over the password ids. Immutable once built.
+ */
+typedef struct {
+    struct CironPwdTable table;
+    /* Index over the password ids of table */
+    struct PwdIndex index;
+    /* crc32 over the entries */
+    uint32_t fingerprint;
+    /* Number of thread tasks using the passwords, only changed by the event loop */
+    ngx_uint_t busy;
+} ngx_http_dlg_auth_pwds_t;
+
+/*
+ * An iron password table, defined by dlg_auth_iron_pwd_table, read from a file
+ * with dlg_auth_iron_pwd_file or made of the dlg_auth_iron_pwd id/password pairs
+ * of a location. Tables are stored once and shared by all locations using them.
+ */
+typedef struct {
+    /* Table name, empty for tables made of dlg_auth_iron_pwd pairs */
+    ngx_str_t name;
+    /* Current passwords, replaced when the password file changes */
+    ngx_http_dlg_auth_pwds_t *pwds;
+    /* Password file, NULL for tables from the configuration, see nginx_dlg_auth_pwd.h */
+    struct ngx_http_dlg_auth_file_s *file;
+} ngx_http_dlg_auth_pwd_table_t;
+
+/*
+ * Module per-location configuration.
+ */
+typedef struct {
+	/* First dlg_auth realm, used for the WWW-Authenticate challenge and statistics */
+    ngx_str_t realm;
+
+    /* All dlg_auth arguments, NULL if dlg_auth is not set */
+    ngx_array_t *realm_args;
+
+    /* Compiled realm_args, a ticket must grant access to one of them */
+    ngx_http_dlg_auth_realms_t *realms;
+
+    /* Whether dlg_auth applies to this location, resolved during merge */
+    ngx_flag_t enabled;
+
+    /* iron password to unseal received access tickets. */
+    ngx_str_t iron_password;
+
+    /* dlg_auth_iron_pwd id/password pairs of this location, NULL if none */
+    ngx_array_t *pwd_entries;
+
+    /* Name of the table set by dlg_auth_iron_pwd table=<name> */
+    ngx_str_t pwd_table_name;
+
+    /* iron password table for password rotation, NULL if none */
+    ngx_http_dlg_auth_pwd_table_t *pwd_table;
+
+    /* Allowed skew when comparing request timestamp with our own clock */
+    ngx_uint_t allowed_clock_skew;
+
+    /* Host to use for signature validation instead of request host */
+    ngx_str_t  host;
+
+    /* Port to use for signature validation instead of request port */
+    ngx_str_t  port;
+
+    /* Whether to cache unsealed tickets */
+    ngx_flag_t cache_tickets;
+
+    /* Shared memory cache of unsealed tickets, NULL for per worker caching only */
+    ngx_shm_zone_t *ticket_cache;
+
+    /* Number of tickets remembered per client connection, 0 disables it */
+    ngx_uint_t connection_cache_size;
+
+    /* Fingerprint of the iron passwords, used to key cached tickets */
+    uint32_t pwd_fingerprint;
+
+    /* Shared memory nonce store for replay protection, NULL if not used */
+    ngx_shm_zone_t *nonce_cache;
+
+    /* Shared memory cache of tickets that failed to unseal, NULL if not used */
+    ngx_shm_zone_t *negative_cache;
+
+    /* Shared memory zone of per client rate limits, NULL if not limited */
+    ngx_shm_zone_t *limit;
+
+    /* Number of requests a client may exceed the rate by */
+    ngx_uint_t limit_burst;
+
+#if (NGX_THREADS)
+    /* Thread pool to unseal tickets in, NULL to unseal in the event loop */
+    ngx_thread_pool_t *thread_pool;
+#endif
+
+    /* Index of the realm in the request statistics */
+    ngx_uint_t stats_realm;
+
+} ngx_http_dlg_auth_loc_conf_t;
+
+/*
+ * Module main configuration.
+ */
+typedef struct {
+	/* Whether any location enables dlg_auth */
+	ngx_flag_t enabled;
+
+	/* Password tables, pointers to ngx_http_dlg_auth_pwd_table_t */
+	ngx_array_t pwd_tables;
+
+	/* Number of entries of the per worker ticket cache, 0 disables it */
+	ngx_uint_t worker_ticket_cache_size;
+
+	/* Revoked clients and tickets, NULL if there is no revocation file */
+	struct ngx_http_dlg_auth_file_s *revocation_file;
+
+	/* Rejection counters and sampling, NULL to log every rejection */
+	struct ngx_http_dlg_auth_rejection_log_s *rejection_log;
+
+	/* Realms of all locations, statistics are kept per realm */
+	ngx_array_t realms;
+
+	/* Whether dlg_auth_status is used anywhere */
+	ngx_flag_t status;
+
+	/* Shared memory zone of the request statistics, NULL if not collected */
+	ngx_shm_zone_t *stats_zone;
+} ngx_http_dlg_auth_main_conf_t;
+
+/*
+ * Authentication state of a request, see nginx_dlg_auth.c.
+ */
+typedef struct ngx_http_dlg_auth_state_s ngx_http_dlg_auth_state_t;
+
+/*
+ * Per request context. Holds what the $dlg_auth_* variables and the checks of
+ * internal redirects and subrequests need of the ticket, see
+ * ngx_dlg_auth_retain_ticket.
+ */
 typedef struct {
 	ngx_str_t client;
 	ngx_str_t user;
 	ngx_str_t owner;
-	ngx_str_t expires;
-	ngx_str_t clockskew;
+	/* Realms of the ticket, separated by commas */
+	ngx_str_t scopes;
+	/* Realms of the ticket and their hashes, nrealms each */
+	HawkcString *realms;
+	uint32_t *realm_hashes;
+	size_t nrealms;
+	time_t expires;
+	int rw;
+	/* Request timestamp relative to our clock, set once the signature is valid */
+	time_t clockskew;
+	/* Password fingerprint of the location that authenticated the request */
+	uint32_t pwd_fingerprint;
+	unsigned has_ticket:1;
+	unsigned has_clockskew:1;
+	/* Whether signature, clock skew and nonce have been checked successfully */
+	unsigned verified:1;
+#if (NGX_THREADS)
+	/* Authentication waiting for its thread task, NULL if none */
+	ngx_http_dlg_auth_state_t *state;
+#endif
 } ngx_http_dlg_auth_ctx_t;
 
 ngx_module_t  nginx_dlg_auth_module;
 
+/*
+ * Find a named password table, returns NULL if there is none.
+ */
+ngx_http_dlg_auth_pwd_table_t *ngx_http_dlg_auth_find_pwd_table(ngx_http_dlg_auth_main_conf_t *mcf, ngx_str_t *name);
+
+/*
+ * Add a shared memory zone given as 'zone=name:size' directive value.
+ */
+ngx_shm_zone_t *ngx_http_dlg_auth_add_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_shm_zone_init_pt init, size_t min_size);
+
 #endif /* NGX_HTTP_DLG_H */
 
 
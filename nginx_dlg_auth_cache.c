@@ -0,0 +1,1350 @@
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+#include "ticket.h"
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_cache.h"
+
+/*
+ * Minimum size of a ticket cache zone. Below that, the slab allocator overhead
+ * leaves hardly any room for entries.
+ */
+#define MIN_CACHE_ZONE_SIZE (8 * ngx_pagesize)
+
+/*
+ * Seconds between snapshots of a zone and, when workers exit, the least time
+ * since the last one. Only one worker writes a snapshot.
+ */
+#define SNAPSHOT_INTERVAL 300
+#define SNAPSHOT_EXIT_INTERVAL 10
+
+/*
+ * An unsealed snapshot starts with this magic, followed by one record per
+ * entry, most recently used first: the uint32_t fingerprint, the u_short
+ * lengths of the sealed and the binary ticket (see ticket.h) and the bytes of
+ * both. The binary ticket names the Hawk algorithm, unlike packed tickets,
+ * so a snapshot can be loaded by another nginx binary.
+ */
+#define SNAPSHOT_MAGIC "DLGTC01\n"
+#define SNAPSHOT_MAGIC_LEN (sizeof(SNAPSHOT_MAGIC) - 1)
+#define SNAPSHOT_RECORD_LEN (sizeof(uint32_t) + 2 * sizeof(u_short))
+
+/*
+ * Shared part of the cache: the tree for lookup and the queue for LRU order.
+ */
+typedef struct {
+	ngx_rbtree_t rbtree;
+	ngx_rbtree_node_t sentinel;
+	ngx_queue_t queue;
+	ngx_atomic_t hits;
+	ngx_atomic_t misses;
+	/* Time of the last snapshot, the worker that moves it on writes the next one */
+	ngx_atomic_t snapshot_time;
+} ngx_http_dlg_auth_cache_sh_t;
+
+/*
+ * Per zone data, accessible via shm_zone->data.
+ */
+typedef struct {
+	ngx_http_dlg_auth_cache_sh_t *sh;
+	ngx_slab_pool_t *shpool;
+	/* Zero terminated path of the snapshot file, empty if there is none */
+	ngx_str_t snapshot;
+	/* Locations using the zone, their passwords seal the snapshot, NULL if none */
+	ngx_array_t *locations;
+	ngx_event_t snapshot_event;
+} ngx_http_dlg_auth_cache_t;
+
+/*
+ * A cache entry. The sealed ticket (id_len bytes) is followed by
+ * the packed ticket (ticket_len bytes).
+ */
+typedef struct {
+	ngx_rbtree_node_t node;
+	ngx_queue_t queue;
+	uint32_t fingerprint;
+	time_t expires;
+	u_short id_len;
+	u_short ticket_len;
+	u_char data[1];
+} ngx_http_dlg_auth_cache_node_t;
+
+/*
+ * Fixed size part of a packed ticket. It is followed by client, user, owner
+ * and pwd bytes and then by every realm, each prefixed by its u_short length
+ * and its uint32_t hash.
+ *
+ * The Hawk algorithm is stored as pointer, which is fine because the zone is
+ * only shared by worker processes running the same binary.
+ */
+typedef struct {
+	time_t exp;
+	HawkcAlgorithm hawkAlgorithm;
+	int rw;
+	u_short client_len;
+	u_short user_len;
+	u_short owner_len;
+	u_short pwd_len;
+	u_short nrealms;
+} ngx_http_dlg_auth_packed_ticket_t;
+
+/*
+ * A slot of the per worker cache. Same as a shared cache entry, the
+ * sealed ticket is followed by the packed ticket in data.
+ */
+typedef struct {
+	uint32_t hash;
+	uint32_t fingerprint;
+	time_t expires;
+	size_t id_len;
+	size_t ticket_len;
+	size_t size;
+	u_char *data;
+} ngx_http_dlg_auth_l1_slot_t;
+
+/*
+ * The per worker cache is 2-way set associative. last is the way used most
+ * recently, the other one is replaced on a miss.
+ */
+typedef struct {
+	ngx_http_dlg_auth_l1_slot_t way[2];
+	ngx_uint_t last;
+} ngx_http_dlg_auth_l1_set_t;
+
+typedef struct {
+	ngx_http_dlg_auth_l1_set_t *sets;
+	ngx_uint_t nsets;
+	ngx_uint_t hits;
+	ngx_uint_t misses;
+	ngx_log_t *log;
+} ngx_http_dlg_auth_l1_t;
+
+/*
+ * Each worker process has its own cache, so no locking is needed.
+ */
+static ngx_http_dlg_auth_l1_t ngx_http_dlg_auth_l1;
+
+/*
+ * Cache of a client connection, allocated with its pool cleanup. Slots are
+ * kept in most recently used order, the last one is replaced on a miss.
+ * The hash of the slots is not used.
+ */
+typedef struct {
+	ngx_uint_t nslots;
+	ngx_log_t *log;
+	ngx_http_dlg_auth_l1_slot_t slots[1];
+} ngx_http_dlg_auth_conn_cache_t;
+
+static ngx_int_t ngx_http_dlg_auth_l1_lookup(uint32_t hash, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, size_t *len);
+static void ngx_http_dlg_auth_l1_store(uint32_t hash, uint32_t fingerprint, HawkcString *id,
+		time_t expires, u_char *ticket, size_t ticket_len);
+static ngx_connection_t *ngx_http_dlg_auth_client_connection(ngx_http_request_t *r);
+static ngx_http_dlg_auth_conn_cache_t *ngx_http_dlg_auth_conn_cache_get(ngx_connection_t *c);
+static void ngx_http_dlg_auth_conn_cache_cleanup(void *data);
+static ngx_int_t ngx_http_dlg_auth_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_dlg_auth_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+		ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_dlg_auth_cache_cmp(uint32_t fingerprint, u_char *id, size_t id_len,
+		ngx_http_dlg_auth_cache_node_t *cn);
+static uint32_t ngx_http_dlg_auth_cache_hash(uint32_t fingerprint, HawkcString *id);
+static ngx_http_dlg_auth_cache_node_t *ngx_http_dlg_auth_cache_find(ngx_http_dlg_auth_cache_t *cache,
+		uint32_t hash, uint32_t fingerprint, HawkcString *id);
+static void ngx_http_dlg_auth_cache_delete(ngx_http_dlg_auth_cache_t *cache, ngx_http_dlg_auth_cache_node_t *cn);
+static void ngx_http_dlg_auth_cache_expire(ngx_http_dlg_auth_cache_t *cache, time_t now, ngx_uint_t force);
+static ngx_int_t ngx_http_dlg_auth_cache_is_zone(ngx_shm_zone_t *zone);
+static void ngx_http_dlg_auth_cache_snapshot_timer(ngx_event_t *ev);
+static void ngx_http_dlg_auth_cache_save(ngx_http_dlg_auth_cache_t *cache, time_t min_age, ngx_log_t *log);
+static u_char *ngx_http_dlg_auth_cache_dump(ngx_http_dlg_auth_cache_t *cache, size_t *len, ngx_log_t *log);
+static ngx_int_t ngx_http_dlg_auth_cache_write(ngx_http_dlg_auth_cache_t *cache, u_char *data, size_t len, ngx_log_t *log);
+static void ngx_http_dlg_auth_cache_load(ngx_http_dlg_auth_cache_t *cache, ngx_log_t *log);
+static ngx_uint_t ngx_http_dlg_auth_cache_restore(ngx_http_dlg_auth_cache_t *cache, u_char *p, u_char *last,
+		ngx_pool_t *pool, ngx_log_t *log);
+static void *ngx_http_dlg_auth_cache_pool_alloc(void *pool, size_t size);
+
+
+/*
+ * Parse 'zone=name:size [snapshot=path]', 'worker' or 'off'.
+ */
+char *ngx_http_dlg_auth_ticket_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_loc_conf_t *lcf;
+	ngx_shm_zone_t *shm_zone;
+	ngx_http_dlg_auth_cache_t *cache;
+	ngx_str_t *value;
+	ngx_str_t snapshot;
+
+	lcf = conf;
+	if(lcf->cache_tickets != NGX_CONF_UNSET) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(cf->args->nelts == 2 && value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		lcf->cache_tickets = 0;
+		return NGX_CONF_OK;
+	}
+
+	lcf->cache_tickets = 1;
+
+	if(cf->args->nelts == 2 && value[1].len == 6 && ngx_strncmp(value[1].data, "worker", 6) == 0) {
+		return NGX_CONF_OK;
+	}
+
+	snapshot.len = 0;
+	snapshot.data = NULL;
+	if(cf->args->nelts == 3) {
+		if(value[2].len <= 9 || ngx_strncmp(value[2].data, "snapshot=", 9) != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+		snapshot.data = value[2].data + 9;
+		snapshot.len = value[2].len - 9;
+		if(ngx_conf_full_name(cf->cycle, &snapshot, 0) != NGX_OK) {
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if( (shm_zone = ngx_http_dlg_auth_add_zone(cf, &value[1], ngx_http_dlg_auth_cache_init_zone, MIN_CACHE_ZONE_SIZE)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	lcf->ticket_cache = shm_zone;
+	if( (cache = shm_zone->data) == NULL) {
+		if( (cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_cache_t))) == NULL) {
+			return NGX_CONF_ERROR;
+		}
+		shm_zone->data = cache;
+	}
+	if(snapshot.len > 0) {
+		if(cache->snapshot.len > 0 && (cache->snapshot.len != snapshot.len
+				|| ngx_strncmp(cache->snapshot.data, snapshot.data, snapshot.len) != 0)) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "conflicting snapshot for dlg_auth_ticket_cache zone \"%V\"",
+					&shm_zone->shm.name);
+			return NGX_CONF_ERROR;
+		}
+		cache->snapshot = snapshot;
+	}
+
+	return NGX_CONF_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_cache_add_location(ngx_conf_t *cf, ngx_http_dlg_auth_loc_conf_t *conf) {
+	ngx_http_dlg_auth_cache_t *cache;
+	ngx_http_dlg_auth_loc_conf_t **lcfp;
+
+	cache = conf->ticket_cache->data;
+	if(cache->locations == NULL) {
+		if( (cache->locations = ngx_array_create(cf->pool, 4, sizeof(ngx_http_dlg_auth_loc_conf_t *))) == NULL) {
+			return NGX_ERROR;
+		}
+	}
+	if( (lcfp = ngx_array_push(cache->locations)) == NULL) {
+		return NGX_ERROR;
+	}
+	*lcfp = conf;
+	return NGX_OK;
+}
+
+/*
+ * Set up the shared part of the zone, or take it over from the previous
+ * cycle on reload.
+ */
+static ngx_int_t ngx_http_dlg_auth_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_cache_t *ocache = data;
+	ngx_http_dlg_auth_cache_t *cache;
+	size_t len;
+
+	cache = shm_zone->data;
+
+	if(ocache != NULL) {
+		cache->sh = ocache->sh;
+		cache->shpool = ocache->shpool;
+		return NGX_OK;
+	}
+
+	cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		cache->sh = cache->shpool->data;
+		return NGX_OK;
+	}
+
+	if( (cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_dlg_auth_cache_sh_t))) == NULL) {
+		return NGX_ERROR;
+	}
+	cache->shpool->data = cache->sh;
+	cache->sh->hits = 0;
+	cache->sh->misses = 0;
+
+	ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel, ngx_http_dlg_auth_cache_rbtree_insert_value);
+	ngx_queue_init(&cache->sh->queue);
+
+	len = sizeof(" in dlg_auth_ticket_cache zone \"\"") + shm_zone->shm.name.len;
+	if( (cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(cache->shpool->log_ctx, " in dlg_auth_ticket_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	cache->sh->snapshot_time = (ngx_atomic_uint_t) ngx_time();
+	if(cache->snapshot.len > 0) {
+		ngx_http_dlg_auth_cache_load(cache, shm_zone->shm.log);
+	}
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_cache_lookup(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, Ticket ticket) {
+	ngx_http_dlg_auth_cache_t *cache;
+	ngx_http_dlg_auth_cache_node_t *cn;
+	uint32_t hash;
+	time_t expires;
+	size_t len;
+
+	hash = ngx_http_dlg_auth_cache_hash(fingerprint, id);
+
+	/*
+	 * Try the per worker cache first, it does not need the zone lock.
+	 */
+	if(ngx_http_dlg_auth_l1_lookup(hash, fingerprint, id, now, buf, size, &len) == NGX_OK) {
+		return ngx_http_dlg_auth_ticket_unpack(ticket, buf, len) == NGX_OK ? NGX_OK : NGX_DECLINED;
+	}
+
+	if(zone == NULL) {
+		return NGX_DECLINED;
+	}
+	cache = zone->data;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	if( (cn = ngx_http_dlg_auth_cache_find(cache, hash, fingerprint, id)) == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		(void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+		return NGX_DECLINED;
+	}
+
+	if(cn->expires < now) {
+		ngx_http_dlg_auth_cache_delete(cache, cn);
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		(void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+		return NGX_DECLINED;
+	}
+
+	if(cn->ticket_len > size) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		(void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+		return NGX_DECLINED;
+	}
+
+	ngx_queue_remove(&cn->queue);
+	ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+	len = cn->ticket_len;
+	expires = cn->expires;
+	ngx_memcpy(buf, cn->data + cn->id_len, len);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+	(void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+
+	ngx_http_dlg_auth_l1_store(hash, fingerprint, id, expires, buf, len);
+
+	if(ngx_http_dlg_auth_ticket_unpack(ticket, buf, len) != NGX_OK) {
+		return NGX_DECLINED;
+	}
+	return NGX_OK;
+}
+
+void ngx_http_dlg_auth_cache_store(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id,
+		Ticket ticket, time_t now, ngx_log_t *log) {
+	ngx_http_dlg_auth_cache_t *cache;
+	ngx_http_dlg_auth_cache_node_t *cn;
+	u_char packed[TICKET_BUFFER_SIZE];
+	size_t packed_len;
+	uint32_t hash;
+	size_t n;
+
+	/*
+	 * Expired tickets are rejected anyway, no need to remember them.
+	 */
+	if(ticket->exp < now || id->len > 0xffff) {
+		return;
+	}
+
+	if( (packed_len = ngx_http_dlg_auth_ticket_pack(ticket, packed, sizeof(packed))) == 0) {
+		ngx_log_error(NGX_LOG_INFO, log, 0, "Ticket too large for dlg_auth_ticket_cache, not caching it");
+		return;
+	}
+
+	hash = ngx_http_dlg_auth_cache_hash(fingerprint, id);
+
+	ngx_http_dlg_auth_l1_store(hash, fingerprint, id, ticket->exp, packed, packed_len);
+
+	if(zone == NULL) {
+		return;
+	}
+	cache = zone->data;
+	n = offsetof(ngx_http_dlg_auth_cache_node_t, data) + id->len + packed_len;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+
+	/*
+	 * Another worker might have unsealed the same ticket concurrently.
+	 */
+	if( (cn = ngx_http_dlg_auth_cache_find(cache, hash, fingerprint, id)) != NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return;
+	}
+
+	ngx_http_dlg_auth_cache_expire(cache, now, 0);
+
+	if( (cn = ngx_slab_alloc_locked(cache->shpool, n)) == NULL) {
+		ngx_http_dlg_auth_cache_expire(cache, now, 1);
+		if( (cn = ngx_slab_alloc_locked(cache->shpool, n)) == NULL) {
+			ngx_shmtx_unlock(&cache->shpool->mutex);
+			ngx_log_error(NGX_LOG_WARN, log, 0, "Unable to allocate ticket cache entry%s", cache->shpool->log_ctx);
+			return;
+		}
+	}
+
+	cn->node.key = hash;
+	cn->fingerprint = fingerprint;
+	cn->expires = ticket->exp;
+	cn->id_len = (u_short) id->len;
+	cn->ticket_len = (u_short) packed_len;
+	ngx_memcpy(cn->data, id->data, id->len);
+	ngx_memcpy(cn->data + id->len, packed, packed_len);
+
+	ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+	ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+ngx_int_t ngx_http_dlg_auth_cache_init_worker(ngx_cycle_t *cycle, ngx_uint_t entries) {
+	ngx_http_dlg_auth_l1.nsets = (entries + 1) / 2;
+	ngx_http_dlg_auth_l1.log = cycle->log;
+	if(ngx_http_dlg_auth_l1.nsets == 0) {
+		return NGX_OK;
+	}
+	if( (ngx_http_dlg_auth_l1.sets = ngx_calloc(ngx_http_dlg_auth_l1.nsets * sizeof(ngx_http_dlg_auth_l1_set_t),
+			cycle->log)) == NULL) {
+		ngx_http_dlg_auth_l1.nsets = 0;
+		return NGX_ERROR;
+	}
+	return NGX_OK;
+}
+
+void ngx_http_dlg_auth_cache_worker_stats(ngx_uint_t *hits, ngx_uint_t *misses) {
+	*hits = ngx_http_dlg_auth_l1.hits;
+	*misses = ngx_http_dlg_auth_l1.misses;
+}
+
+void ngx_http_dlg_auth_cache_zone_stats(ngx_shm_zone_t *zone, ngx_atomic_uint_t *hits, ngx_atomic_uint_t *misses) {
+	ngx_http_dlg_auth_cache_t *cache;
+
+	cache = zone->data;
+	*hits = cache->sh->hits;
+	*misses = cache->sh->misses;
+}
+
+static ngx_int_t ngx_http_dlg_auth_l1_lookup(uint32_t hash, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, size_t *len) {
+	ngx_http_dlg_auth_l1_set_t *set;
+	ngx_http_dlg_auth_l1_slot_t *slot;
+	ngx_uint_t i;
+
+	if(ngx_http_dlg_auth_l1.nsets == 0) {
+		return NGX_DECLINED;
+	}
+
+	set = &(ngx_http_dlg_auth_l1.sets[hash % ngx_http_dlg_auth_l1.nsets]);
+	for(i = 0; i < 2; i++) {
+		slot = &(set->way[i]);
+		if(slot->data == NULL || slot->hash != hash || slot->fingerprint != fingerprint
+				|| slot->id_len != id->len || ngx_memcmp(slot->data, id->data, id->len) != 0) {
+			continue;
+		}
+		if(slot->expires < now || slot->ticket_len > size) {
+			break;
+		}
+		ngx_memcpy(buf, slot->data + slot->id_len, slot->ticket_len);
+		*len = slot->ticket_len;
+		set->last = i;
+		ngx_http_dlg_auth_l1.hits++;
+		return NGX_OK;
+	}
+
+	ngx_http_dlg_auth_l1.misses++;
+	return NGX_DECLINED;
+}
+
+static void ngx_http_dlg_auth_l1_store(uint32_t hash, uint32_t fingerprint, HawkcString *id,
+		time_t expires, u_char *ticket, size_t ticket_len) {
+	ngx_http_dlg_auth_l1_set_t *set;
+	ngx_http_dlg_auth_l1_slot_t *slot;
+	ngx_uint_t i;
+	size_t n;
+
+	if(ngx_http_dlg_auth_l1.nsets == 0) {
+		return;
+	}
+
+	set = &(ngx_http_dlg_auth_l1.sets[hash % ngx_http_dlg_auth_l1.nsets]);
+
+	/*
+	 * Reuse a slot holding the same ticket, otherwise replace
+	 * the least recently used way.
+	 */
+	for(i = 0; i < 2; i++) {
+		slot = &(set->way[i]);
+		if(slot->data != NULL && slot->hash == hash && slot->fingerprint == fingerprint
+				&& slot->id_len == id->len && ngx_memcmp(slot->data, id->data, id->len) == 0) {
+			break;
+		}
+	}
+	if(i == 2) {
+		i = 1 - set->last;
+		slot = &(set->way[i]);
+	}
+
+	n = id->len + ticket_len;
+	if(slot->size < n) {
+		if(slot->data != NULL) {
+			ngx_free(slot->data);
+			slot->data = NULL;
+			slot->size = 0;
+		}
+		if( (slot->data = ngx_alloc(n, ngx_http_dlg_auth_l1.log)) == NULL) {
+			return;
+		}
+		slot->size = n;
+	}
+
+	slot->hash = hash;
+	slot->fingerprint = fingerprint;
+	slot->expires = expires;
+	slot->id_len = id->len;
+	slot->ticket_len = ticket_len;
+	ngx_memcpy(slot->data, id->data, id->len);
+	ngx_memcpy(slot->data + id->len, ticket, ticket_len);
+	set->last = i;
+}
+
+ngx_int_t ngx_http_dlg_auth_conn_cache_lookup(ngx_http_request_t *r, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, Ticket ticket) {
+	ngx_http_dlg_auth_conn_cache_t *cc;
+	ngx_http_dlg_auth_l1_slot_t *slot, hit;
+	ngx_uint_t i;
+
+	if( (cc = ngx_http_dlg_auth_conn_cache_get(ngx_http_dlg_auth_client_connection(r))) == NULL) {
+		return NGX_DECLINED;
+	}
+
+	for(i = 0; i < cc->nslots; i++) {
+		slot = &(cc->slots[i]);
+		if(slot->data == NULL || slot->fingerprint != fingerprint || slot->id_len != id->len
+				|| ngx_memcmp(slot->data, id->data, id->len) != 0) {
+			continue;
+		}
+		if(slot->expires < now || slot->ticket_len > size) {
+			return NGX_DECLINED;
+		}
+		ngx_memcpy(buf, slot->data + slot->id_len, slot->ticket_len);
+		if(i > 0) {
+			hit = *slot;
+			ngx_memmove(&(cc->slots[1]), &(cc->slots[0]), i * sizeof(ngx_http_dlg_auth_l1_slot_t));
+			cc->slots[0] = hit;
+		}
+		return ngx_http_dlg_auth_ticket_unpack(ticket, buf, cc->slots[0].ticket_len) == NGX_OK ? NGX_OK : NGX_DECLINED;
+	}
+
+	return NGX_DECLINED;
+}
+
+void ngx_http_dlg_auth_conn_cache_store(ngx_http_request_t *r, ngx_uint_t entries, uint32_t fingerprint,
+		HawkcString *id, Ticket ticket, time_t now) {
+	ngx_http_dlg_auth_conn_cache_t *cc;
+	ngx_http_dlg_auth_l1_slot_t *slot, reuse;
+	ngx_pool_cleanup_t *cln;
+	ngx_connection_t *c;
+	u_char packed[TICKET_BUFFER_SIZE];
+	size_t packed_len, n;
+	ngx_uint_t i;
+
+	if(ticket->exp < now) {
+		return;
+	}
+	if( (packed_len = ngx_http_dlg_auth_ticket_pack(ticket, packed, sizeof(packed))) == 0) {
+		return;
+	}
+
+	c = ngx_http_dlg_auth_client_connection(r);
+	if( (cc = ngx_http_dlg_auth_conn_cache_get(c)) == NULL) {
+		n = sizeof(ngx_http_dlg_auth_conn_cache_t) + (entries - 1) * sizeof(ngx_http_dlg_auth_l1_slot_t);
+		if( (cln = ngx_pool_cleanup_add(c->pool, n)) == NULL) {
+			return;
+		}
+		cc = cln->data;
+		ngx_memzero(cc, n);
+		cc->nslots = entries;
+		cc->log = c->log;
+		cln->handler = ngx_http_dlg_auth_conn_cache_cleanup;
+	}
+
+	/*
+	 * Reuse the slot of the same ticket, if any, otherwise the least recently
+	 * used one, and move it to the front.
+	 */
+	for(i = 0; i < cc->nslots - 1; i++) {
+		slot = &(cc->slots[i]);
+		if(slot->data == NULL || (slot->fingerprint == fingerprint && slot->id_len == id->len
+				&& ngx_memcmp(slot->data, id->data, id->len) == 0)) {
+			break;
+		}
+	}
+	if(i > 0) {
+		reuse = cc->slots[i];
+		ngx_memmove(&(cc->slots[1]), &(cc->slots[0]), i * sizeof(ngx_http_dlg_auth_l1_slot_t));
+		cc->slots[0] = reuse;
+	}
+	slot = &(cc->slots[0]);
+
+	n = id->len + packed_len;
+	if(slot->size < n) {
+		if(slot->data != NULL) {
+			ngx_free(slot->data);
+			ngx_memzero(slot, sizeof(ngx_http_dlg_auth_l1_slot_t));
+		}
+		if( (slot->data = ngx_alloc(n, cc->log)) == NULL) {
+			return;
+		}
+		slot->size = n;
+	}
+
+	slot->fingerprint = fingerprint;
+	slot->expires = ticket->exp;
+	slot->id_len = id->len;
+	slot->ticket_len = packed_len;
+	ngx_memcpy(slot->data, id->data, id->len);
+	ngx_memcpy(slot->data + id->len, packed, packed_len);
+}
+
+/*
+ * The connection the client is talking to us on. HTTP/2 streams have fake
+ * connections of their own, their cache belongs to the real one.
+ */
+static ngx_connection_t *ngx_http_dlg_auth_client_connection(ngx_http_request_t *r) {
+#if (NGX_HTTP_V2)
+	if(r->stream != NULL) {
+		return r->stream->connection->connection;
+	}
+#endif
+	return r->connection;
+}
+
+/*
+ * Find the cache of a connection among the cleanups of its pool, NULL if
+ * there is none yet.
+ */
+static ngx_http_dlg_auth_conn_cache_t *ngx_http_dlg_auth_conn_cache_get(ngx_connection_t *c) {
+	ngx_pool_cleanup_t *cln;
+
+	for(cln = c->pool->cleanup; cln != NULL; cln = cln->next) {
+		if(cln->handler == ngx_http_dlg_auth_conn_cache_cleanup) {
+			return cln->data;
+		}
+	}
+	return NULL;
+}
+
+static void ngx_http_dlg_auth_conn_cache_cleanup(void *data) {
+	ngx_http_dlg_auth_conn_cache_t *cc = data;
+	ngx_uint_t i;
+
+	for(i = 0; i < cc->nslots; i++) {
+		if(cc->slots[i].data != NULL) {
+			ngx_free(cc->slots[i].data);
+		}
+	}
+}
+
+/*
+ * Remove up to two expired entries from the LRU end of the queue. If force is
+ * set, the least recently used entry is removed in any case to make room.
+ */
+static void ngx_http_dlg_auth_cache_expire(ngx_http_dlg_auth_cache_t *cache, time_t now, ngx_uint_t force) {
+	ngx_http_dlg_auth_cache_node_t *cn;
+	ngx_queue_t *q;
+	ngx_uint_t n;
+
+	for(n = 0; n < 3; n++) {
+		if(ngx_queue_empty(&cache->sh->queue)) {
+			return;
+		}
+		q = ngx_queue_last(&cache->sh->queue);
+		cn = ngx_queue_data(q, ngx_http_dlg_auth_cache_node_t, queue);
+
+		if(!force && cn->expires >= now) {
+			return;
+		}
+		force = 0;
+		ngx_http_dlg_auth_cache_delete(cache, cn);
+	}
+}
+
+static void ngx_http_dlg_auth_cache_delete(ngx_http_dlg_auth_cache_t *cache, ngx_http_dlg_auth_cache_node_t *cn) {
+	ngx_queue_remove(&cn->queue);
+	ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+	ngx_slab_free_locked(cache->shpool, cn);
+}
+
+static ngx_http_dlg_auth_cache_node_t *ngx_http_dlg_auth_cache_find(ngx_http_dlg_auth_cache_t *cache,
+		uint32_t hash, uint32_t fingerprint, HawkcString *id) {
+	ngx_rbtree_node_t *node;
+	ngx_rbtree_node_t *sentinel;
+	ngx_http_dlg_auth_cache_node_t *cn;
+	ngx_int_t rc;
+
+	node = cache->sh->rbtree.root;
+	sentinel = cache->sh->rbtree.sentinel;
+
+	while(node != sentinel) {
+		if(hash < node->key) {
+			node = node->left;
+			continue;
+		}
+		if(hash > node->key) {
+			node = node->right;
+			continue;
+		}
+		cn = (ngx_http_dlg_auth_cache_node_t *) node;
+		rc = ngx_http_dlg_auth_cache_cmp(fingerprint, id->data, id->len, cn);
+		if(rc == 0) {
+			return cn;
+		}
+		node = (rc < 0) ? node->left : node->right;
+	}
+	return NULL;
+}
+
+/*
+ * Order entries with equal hash by fingerprint and then by sealed ticket.
+ */
+static ngx_int_t ngx_http_dlg_auth_cache_cmp(uint32_t fingerprint, u_char *id, size_t id_len,
+		ngx_http_dlg_auth_cache_node_t *cn) {
+	if(fingerprint != cn->fingerprint) {
+		return (fingerprint < cn->fingerprint) ? -1 : 1;
+	}
+	return ngx_memn2cmp(id, cn->data, id_len, cn->id_len);
+}
+
+static void ngx_http_dlg_auth_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+		ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel) {
+	ngx_rbtree_node_t **p;
+	ngx_http_dlg_auth_cache_node_t *cn;
+	ngx_http_dlg_auth_cache_node_t *cnt;
+
+	for( ;; ) {
+		if(node->key < temp->key) {
+			p = &temp->left;
+		} else if(node->key > temp->key) {
+			p = &temp->right;
+		} else {
+			cn = (ngx_http_dlg_auth_cache_node_t *) node;
+			cnt = (ngx_http_dlg_auth_cache_node_t *) temp;
+			p = (ngx_http_dlg_auth_cache_cmp(cn->fingerprint, cn->data, cn->id_len, cnt) < 0)
+					? &temp->left : &temp->right;
+		}
+		if(*p == sentinel) {
+			break;
+		}
+		temp = *p;
+	}
+
+	*p = node;
+	node->parent = temp;
+	node->left = sentinel;
+	node->right = sentinel;
+	ngx_rbt_red(node);
+}
+
+static uint32_t ngx_http_dlg_auth_cache_hash(uint32_t fingerprint, HawkcString *id) {
+	uint32_t hash;
+
+	ngx_crc32_init(hash);
+	ngx_crc32_update(&hash, id->data, id->len);
+	ngx_crc32_update(&hash, (u_char *) &fingerprint, sizeof(fingerprint));
+	ngx_crc32_final(hash);
+
+	return hash;
+}
+
+/*
+ * Ticket strings are bounded by the unseal buffer size, so u_short
+ * lengths are plenty.
+ */
+size_t ngx_http_dlg_auth_ticket_pack(Ticket ticket, u_char *buf, size_t size) {
+	ngx_http_dlg_auth_packed_ticket_t h;
+	u_char *p;
+	u_char *last;
+	u_short len;
+	size_t i;
+
+	if(ticket->client.len > 0xffff || ticket->user.len > 0xffff || ticket->owner.len > 0xffff
+			|| ticket->pwd.len > 0xffff) {
+		return 0;
+	}
+
+	h.exp = ticket->exp;
+	h.hawkAlgorithm = ticket->hawkAlgorithm;
+	h.rw = ticket->rw;
+	h.client_len = (u_short) ticket->client.len;
+	h.user_len = (u_short) ticket->user.len;
+	h.owner_len = (u_short) ticket->owner.len;
+	h.pwd_len = (u_short) ticket->pwd.len;
+	h.nrealms = (u_short) ticket->nrealms;
+
+	if(size < sizeof(h) + h.client_len + h.user_len + h.owner_len + h.pwd_len) {
+		return 0;
+	}
+	last = buf + size;
+
+	p = ngx_cpymem(buf, &h, sizeof(h));
+	p = ngx_cpymem(p, ticket->client.data, h.client_len);
+	p = ngx_cpymem(p, ticket->user.data, h.user_len);
+	p = ngx_cpymem(p, ticket->owner.data, h.owner_len);
+	p = ngx_cpymem(p, ticket->pwd.data, h.pwd_len);
+
+	for(i = 0; i < ticket->nrealms; i++) {
+		if(ticket->realms[i].len > 0xffff || (size_t) (last - p) < sizeof(len) + sizeof(uint32_t) + ticket->realms[i].len) {
+			return 0;
+		}
+		len = (u_short) ticket->realms[i].len;
+		p = ngx_cpymem(p, &len, sizeof(len));
+		p = ngx_cpymem(p, &(ticket->realm_hashes[i]), sizeof(uint32_t));
+		p = ngx_cpymem(p, ticket->realms[i].data, len);
+	}
+
+	return p - buf;
+}
+
+ngx_int_t ngx_http_dlg_auth_ticket_unpack(Ticket ticket, u_char *buf, size_t len) {
+	ngx_http_dlg_auth_packed_ticket_t h;
+	u_char *p;
+	u_char *last;
+	u_short rlen;
+	uint32_t rhash;
+	size_t i;
+
+	if(len < sizeof(h)) {
+		return NGX_ERROR;
+	}
+	ngx_memcpy(&h, buf, sizeof(h));
+	if(h.nrealms > MAX_REALMS || len < sizeof(h) + h.client_len + h.user_len + h.owner_len + h.pwd_len) {
+		return NGX_ERROR;
+	}
+
+	/* The ticket has been set up with ticket_init by the caller */
+	ticket->nrealms = 0;
+	ticket->exp = h.exp;
+	ticket->hawkAlgorithm = h.hawkAlgorithm;
+	ticket->rw = h.rw;
+
+	p = buf + sizeof(h);
+	last = buf + len;
+
+	ticket->client.data = p;
+	ticket->client.len = h.client_len;
+	p += h.client_len;
+	ticket->user.data = p;
+	ticket->user.len = h.user_len;
+	p += h.user_len;
+	ticket->owner.data = p;
+	ticket->owner.len = h.owner_len;
+	p += h.owner_len;
+	ticket->pwd.data = p;
+	ticket->pwd.len = h.pwd_len;
+	p += h.pwd_len;
+
+	for(i = 0; i < h.nrealms; i++) {
+		if((size_t) (last - p) < sizeof(rlen) + sizeof(rhash)) {
+			return NGX_ERROR;
+		}
+		ngx_memcpy(&rlen, p, sizeof(rlen));
+		p += sizeof(rlen);
+		ngx_memcpy(&rhash, p, sizeof(rhash));
+		p += sizeof(rhash);
+		if((size_t) (last - p) < rlen) {
+			return NGX_ERROR;
+		}
+		if(ticket_add_realm(ticket, p, rlen, rhash) != OK) {
+			return NGX_ERROR;
+		}
+		p += rlen;
+	}
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_cache_snapshot_init_worker(ngx_cycle_t *cycle) {
+	ngx_http_dlg_auth_cache_t *cache;
+	ngx_list_part_t *part;
+	ngx_shm_zone_t *zones;
+	ngx_event_t *ev;
+	ngx_uint_t i;
+
+	part = &(cycle->shared_memory.part);
+	zones = part->elts;
+	for(i = 0; ; i++) {
+		if(i >= part->nelts) {
+			if(part->next == NULL) {
+				break;
+			}
+			part = part->next;
+			zones = part->elts;
+			i = 0;
+		}
+		if(!ngx_http_dlg_auth_cache_is_zone(&zones[i])) {
+			continue;
+		}
+		cache = zones[i].data;
+		ev = &(cache->snapshot_event);
+		ev->handler = ngx_http_dlg_auth_cache_snapshot_timer;
+		ev->data = cache;
+		ev->log = cycle->log;
+		/* Do not keep the worker from exiting on shutdown */
+		ngx_http_dlg_auth_timer_cancelable(ev);
+		ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll(SNAPSHOT_INTERVAL * 1000));
+	}
+	return NGX_OK;
+}
+
+void ngx_http_dlg_auth_cache_snapshot_exit_worker(ngx_cycle_t *cycle) {
+	ngx_list_part_t *part;
+	ngx_shm_zone_t *zones;
+	ngx_uint_t i;
+
+	part = &(cycle->shared_memory.part);
+	zones = part->elts;
+	for(i = 0; ; i++) {
+		if(i >= part->nelts) {
+			if(part->next == NULL) {
+				break;
+			}
+			part = part->next;
+			zones = part->elts;
+			i = 0;
+		}
+		if(ngx_http_dlg_auth_cache_is_zone(&zones[i])) {
+			ngx_http_dlg_auth_cache_save(zones[i].data, SNAPSHOT_EXIT_INTERVAL, cycle->log);
+		}
+	}
+}
+
+/*
+ * Whether zone is a ticket cache zone with a snapshot file.
+ */
+static ngx_int_t ngx_http_dlg_auth_cache_is_zone(ngx_shm_zone_t *zone) {
+	ngx_http_dlg_auth_cache_t *cache;
+
+	if(zone->tag != &nginx_dlg_auth_module || zone->init != ngx_http_dlg_auth_cache_init_zone) {
+		return 0;
+	}
+	cache = zone->data;
+	return cache->snapshot.len > 0 && cache->sh != NULL;
+}
+
+/*
+ * Timer handler, write a snapshot unless one has been written during the last
+ * SNAPSHOT_INTERVAL seconds. Where the timer polls, see nginx_dlg_auth.h, that
+ * check makes most calls return right away.
+ */
+static void ngx_http_dlg_auth_cache_snapshot_timer(ngx_event_t *ev) {
+	if(ngx_exiting || ngx_quit || ngx_terminate) {
+		return;
+	}
+	ngx_http_dlg_auth_cache_save(ev->data, SNAPSHOT_INTERVAL, ev->log);
+	ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll(SNAPSHOT_INTERVAL * 1000));
+}
+
+/*
+ * Write a snapshot of the zone, unless one has been written during the last
+ * min_age seconds. The snapshot is sealed with iron, using the first password
+ * of the first location using the zone.
+ */
+static void ngx_http_dlg_auth_cache_save(ngx_http_dlg_auth_cache_t *cache, time_t min_age, ngx_log_t *log) {
+	ngx_http_dlg_auth_loc_conf_t **locations;
+	ngx_http_dlg_auth_loc_conf_t *lcf;
+	struct CironContext ciron_ctx;
+	CironPwdTableEntry entry;
+	ngx_atomic_uint_t last, now;
+	u_char *plain, *encryption_buffer, *sealed;
+	size_t plain_len, encryption_len, sealed_len;
+	const unsigned char *pwd_id;
+	size_t pwd_id_len;
+	ngx_str_t password;
+
+	now = (ngx_atomic_uint_t) ngx_time();
+	last = cache->sh->snapshot_time;
+	if(now - last < (ngx_atomic_uint_t) min_age || !ngx_atomic_cmp_set(&(cache->sh->snapshot_time), last, now)) {
+		return;
+	}
+	if(cache->locations == NULL) {
+		return;
+	}
+
+	locations = cache->locations->elts;
+	lcf = locations[0];
+	if(lcf->pwd_table != NULL) {
+		entry = &(lcf->pwd_table->pwds->table.entries[0]);
+		pwd_id = entry->password_id;
+		pwd_id_len = entry->password_id_len;
+		password.data = entry->password;
+		password.len = entry->password_len;
+	} else {
+		pwd_id = NULL;
+		pwd_id_len = 0;
+		password = lcf->iron_password;
+	}
+
+	if( (plain = ngx_http_dlg_auth_cache_dump(cache, &plain_len, log)) == NULL) {
+		return;
+	}
+
+	ciron_context_init(&ciron_ctx, CIRON_DEFAULT_ENCRYPTION_OPTIONS, CIRON_DEFAULT_INTEGRITY_OPTIONS);
+	encryption_buffer = NULL;
+	sealed = NULL;
+	if(ciron_calculate_encryption_buffer_length(&ciron_ctx, plain_len, &encryption_len) != CIRON_OK
+			|| ciron_calculate_seal_buffer_length(&ciron_ctx, plain_len, pwd_id_len, &sealed_len) != CIRON_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "Ticket cache snapshot too large");
+		goto done;
+	}
+	if( (encryption_buffer = ngx_alloc(encryption_len, log)) == NULL || (sealed = ngx_alloc(sealed_len, log)) == NULL) {
+		goto done;
+	}
+	if(ciron_seal(&ciron_ctx, plain, plain_len, pwd_id, pwd_id_len, password.data, password.len,
+			encryption_buffer, sealed, &sealed_len) != CIRON_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "Unable to seal ticket cache snapshot: %s", ciron_get_error(&ciron_ctx));
+		goto done;
+	}
+	(void) ngx_http_dlg_auth_cache_write(cache, sealed, sealed_len, log);
+
+done:
+	ngx_free(plain);
+	if(encryption_buffer != NULL) {
+		ngx_free(encryption_buffer);
+	}
+	if(sealed != NULL) {
+		ngx_free(sealed);
+	}
+}
+
+/*
+ * Serialize the entries of the zone that have not expired. The entries are
+ * copied under the lock and converted to binary tickets after.
+ */
+static u_char *ngx_http_dlg_auth_cache_dump(ngx_http_dlg_auth_cache_t *cache, size_t *len, ngx_log_t *log) {
+	ngx_http_dlg_auth_cache_node_t *cn;
+	ngx_pool_t *pool;
+	ngx_queue_t *q;
+	struct Ticket ticket;
+	u_char *copy, *plain, *p, *end, *out;
+	uint32_t fingerprint;
+	u_short id_len, ticket_len, binary_len;
+	time_t now;
+	size_t size;
+
+	now = ngx_time();
+	ngx_shmtx_lock(&cache->shpool->mutex);
+	size = 0;
+	for(q = ngx_queue_head(&cache->sh->queue); q != ngx_queue_sentinel(&cache->sh->queue); q = ngx_queue_next(q)) {
+		cn = ngx_queue_data(q, ngx_http_dlg_auth_cache_node_t, queue);
+		size += SNAPSHOT_RECORD_LEN + cn->id_len + cn->ticket_len;
+	}
+	if( (copy = ngx_alloc(size + 1, log)) == NULL) {
+		ngx_shmtx_unlock(&cache->shpool->mutex);
+		return NULL;
+	}
+	p = copy;
+	for(q = ngx_queue_head(&cache->sh->queue); q != ngx_queue_sentinel(&cache->sh->queue); q = ngx_queue_next(q)) {
+		cn = ngx_queue_data(q, ngx_http_dlg_auth_cache_node_t, queue);
+		if(cn->expires < now) {
+			continue;
+		}
+		p = ngx_cpymem(p, &(cn->fingerprint), sizeof(uint32_t));
+		p = ngx_cpymem(p, &(cn->id_len), sizeof(u_short));
+		p = ngx_cpymem(p, &(cn->ticket_len), sizeof(u_short));
+		p = ngx_cpymem(p, cn->data, cn->id_len + cn->ticket_len);
+	}
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+	end = p;
+
+	/* Binary tickets are shorter than packed ones */
+	if( (plain = ngx_alloc(SNAPSHOT_MAGIC_LEN + (end - copy), log)) == NULL
+			|| (pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log)) == NULL) {
+		ngx_free(copy);
+		if(plain != NULL) {
+			ngx_free(plain);
+		}
+		return NULL;
+	}
+	out = ngx_cpymem(plain, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	for(p = copy; p < end; p += id_len + ticket_len) {
+		ngx_memcpy(&fingerprint, p, sizeof(uint32_t));
+		ngx_memcpy(&id_len, p + sizeof(uint32_t), sizeof(u_short));
+		ngx_memcpy(&ticket_len, p + sizeof(uint32_t) + sizeof(u_short), sizeof(u_short));
+		p += SNAPSHOT_RECORD_LEN;
+
+		/* Tickets that do not fit the binary format are left out */
+		ticket_init(&ticket, ngx_http_dlg_auth_cache_pool_alloc, pool);
+		if(ngx_http_dlg_auth_ticket_unpack(&ticket, p + id_len, ticket_len) != NGX_OK
+				|| (binary_len = (u_short) ticket_to_binary(&ticket, out + SNAPSHOT_RECORD_LEN + id_len, ticket_len)) == 0) {
+			continue;
+		}
+		out = ngx_cpymem(out, &fingerprint, sizeof(uint32_t));
+		out = ngx_cpymem(out, &id_len, sizeof(u_short));
+		out = ngx_cpymem(out, &binary_len, sizeof(u_short));
+		out = ngx_cpymem(out, p, id_len) + binary_len;
+	}
+	ngx_destroy_pool(pool);
+	ngx_free(copy);
+
+	*len = out - plain;
+	return plain;
+}
+
+/*
+ * Write the sealed snapshot next to the snapshot file and rename it over it.
+ */
+static ngx_int_t ngx_http_dlg_auth_cache_write(ngx_http_dlg_auth_cache_t *cache, u_char *data, size_t len, ngx_log_t *log) {
+	u_char *tmp;
+	ngx_fd_t fd;
+	ssize_t n;
+	size_t written;
+	ngx_int_t rc;
+
+	if( (tmp = ngx_alloc(cache->snapshot.len + sizeof(".tmp"), log)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(tmp, "%V.tmp%Z", &(cache->snapshot));
+
+	if( (fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, 0600)) == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%s\" failed", tmp);
+		ngx_free(tmp);
+		return NGX_ERROR;
+	}
+	rc = NGX_OK;
+	for(written = 0; written < len; written += n) {
+		if( (n = ngx_write_fd(fd, data + written, len - written)) <= 0) {
+			ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_write_fd_n " \"%s\" failed", tmp);
+			rc = NGX_ERROR;
+			break;
+		}
+	}
+	if(ngx_close_file(fd) == NGX_FILE_ERROR && rc == NGX_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_close_file_n " \"%s\" failed", tmp);
+		rc = NGX_ERROR;
+	}
+	if(rc == NGX_OK && ngx_rename_file(tmp, cache->snapshot.data) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%V\" failed", tmp, &(cache->snapshot));
+		rc = NGX_ERROR;
+	}
+	if(rc != NGX_OK) {
+		(void) ngx_delete_file(tmp);
+	}
+	ngx_free(tmp);
+	return rc;
+}
+
+/*
+ * Fill a new zone from its snapshot file. Any password of the locations using
+ * the zone unseals it. A missing or broken snapshot leaves the zone empty.
+ */
+static void ngx_http_dlg_auth_cache_load(ngx_http_dlg_auth_cache_t *cache, ngx_log_t *log) {
+	ngx_http_dlg_auth_loc_conf_t **locations;
+	struct CironContext ciron_ctx;
+	struct CironPwdTable table;
+	CironPwdTable pwds;
+	ngx_str_t password;
+	ngx_file_info_t fi;
+	ngx_pool_t *pool;
+	ngx_fd_t fd;
+	u_char *map, *encryption_buffer, *plain;
+	size_t len, encryption_len, plain_len, n;
+	ngx_uint_t i, loaded;
+
+	if(cache->locations == NULL) {
+		return;
+	}
+	if( (fd = ngx_open_file(cache->snapshot.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0)) == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_NOTICE, log, ngx_errno, "No ticket cache snapshot \"%V\"", &(cache->snapshot));
+		return;
+	}
+	if(ngx_fd_info(fd, &fi) == NGX_FILE_ERROR || (len = (size_t) ngx_file_size(&fi)) == 0) {
+		ngx_close_file(fd);
+		return;
+	}
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	ngx_close_file(fd);
+	if(map == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "mmap() \"%V\" failed", &(cache->snapshot));
+		return;
+	}
+
+	/*
+	 * All passwords of the locations using the zone, so that rotating the
+	 * passwords keeps the snapshot usable as long as its password is there.
+	 */
+	locations = cache->locations->elts;
+	table.nentries = 0;
+	table.entries = NULL;
+	password.len = 0;
+	password.data = NULL;
+	pool = NULL;
+	encryption_buffer = NULL;
+	plain = NULL;
+	for(i = 0, n = 0; i < cache->locations->nelts; i++) {
+		if(locations[i]->pwd_table != NULL) {
+			n += locations[i]->pwd_table->pwds->table.nentries;
+		} else if(password.len == 0) {
+			password = locations[i]->iron_password;
+		}
+	}
+	if( (pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log)) == NULL) {
+		goto done;
+	}
+	if(n > 0) {
+		if( (table.entries = ngx_palloc(pool, n * sizeof(struct CironPwdTableEntry))) == NULL) {
+			goto done;
+		}
+		for(i = 0; i < cache->locations->nelts; i++) {
+			if(locations[i]->pwd_table != NULL) {
+				pwds = &(locations[i]->pwd_table->pwds->table);
+				ngx_memcpy(table.entries + table.nentries, pwds->entries, pwds->nentries * sizeof(struct CironPwdTableEntry));
+				table.nentries += pwds->nentries;
+			}
+		}
+	}
+
+	ciron_context_init(&ciron_ctx, CIRON_DEFAULT_ENCRYPTION_OPTIONS, CIRON_DEFAULT_INTEGRITY_OPTIONS);
+	if(ciron_calculate_encryption_buffer_length(&ciron_ctx, len, &encryption_len) != CIRON_OK
+			|| ciron_calculate_unseal_buffer_length(&ciron_ctx, len, &plain_len) != CIRON_OK) {
+		ngx_log_error(NGX_LOG_ERR, log, 0, "Invalid ticket cache snapshot \"%V\"", &(cache->snapshot));
+		goto done;
+	}
+	if( (encryption_buffer = ngx_alloc(encryption_len, log)) == NULL || (plain = ngx_alloc(plain_len, log)) == NULL) {
+		goto done;
+	}
+	if(ciron_unseal(&ciron_ctx, map, len, (table.nentries > 0) ? &table : NULL, password.data, password.len,
+			encryption_buffer, plain, &plain_len) != CIRON_OK) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "Unable to unseal ticket cache snapshot \"%V\", starting empty: %s",
+				&(cache->snapshot), ciron_get_error(&ciron_ctx));
+		goto done;
+	}
+	if(plain_len < SNAPSHOT_MAGIC_LEN || ngx_memcmp(plain, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "Invalid ticket cache snapshot \"%V\", starting empty", &(cache->snapshot));
+		goto done;
+	}
+
+	loaded = ngx_http_dlg_auth_cache_restore(cache, plain + SNAPSHOT_MAGIC_LEN, plain + plain_len, pool, log);
+	ngx_log_error(NGX_LOG_NOTICE, log, 0, "Loaded %ui tickets from ticket cache snapshot \"%V\"", loaded, &(cache->snapshot));
+
+done:
+	munmap(map, len);
+	if(pool != NULL) {
+		ngx_destroy_pool(pool);
+	}
+	if(encryption_buffer != NULL) {
+		ngx_free(encryption_buffer);
+	}
+	if(plain != NULL) {
+		ngx_free(plain);
+	}
+}
+
+/*
+ * Insert the records of an unsealed snapshot, keeping their order. Expired
+ * tickets and tickets of passwords no location uses anymore are dropped.
+ * Returns the number of tickets inserted.
+ */
+static ngx_uint_t ngx_http_dlg_auth_cache_restore(ngx_http_dlg_auth_cache_t *cache, u_char *p, u_char *last,
+		ngx_pool_t *pool, ngx_log_t *log) {
+	ngx_http_dlg_auth_loc_conf_t **locations;
+	ngx_http_dlg_auth_loc_conf_t *lcf;
+	ngx_http_dlg_auth_cache_node_t *cn;
+	struct Ticket ticket;
+	HawkcString id;
+	u_char packed[TICKET_BUFFER_SIZE];
+	size_t packed_len;
+	uint32_t fingerprint, key;
+	u_short id_len, binary_len;
+	ngx_uint_t i, loaded;
+	time_t now;
+
+	now = ngx_time();
+	locations = cache->locations->elts;
+	loaded = 0;
+
+	ngx_shmtx_lock(&cache->shpool->mutex);
+	while((size_t) (last - p) >= SNAPSHOT_RECORD_LEN) {
+		ngx_memcpy(&fingerprint, p, sizeof(uint32_t));
+		ngx_memcpy(&id_len, p + sizeof(uint32_t), sizeof(u_short));
+		ngx_memcpy(&binary_len, p + sizeof(uint32_t) + sizeof(u_short), sizeof(u_short));
+		p += SNAPSHOT_RECORD_LEN;
+		if((size_t) (last - p) < (size_t) id_len + binary_len) {
+			break;
+		}
+		id.data = p;
+		id.len = id_len;
+		p += id_len + binary_len;
+
+		/* Same key as ngx_dlg_auth_authenticate uses */
+		for(i = 0; i < cache->locations->nelts; i++) {
+			lcf = locations[i];
+			key = lcf->pwd_fingerprint;
+			if(lcf->pwd_table != NULL && lcf->pwd_table->file != NULL) {
+				key ^= lcf->pwd_table->pwds->fingerprint;
+			}
+			if(key == fingerprint) {
+				break;
+			}
+		}
+		if(i == cache->locations->nelts) {
+			continue;
+		}
+
+		ticket_init(&ticket, ngx_http_dlg_auth_cache_pool_alloc, pool);
+		if(ticket_from_binary(&ticket, id.data + id_len, binary_len) != OK || ticket.exp < now
+				|| (packed_len = ngx_http_dlg_auth_ticket_pack(&ticket, packed, sizeof(packed))) == 0
+				|| ngx_http_dlg_auth_cache_find(cache, ngx_http_dlg_auth_cache_hash(fingerprint, &id), fingerprint, &id) != NULL) {
+			continue;
+		}
+
+		if( (cn = ngx_slab_alloc_locked(cache->shpool, offsetof(ngx_http_dlg_auth_cache_node_t, data) + id_len + packed_len)) == NULL) {
+			ngx_log_error(NGX_LOG_NOTICE, log, 0, "Zone full, not loading more tickets from snapshot%s", cache->shpool->log_ctx);
+			break;
+		}
+		cn->node.key = ngx_http_dlg_auth_cache_hash(fingerprint, &id);
+		cn->fingerprint = fingerprint;
+		cn->expires = ticket.exp;
+		cn->id_len = id_len;
+		cn->ticket_len = (u_short) packed_len;
+		ngx_memcpy(cn->data, id.data, id_len);
+		ngx_memcpy(cn->data + id_len, packed, packed_len);
+
+		ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+		ngx_queue_insert_tail(&cache->sh->queue, &cn->queue);
+		loaded++;
+	}
+	ngx_shmtx_unlock(&cache->shpool->mutex);
+
+	return loaded;
+}
+
+static void *ngx_http_dlg_auth_cache_pool_alloc(void *pool, size_t size) {
+	return ngx_palloc(pool, size);
+}
@@ -0,0 +1,120 @@
+#ifndef NGX_HTTP_DLG_AUTH_CACHE_H
+#define NGX_HTTP_DLG_AUTH_CACHE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+#include "ticket.h"
+
+/*
+ * Shared memory cache of unsealed tickets.
+ *
+ * Entries are keyed by the sealed ticket (the Hawk id) and by a fingerprint of
+ * the iron passwords of the location that unsealed the ticket. The full sealed
+ * ticket is stored with every entry and compared on lookup, so a hit means
+ * exactly the same bytes have been unsealed successfully before.
+ *
+ * Entries are removed when the ticket expires or, if the zone runs out of
+ * memory, in least recently used order.
+ *
+ * In front of the shared zone, every worker process has a small cache of its
+ * own that is consulted first and does not need the zone's lock. Locations can
+ * also use the per worker cache alone, without a shared zone.
+ *
+ * In front of both, every client connection remembers the last few tickets
+ * used on it, for clients sending many requests per keep-alive or HTTP/2
+ * connection.
+ *
+ * A shared zone can be given a snapshot file, so that it does not start out
+ * empty after a restart or binary upgrade. A worker writes the snapshot every
+ * few minutes and when exiting, sealed with iron like the tickets themselves.
+ * A new zone is filled from the snapshot, leaving out expired tickets and
+ * tickets of passwords no longer configured.
+ */
+
+/*
+ * Handler for the dlg_auth_ticket_cache directive.
+ */
+char *ngx_http_dlg_auth_ticket_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Register a location using a shared zone. Called from merge for locations
+ * with dlg_auth and a shared zone, their passwords seal the snapshots of the
+ * zone and only their tickets are loaded from a snapshot.
+ */
+ngx_int_t ngx_http_dlg_auth_cache_add_location(ngx_conf_t *cf, ngx_http_dlg_auth_loc_conf_t *conf);
+
+/*
+ * Start writing snapshots of the zones that have a snapshot file. Called
+ * from init_process.
+ */
+ngx_int_t ngx_http_dlg_auth_cache_snapshot_init_worker(ngx_cycle_t *cycle);
+
+/*
+ * Write snapshots of the zones that have a snapshot file when a worker exits.
+ * Called from exit_process.
+ */
+void ngx_http_dlg_auth_cache_snapshot_exit_worker(ngx_cycle_t *cycle);
+
+/*
+ * Set up the per worker cache. Must be called from the init process hook.
+ */
+ngx_int_t ngx_http_dlg_auth_cache_init_worker(ngx_cycle_t *cycle, ngx_uint_t entries);
+
+/*
+ * Obtain hit and miss counters of the per worker cache of the calling process.
+ */
+void ngx_http_dlg_auth_cache_worker_stats(ngx_uint_t *hits, ngx_uint_t *misses);
+
+/*
+ * Obtain hit and miss counters of a shared zone (summed up over all workers).
+ */
+void ngx_http_dlg_auth_cache_zone_stats(ngx_shm_zone_t *zone, ngx_atomic_uint_t *hits, ngx_atomic_uint_t *misses);
+
+/*
+ * Look up the ticket sealed as id, first in the per worker cache and then in
+ * the shared zone, if zone is not NULL. On a hit, the cached ticket fields are copied
+ * to buf and ticket is set up to point into buf. Returns NGX_OK on a hit,
+ * NGX_DECLINED on a miss.
+ */
+ngx_int_t ngx_http_dlg_auth_cache_lookup(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, Ticket ticket);
+
+/*
+ * Store an unsealed ticket in the per worker cache and, if zone is not NULL,
+ * in the shared zone. Failing to store is not an error for the request,
+ * so nothing is returned.
+ */
+void ngx_http_dlg_auth_cache_store(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id,
+		Ticket ticket, time_t now, ngx_log_t *log);
+
+/*
+ * Look up the ticket sealed as id in the cache of the client connection of r,
+ * otherwise the same as ngx_http_dlg_auth_cache_lookup.
+ */
+ngx_int_t ngx_http_dlg_auth_conn_cache_lookup(ngx_http_request_t *r, uint32_t fingerprint, HawkcString *id,
+		time_t now, u_char *buf, size_t size, Ticket ticket);
+
+/*
+ * Store a ticket in the cache of the client connection of r. The cache is
+ * created with room for entries tickets when the first one is stored, and
+ * freed with the connection.
+ */
+void ngx_http_dlg_auth_conn_cache_store(ngx_http_request_t *r, ngx_uint_t entries, uint32_t fingerprint,
+		HawkcString *id, Ticket ticket, time_t now);
+
+/*
+ * Serialize ticket into buf. Returns the number of bytes used or 0 if
+ * buf is too small.
+ */
+size_t ngx_http_dlg_auth_ticket_pack(Ticket ticket, u_char *buf, size_t size);
+
+/*
+ * Set up ticket from data previously produced by ngx_http_dlg_auth_ticket_pack.
+ * All strings of ticket point into buf afterwards. ticket must have been initialized
+ * with ticket_init.
+ */
+ngx_int_t ngx_http_dlg_auth_ticket_unpack(Ticket ticket, u_char *buf, size_t len);
+
+#endif /* NGX_HTTP_DLG_AUTH_CACHE_H */
@@ -0,0 +1,131 @@
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_file.h"
+
+static void check_file(ngx_event_t *ev);
+
+ngx_int_t ngx_http_dlg_auth_file_conf(ngx_conf_t *cf, ngx_http_dlg_auth_file_t *file, ngx_str_t *path, ngx_str_t *interval) {
+	ngx_file_info_t fi;
+	ngx_int_t msec;
+
+	msec = NGX_HTTP_DLG_AUTH_FILE_CHECK_INTERVAL;
+	if(interval != NULL) {
+		if( (msec = ngx_parse_time(interval, 0)) == NGX_ERROR || msec == 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Invalid %s check interval \"%V\"", file->kind, interval);
+			return NGX_ERROR;
+		}
+	}
+	file->check_interval = (ngx_msec_t) msec;
+
+	file->path = *path;
+	if(ngx_conf_full_name(cf->cycle, &(file->path), 1) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	/*
+	 * The state is taken before loading. Should the file be replaced in
+	 * between, the first check loads it once more.
+	 */
+	if(ngx_file_info(file->path.data, &fi) == NGX_FILE_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, ngx_file_info_n " \"%V\" failed", &(file->path));
+		return NGX_ERROR;
+	}
+	if( (file->current = file->load(file, cf->pool, cf->log)) == NULL) {
+		return NGX_ERROR;
+	}
+	file->uniq = ngx_file_uniq(&fi);
+	file->size = ngx_file_size(&fi);
+	file->mtime = ngx_file_mtime(&fi);
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_file_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_file_t *file) {
+	ngx_event_t *ev;
+
+	ev = &(file->check_event);
+	ev->handler = check_file;
+	ev->data = file;
+	ev->log = cycle->log;
+	/* Do not keep the worker from exiting on shutdown */
+	ngx_http_dlg_auth_timer_cancelable(ev);
+	file->next_check = ngx_current_msec + file->check_interval;
+	ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll(file->check_interval));
+	return NGX_OK;
+}
+
+/*
+ * Timer handler, load the file again if it changed.
+ */
+static void check_file(ngx_event_t *ev) {
+	ngx_http_dlg_auth_file_t *file = ev->data;
+	ngx_file_info_t fi;
+	ngx_msec_int_t left;
+	void *data;
+
+	if(ngx_exiting || ngx_quit || ngx_terminate) {
+		return;
+	}
+
+	if( (left = (ngx_msec_int_t) (file->next_check - ngx_current_msec)) > 0) {
+		ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll((ngx_msec_t) left));
+		return;
+	}
+
+	if(ngx_file_info(file->path.data, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno, ngx_file_info_n " \"%V\" failed, keeping the %s loaded before",
+				&(file->path), file->kind);
+	} else if(ngx_file_uniq(&fi) != file->uniq || ngx_file_size(&fi) != file->size || ngx_file_mtime(&fi) != file->mtime) {
+		if(file->previous != NULL && file->busy(file->previous) > 0) {
+			/* A thread task still uses the data replaced last time, try again at the next check */
+			ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0, "\"%V\" in use, reload postponed", &(file->path));
+		} else if( (data = file->load(file, NULL, ev->log)) != NULL) {
+			if(file->previous != NULL) {
+				file->free(file->previous);
+			}
+			/* Data loaded during configuration is released with the cycle */
+			file->previous = file->reloaded ? file->current : NULL;
+			file->current = data;
+			file->reloaded = 1;
+			file->uniq = ngx_file_uniq(&fi);
+			file->size = ngx_file_size(&fi);
+			file->mtime = ngx_file_mtime(&fi);
+			file->swap(file, data, ev->log);
+		}
+	}
+
+	file->next_check = ngx_current_msec + file->check_interval;
+	ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll(file->check_interval));
+}
+
+u_char *ngx_http_dlg_auth_file_map(ngx_http_dlg_auth_file_t *file, int flags, size_t *size, ngx_log_t *log) {
+	ngx_file_info_t fi;
+	ngx_fd_t fd;
+	u_char *map;
+
+	if( (fd = ngx_open_file(file->path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0)) == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, ngx_open_file_n " \"%V\" failed", &(file->path));
+		return NULL;
+	}
+	if(ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, ngx_fd_info_n " \"%V\" failed", &(file->path));
+		ngx_close_file(fd);
+		return NULL;
+	}
+	if( (*size = (size_t) ngx_file_size(&fi)) == 0) {
+		ngx_log_error(NGX_LOG_EMERG, log, 0, "Empty %s \"%V\"", file->kind, &(file->path));
+		ngx_close_file(fd);
+		return NULL;
+	}
+	map = mmap(NULL, *size, PROT_READ, flags, fd, 0);
+	ngx_close_file(fd);
+	if(map == MAP_FAILED) {
+		ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "mmap() \"%V\" failed", &(file->path));
+		return NULL;
+	}
+	return map;
+}
@@ -0,0 +1,96 @@
+#ifndef NGX_HTTP_DLG_AUTH_FILE_H
+#define NGX_HTTP_DLG_AUTH_FILE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Files that are read during configuration and then watched by every worker,
+ * used by dlg_auth_iron_pwd_file and dlg_auth_revocation_file.
+ *
+ * Each worker checks the file on a timer. If inode, size or mtime changed, the
+ * file is loaded again and the result swapped in with a single pointer
+ * assignment. Requests read that pointer once, there is no lock on the request
+ * path. A file that cannot be read or loaded leaves the current data in use.
+ *
+ * Data replaced by a reload may still be used by thread tasks. It is released by
+ * the next reload, which is postponed while the tasks are not done.
+ */
+
+/*
+ * Default interval for checking a file for changes.
+ */
+#define NGX_HTTP_DLG_AUTH_FILE_CHECK_INTERVAL 5000
+
+typedef struct ngx_http_dlg_auth_file_s ngx_http_dlg_auth_file_t;
+
+/*
+ * Load the file. Data loaded during configuration is allocated from pool or
+ * released with it, data loaded by a worker (pool is NULL) is released with the
+ * free handler. Returns NULL if the file cannot be read or is invalid, with the
+ * reason logged.
+ */
+typedef void *(*ngx_http_dlg_auth_file_load_pt)(ngx_http_dlg_auth_file_t *file, ngx_pool_t *pool, ngx_log_t *log);
+
+/*
+ * Number of thread tasks using data.
+ */
+typedef ngx_uint_t (*ngx_http_dlg_auth_file_busy_pt)(void *data);
+
+/*
+ * Release data loaded by a worker.
+ */
+typedef void (*ngx_http_dlg_auth_file_free_pt)(void *data);
+
+/*
+ * Make data loaded by a worker the one requests use.
+ */
+typedef void (*ngx_http_dlg_auth_file_swap_pt)(ngx_http_dlg_auth_file_t *file, void *data, ngx_log_t *log);
+
+struct ngx_http_dlg_auth_file_s {
+	/* Zero terminated path */
+	ngx_str_t path;
+	/* What the file holds, for messages, like "password file" */
+	char *kind;
+	ngx_msec_t check_interval;
+	/* When the file is to be checked next, see ngx_http_dlg_auth_timer_poll */
+	ngx_msec_t next_check;
+	/* File state the current data was loaded from */
+	ngx_file_uniq_t uniq;
+	off_t size;
+	time_t mtime;
+	void *current;
+	/* Data replaced by the last reload, released by the next one once no task uses it */
+	void *previous;
+	/* Whether the current data has been loaded by the worker */
+	ngx_flag_t reloaded;
+	ngx_event_t check_event;
+	ngx_http_dlg_auth_file_load_pt load;
+	ngx_http_dlg_auth_file_busy_pt busy;
+	ngx_http_dlg_auth_file_free_pt free;
+	ngx_http_dlg_auth_file_swap_pt swap;
+	/* Passed on to the handlers, like the password table of the file */
+	void *data;
+};
+
+/*
+ * Set up file, with kind and handlers already set, from the directive arguments
+ * path and interval (NULL for the default) and load it. Returns NGX_OK or
+ * NGX_ERROR, a file that cannot be loaded is a configuration error.
+ */
+ngx_int_t ngx_http_dlg_auth_file_conf(ngx_conf_t *cf, ngx_http_dlg_auth_file_t *file, ngx_str_t *path, ngx_str_t *interval);
+
+/*
+ * Start checking the file for changes. Called from init_process.
+ */
+ngx_int_t ngx_http_dlg_auth_file_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_file_t *file);
+
+/*
+ * Map the file into memory with mmap flags (MAP_PRIVATE or MAP_SHARED) for the
+ * load handler. Returns the mapping and sets size or returns NULL with the reason
+ * logged. Empty files are refused.
+ */
+u_char *ngx_http_dlg_auth_file_map(ngx_http_dlg_auth_file_t *file, int flags, size_t *size, ngx_log_t *log);
+
+#endif /* NGX_HTTP_DLG_AUTH_FILE_H */
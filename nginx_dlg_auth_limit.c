@@ -0,0 +1,295 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_limit.h"
+
+#define MIN_LIMIT_ZONE_SIZE (8 * ngx_pagesize)
+
+/*
+ * Number of slots probed per request.
+ */
+#define MAX_PROBES 8
+
+/*
+ * Attempts to update a slot before the request is let through.
+ */
+#define MAX_RETRIES 4
+
+/*
+ * Time unit of arrival times, 100 microseconds. Rates can be up to one request
+ * per unit.
+ */
+#define UNITS_PER_SEC 10000
+
+/*
+ * Slot layout: 22 bits of the client hash and 42 bits of arrival time (about
+ * 13 years). A slot value of 0 is free.
+ */
+#define HASH_SHIFT 42
+#define TAT_MASK (((ngx_atomic_uint_t) 1 << HASH_SHIFT) - 1)
+
+/*
+ * Shared part of the zone.
+ */
+typedef struct {
+	uint64_t seed;
+	/* Time the zone was created, arrival times are relative to it */
+	time_t epoch;
+	ngx_uint_t nslots;
+	ngx_atomic_t slots[1];
+} ngx_http_dlg_auth_limit_sh_t;
+
+/*
+ * Per zone data, accessible via shm_zone->data.
+ */
+typedef struct {
+	ngx_http_dlg_auth_limit_sh_t *sh;
+	ngx_slab_pool_t *shpool;
+	/* Interval between requests at the configured rate, in units */
+	ngx_atomic_uint_t interval;
+} ngx_http_dlg_auth_limit_t;
+
+static ngx_int_t ngx_http_dlg_auth_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t parse_rate(ngx_str_t *value);
+static uint64_t hash_client(ngx_http_dlg_auth_limit_sh_t *sh, ngx_str_t *client);
+
+
+/*
+ * Parse 'zone=name:size rate=<rate> [burst=<number>]' or 'off'.
+ */
+char *ngx_http_dlg_auth_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_loc_conf_t *lcf = conf;
+	ngx_shm_zone_t *shm_zone;
+	ngx_http_dlg_auth_limit_t *ctx;
+	ngx_str_t *value;
+	ngx_str_t s;
+	ngx_int_t interval;
+	ngx_int_t burst;
+	ngx_uint_t i;
+
+	if(lcf->limit != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		if(cf->args->nelts > 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+		lcf->limit = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if(sizeof(ngx_atomic_uint_t) < sizeof(uint64_t)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_limit requires 64 bit atomic operations");
+		return NGX_CONF_ERROR;
+	}
+
+	interval = 0;
+	burst = 0;
+	for(i = 2; i < cf->args->nelts; i++) {
+		if(value[i].len > 5 && ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+			s.data = value[i].data + 5;
+			s.len = value[i].len - 5;
+			if( (interval = parse_rate(&s)) == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid rate \"%V\", must be like 10r/s or 30r/m and at most 10000r/s",
+						&value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+		if(value[i].len > 6 && ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+			if( (burst = ngx_atoi(value[i].data + 6, value[i].len - 6)) == NGX_ERROR) {
+				ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid burst \"%V\"", &value[i]);
+				return NGX_CONF_ERROR;
+			}
+			continue;
+		}
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+		return NGX_CONF_ERROR;
+	}
+
+	if( (shm_zone = ngx_http_dlg_auth_add_zone(cf, &value[1], ngx_http_dlg_auth_limit_init_zone, MIN_LIMIT_ZONE_SIZE)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	lcf->limit = shm_zone;
+	lcf->limit_burst = (ngx_uint_t) burst;
+
+	if( (ctx = shm_zone->data) == NULL) {
+		if( (ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_limit_t))) == NULL) {
+			return NGX_CONF_ERROR;
+		}
+		shm_zone->data = ctx;
+	}
+	if(interval != 0) {
+		if(ctx->interval != 0 && ctx->interval != (ngx_atomic_uint_t) interval) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "conflicting rate for dlg_auth_limit zone \"%V\"", &shm_zone->shm.name);
+			return NGX_CONF_ERROR;
+		}
+		ctx->interval = interval;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Set up the shared part of the zone, or take it over from the previous
+ * cycle on reload.
+ */
+static ngx_int_t ngx_http_dlg_auth_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_limit_t *octx = data;
+	ngx_http_dlg_auth_limit_t *ctx;
+	ngx_uint_t n;
+	ngx_uint_t i;
+	size_t len;
+
+	ctx = shm_zone->data;
+	if(ctx->interval == 0) {
+		ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "dlg_auth_limit zone \"%V\" has no rate", &shm_zone->shm.name);
+		return NGX_ERROR;
+	}
+
+	if(octx != NULL) {
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	len = sizeof(" in dlg_auth_limit zone \"\"") + shm_zone->shm.name.len;
+	if( (ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(ctx->shpool->log_ctx, " in dlg_auth_limit zone \"%V\"%Z", &shm_zone->shm.name);
+
+	/* As for the nonce zone, take what the slab allocator can give us */
+	n = (shm_zone->shm.size - shm_zone->shm.size / 8) / sizeof(ngx_atomic_t);
+	for(i = 0; i < 8 && ctx->sh == NULL; i++) {
+		ctx->sh = ngx_slab_alloc(ctx->shpool, offsetof(ngx_http_dlg_auth_limit_sh_t, slots) + n * sizeof(ngx_atomic_t));
+		if(ctx->sh == NULL) {
+			n -= n / 8;
+		}
+	}
+	if(ctx->sh == NULL) {
+		return NGX_ERROR;
+	}
+	ctx->shpool->data = ctx->sh;
+
+	ngx_memzero((void *) ctx->sh->slots, n * sizeof(ngx_atomic_t));
+	ctx->sh->nslots = n;
+	ctx->sh->epoch = ngx_time() - 1;
+	ctx->sh->seed = ((uint64_t) ngx_random() << 32) ^ (uint64_t) ngx_random() ^ (uint64_t) ngx_time();
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_limit_check(ngx_shm_zone_t *zone, ngx_uint_t burst, ngx_str_t *client) {
+	ngx_http_dlg_auth_limit_t *ctx;
+	ngx_http_dlg_auth_limit_sh_t *sh;
+	ngx_atomic_uint_t slot, tag, now, tat, oldest;
+	ngx_uint_t i, n, k, first, found, victim;
+	ngx_time_t *tp;
+	uint64_t h;
+
+	ctx = zone->data;
+	sh = ctx->sh;
+	h = hash_client(sh, client);
+	tag = (ngx_atomic_uint_t) (h >> HASH_SHIFT) << HASH_SHIFT;
+
+	tp = ngx_timeofday();
+	now = (ngx_atomic_uint_t) (tp->sec - sh->epoch) * UNITS_PER_SEC + tp->msec * (UNITS_PER_SEC / 1000);
+
+	first = (ngx_uint_t) (h % sh->nslots);
+	for(k = 0; k < MAX_RETRIES; k++) {
+		/*
+		 * Find the bucket of the client or, failing that, a slot to start one in:
+		 * a free one, one of a bucket that has filled up again or the oldest.
+		 */
+		found = 0;
+		victim = first;
+		oldest = TAT_MASK;
+		i = first;
+		for(n = 0; n < MAX_PROBES; n++) {
+			slot = sh->slots[i];
+			if(slot != 0 && (slot & ~TAT_MASK) == tag) {
+				found = 1;
+				victim = i;
+				break;
+			}
+			if(oldest != 0 && (slot == 0 || (slot & TAT_MASK) <= now)) {
+				victim = i;
+				oldest = 0;
+			} else if((slot & TAT_MASK) < oldest) {
+				victim = i;
+				oldest = slot & TAT_MASK;
+			}
+			if(++i == sh->nslots) {
+				i = 0;
+			}
+		}
+
+		slot = sh->slots[victim];
+		tat = now;
+		if(found && (slot & TAT_MASK) > now) {
+			tat = slot & TAT_MASK;
+		}
+		if(tat - now > burst * ctx->interval) {
+			return NGX_BUSY;
+		}
+		if(ngx_atomic_cmp_set(&(sh->slots[victim]), slot, tag | ((tat + ctx->interval) & TAT_MASK))) {
+			return NGX_OK;
+		}
+	}
+
+	/* Heavy contention on the slot, rather let the request through than spin */
+	return NGX_OK;
+}
+
+/*
+ * Parse '<n>r/s' or '<n>r/m' into the interval between requests.
+ */
+static ngx_int_t parse_rate(ngx_str_t *value) {
+	ngx_int_t rate;
+	ngx_int_t scale;
+	size_t len;
+
+	len = value->len;
+	if(len < 4 || value->data[len - 3] != 'r' || value->data[len - 2] != '/') {
+		return NGX_ERROR;
+	}
+	if(value->data[len - 1] == 's') {
+		scale = 1;
+	} else if(value->data[len - 1] == 'm') {
+		scale = 60;
+	} else {
+		return NGX_ERROR;
+	}
+	if( (rate = ngx_atoi(value->data, len - 3)) == NGX_ERROR || rate == 0 || rate > UNITS_PER_SEC * scale) {
+		return NGX_ERROR;
+	}
+	return UNITS_PER_SEC * scale / rate;
+}
+
+/*
+ * 64 bit FNV-1a over seed and client.
+ */
+static uint64_t hash_client(ngx_http_dlg_auth_limit_sh_t *sh, ngx_str_t *client) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ sh->seed;
+	size_t i;
+
+	for(i = 0; i < client->len; i++) {
+		h ^= client->data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
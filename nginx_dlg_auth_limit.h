@@ -0,0 +1,42 @@
+#ifndef NGX_HTTP_DLG_AUTH_LIMIT_H
+#define NGX_HTTP_DLG_AUTH_LIMIT_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#ifndef NGX_HTTP_TOO_MANY_REQUESTS
+#define NGX_HTTP_TOO_MANY_REQUESTS 429
+#endif
+
+/*
+ * Per client rate limiting of authenticated requests.
+ *
+ * Every client (the client of the ticket) has a token bucket, kept as the
+ * theoretical arrival time of the generic cell rate algorithm: a request at
+ * time now is allowed if the arrival time is at most burst intervals ahead of
+ * now and then moves the arrival time one interval further. A single 64 bit
+ * value is all a bucket needs.
+ *
+ * Like the negative cache, the zone is an array of such values updated with
+ * compare and swap, without a lock. A slot holds 22 bits of the client hash and
+ * the arrival time, in units of 100 microseconds since the zone was created.
+ * Slots of buckets that have filled up again are free for other clients. If all
+ * probed slots are in use, the oldest one is taken over, so under pressure a
+ * client may get a fresh bucket, but is never limited because of another one.
+ */
+
+/*
+ * Handler for the dlg_auth_limit directive:
+ *
+ *     dlg_auth_limit zone=<name>:<size> rate=<rate> [burst=<number>] | off
+ */
+char *ngx_http_dlg_auth_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Take a token from the bucket of the client. Returns NGX_OK if the request is
+ * allowed, NGX_BUSY if it exceeds the rate.
+ */
+ngx_int_t ngx_http_dlg_auth_limit_check(ngx_shm_zone_t *zone, ngx_uint_t burst, ngx_str_t *client);
+
+#endif /* NGX_HTTP_DLG_AUTH_LIMIT_H */
@@ -0,0 +1,267 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_negative.h"
+
+#define MIN_NEGATIVE_ZONE_SIZE (8 * ngx_pagesize)
+
+/*
+ * Number of slots probed on lookup and insert.
+ */
+#define MAX_PROBES 8
+
+/*
+ * Default and maximum time to remember a failure, in seconds.
+ */
+#define DEFAULT_TTL 10
+#define MAX_TTL 3600
+
+/*
+ * Slot layout: 40 bits of the hash, 22 bits of the expiry time (seconds modulo
+ * 2^22, about 48 days) and 2 bits of status. A slot value of 0 is free.
+ */
+#define HASH_SHIFT 24
+#define EXPIRES_SHIFT 2
+#define EXPIRES_MASK ((ngx_atomic_uint_t) 0x3fffff)
+#define STATUS_MASK ((ngx_atomic_uint_t) 0x3)
+#define STATUS_400 1
+#define STATUS_401 2
+
+/*
+ * Shared part of the zone.
+ */
+typedef struct {
+	uint64_t seed;
+	ngx_uint_t nslots;
+	ngx_atomic_t slots[1];
+} ngx_http_dlg_auth_negative_sh_t;
+
+/*
+ * Per zone data, accessible via shm_zone->data.
+ */
+typedef struct {
+	ngx_http_dlg_auth_negative_sh_t *sh;
+	ngx_slab_pool_t *shpool;
+	ngx_uint_t ttl;
+} ngx_http_dlg_auth_negative_t;
+
+static ngx_int_t ngx_http_dlg_auth_negative_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static uint64_t hash_id(ngx_http_dlg_auth_negative_sh_t *sh, uint32_t fingerprint, HawkcString *id);
+static ngx_uint_t is_live(ngx_atomic_uint_t slot, time_t now, ngx_uint_t ttl);
+
+
+/*
+ * Parse 'zone=name:size [ttl=<time>]' or 'off'.
+ */
+char *ngx_http_dlg_auth_negative_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_shm_zone_t **zp;
+	ngx_shm_zone_t *shm_zone;
+	ngx_http_dlg_auth_negative_t *ctx;
+	ngx_str_t *value;
+	ngx_str_t s;
+	ngx_int_t ttl;
+
+	zp = (ngx_shm_zone_t **) ((char *) conf + cmd->offset);
+	if(*zp != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		if(cf->args->nelts > 2) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+		*zp = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if(sizeof(ngx_atomic_uint_t) < sizeof(uint64_t)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_negative_cache requires 64 bit atomic operations");
+		return NGX_CONF_ERROR;
+	}
+
+	ttl = 0;
+	if(cf->args->nelts == 3) {
+		if(value[2].len <= 4 || ngx_strncmp(value[2].data, "ttl=", 4) != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+		s.data = value[2].data + 4;
+		s.len = value[2].len - 4;
+		if( (ttl = ngx_parse_time(&s, 1)) == NGX_ERROR || ttl == 0 || ttl > MAX_TTL) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid ttl \"%V\", must be between 1s and 1h", &value[2]);
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if( (shm_zone = ngx_http_dlg_auth_add_zone(cf, &value[1], ngx_http_dlg_auth_negative_init_zone, MIN_NEGATIVE_ZONE_SIZE)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	*zp = shm_zone;
+
+	if( (ctx = shm_zone->data) == NULL) {
+		if( (ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_negative_t))) == NULL) {
+			return NGX_CONF_ERROR;
+		}
+		shm_zone->data = ctx;
+	}
+	if(ttl != 0) {
+		if(ctx->ttl != 0 && ctx->ttl != (ngx_uint_t) ttl) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "conflicting ttl for dlg_auth_negative_cache zone \"%V\"", &shm_zone->shm.name);
+			return NGX_CONF_ERROR;
+		}
+		ctx->ttl = ttl;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Set up the shared part of the zone, or take it over from the previous
+ * cycle on reload.
+ */
+static ngx_int_t ngx_http_dlg_auth_negative_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_negative_t *octx = data;
+	ngx_http_dlg_auth_negative_t *ctx;
+	ngx_uint_t n;
+	ngx_uint_t i;
+	size_t len;
+
+	ctx = shm_zone->data;
+	if(ctx->ttl == 0) {
+		ctx->ttl = DEFAULT_TTL;
+	}
+
+	if(octx != NULL) {
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	len = sizeof(" in dlg_auth_negative_cache zone \"\"") + shm_zone->shm.name.len;
+	if( (ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(ctx->shpool->log_ctx, " in dlg_auth_negative_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	/* As for the nonce zone, take what the slab allocator can give us */
+	n = (shm_zone->shm.size - shm_zone->shm.size / 8) / sizeof(ngx_atomic_t);
+	for(i = 0; i < 8 && ctx->sh == NULL; i++) {
+		ctx->sh = ngx_slab_alloc(ctx->shpool, offsetof(ngx_http_dlg_auth_negative_sh_t, slots) + n * sizeof(ngx_atomic_t));
+		if(ctx->sh == NULL) {
+			n -= n / 8;
+		}
+	}
+	if(ctx->sh == NULL) {
+		return NGX_ERROR;
+	}
+	ctx->shpool->data = ctx->sh;
+
+	ngx_memzero((void *) ctx->sh->slots, n * sizeof(ngx_atomic_t));
+	ctx->sh->nslots = n;
+	ctx->sh->seed = ((uint64_t) ngx_random() << 32) ^ (uint64_t) ngx_random() ^ (uint64_t) ngx_time();
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_negative_lookup(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id, time_t now) {
+	ngx_http_dlg_auth_negative_t *ctx;
+	ngx_http_dlg_auth_negative_sh_t *sh;
+	ngx_atomic_uint_t slot;
+	ngx_uint_t i, n;
+	uint64_t h;
+
+	ctx = zone->data;
+	sh = ctx->sh;
+	h = hash_id(sh, fingerprint, id);
+
+	i = (ngx_uint_t) (h % sh->nslots);
+	for(n = 0; n < MAX_PROBES; n++) {
+		slot = sh->slots[i];
+		if((slot >> HASH_SHIFT) == (h >> HASH_SHIFT) && is_live(slot, now, ctx->ttl)) {
+			return ((slot & STATUS_MASK) == STATUS_400) ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_UNAUTHORIZED;
+		}
+		if(++i == sh->nslots) {
+			i = 0;
+		}
+	}
+	return 0;
+}
+
+void ngx_http_dlg_auth_negative_store(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id, time_t now,
+		ngx_int_t status) {
+	ngx_http_dlg_auth_negative_t *ctx;
+	ngx_http_dlg_auth_negative_sh_t *sh;
+	ngx_atomic_uint_t entry, old;
+	ngx_uint_t i, n, first;
+	uint64_t h;
+
+	ctx = zone->data;
+	sh = ctx->sh;
+	h = hash_id(sh, fingerprint, id);
+
+	entry = ((ngx_atomic_uint_t) (h >> HASH_SHIFT) << HASH_SHIFT)
+			| ((((ngx_atomic_uint_t) now + ctx->ttl) & EXPIRES_MASK) << EXPIRES_SHIFT)
+			| ((status == NGX_HTTP_BAD_REQUEST) ? STATUS_400 : STATUS_401);
+
+	first = i = (ngx_uint_t) (h % sh->nslots);
+	for(n = 0; n < MAX_PROBES; n++) {
+		old = sh->slots[i];
+		if(old == 0 || (old >> HASH_SHIFT) == (h >> HASH_SHIFT) || !is_live(old, now, ctx->ttl)) {
+			/* Losing a race only means that another failure is remembered instead */
+			ngx_atomic_cmp_set(&(sh->slots[i]), old, entry);
+			return;
+		}
+		if(++i == sh->nslots) {
+			i = 0;
+		}
+	}
+
+	/* All probed slots are in use, evict the first */
+	sh->slots[first] = entry;
+}
+
+/*
+ * A slot is live if its expiry time lies ahead, within the TTL.
+ */
+static ngx_uint_t is_live(ngx_atomic_uint_t slot, time_t now, ngx_uint_t ttl) {
+	ngx_atomic_uint_t left;
+
+	if(slot == 0) {
+		return 0;
+	}
+	left = (((slot >> EXPIRES_SHIFT) & EXPIRES_MASK) - (ngx_atomic_uint_t) now) & EXPIRES_MASK;
+	return left != 0 && left <= ttl;
+}
+
+/*
+ * 64 bit FNV-1a over seed, fingerprint and id.
+ */
+static uint64_t hash_id(ngx_http_dlg_auth_negative_sh_t *sh, uint32_t fingerprint, HawkcString *id) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ sh->seed;
+	u_char *p;
+	size_t i;
+
+	p = (u_char *) &fingerprint;
+	for(i = 0; i < sizeof(fingerprint); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	for(i = 0; i < id->len; i++) {
+		h ^= (u_char) id->data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
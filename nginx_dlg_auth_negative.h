@@ -0,0 +1,43 @@
+#ifndef NGX_HTTP_DLG_AUTH_NEGATIVE_H
+#define NGX_HTTP_DLG_AUTH_NEGATIVE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+
+/*
+ * Shared memory cache of sealed tickets that could not be unsealed or parsed.
+ *
+ * Such failures depend on nothing but the sealed ticket (the Hawk id) and the
+ * iron passwords of the location, so for a while the same id will fail the same
+ * way. Repeating the id is answered with the remembered status (400 or 401)
+ * before anything is decrypted. Failures that depend on the request, like a bad
+ * signature or clock skew, are never cached.
+ *
+ * Like the nonce cache, the zone is an array of 64 bit slots updated with
+ * compare and swap, without a lock. A slot holds 40 bits of a hash of password
+ * fingerprint and id, the expiry time and the status. Hashes are seeded per zone.
+ * When all probed slots are in use, the first one is overwritten, so the cache is
+ * bounded by the zone size and merely forgets under pressure.
+ */
+
+/*
+ * Handler for the dlg_auth_negative_cache directive. The zone is stored as
+ * ngx_shm_zone_t pointer at cmd->offset in the location configuration
+ * ('off' stores NULL).
+ */
+char *ngx_http_dlg_auth_negative_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Returns the status remembered for the id, or 0 if there is none.
+ */
+ngx_int_t ngx_http_dlg_auth_negative_lookup(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id, time_t now);
+
+/*
+ * Remember the status (NGX_HTTP_BAD_REQUEST or NGX_HTTP_UNAUTHORIZED) for the id.
+ */
+void ngx_http_dlg_auth_negative_store(ngx_shm_zone_t *zone, uint32_t fingerprint, HawkcString *id, time_t now,
+		ngx_int_t status);
+
+#endif /* NGX_HTTP_DLG_AUTH_NEGATIVE_H */
@@ -0,0 +1,331 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_nonce.h"
+
+#define MIN_NONCE_ZONE_SIZE (8 * ngx_pagesize)
+
+/*
+ * Number of slots to try when inserting into a table. If all of them are taken,
+ * the table is considered full.
+ */
+#define MAX_PROBES 16
+
+/*
+ * Every slot holds the low 16 bits of ts (the tag) and 48 bits of the request
+ * hash. Slots with a tag different from the current one belong to an earlier
+ * round of the ring and count as free. A slot value of 0 is always free.
+ */
+#define TAG_MASK ((ngx_atomic_uint_t) 0xffff)
+
+/*
+ * Shared part of the zone. slots holds nbuckets tables of nslots slots each.
+ */
+typedef struct {
+	ngx_uint_t nbuckets;
+	ngx_uint_t nslots;
+	ngx_uint_t total;
+	ngx_atomic_t overflows;
+	ngx_atomic_t slots[1];
+} ngx_http_dlg_auth_nonce_sh_t;
+
+/*
+ * Per zone data, accessible via shm_zone->data.
+ */
+typedef struct {
+	ngx_http_dlg_auth_nonce_sh_t *sh;
+	ngx_slab_pool_t *shpool;
+	/* Ring size required by the allowed clock skew of all locations using the zone */
+	ngx_uint_t nbuckets;
+} ngx_http_dlg_auth_nonce_t;
+
+static ngx_int_t ngx_http_dlg_auth_nonce_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_http_dlg_auth_nonce_partition(ngx_http_dlg_auth_nonce_sh_t *sh, ngx_uint_t nbuckets);
+static void ngx_http_dlg_auth_nonce_repartition(ngx_shm_zone_t *shm_zone, ngx_http_dlg_auth_nonce_sh_t *sh, ngx_uint_t nbuckets);
+static ngx_int_t ngx_http_dlg_auth_nonce_insert(ngx_http_dlg_auth_nonce_sh_t *sh, time_t ts, ngx_atomic_uint_t entry);
+static uint64_t fnv1a(uint64_t h, u_char *p, size_t len);
+
+
+/*
+ * Parse 'zone=name:size' or 'off'.
+ */
+char *ngx_http_dlg_auth_nonce_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_shm_zone_t **zp;
+	ngx_shm_zone_t *shm_zone;
+	ngx_http_dlg_auth_nonce_t *ctx;
+	ngx_str_t *value;
+
+	zp = (ngx_shm_zone_t **) ((char *) conf + cmd->offset);
+	if(*zp != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if(value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+		*zp = NULL;
+		return NGX_CONF_OK;
+	}
+
+	if(sizeof(ngx_atomic_uint_t) < sizeof(uint64_t)) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "dlg_auth_nonce_cache requires 64 bit atomic operations");
+		return NGX_CONF_ERROR;
+	}
+
+	if( (shm_zone = ngx_http_dlg_auth_add_zone(cf, &value[1], ngx_http_dlg_auth_nonce_init_zone, MIN_NONCE_ZONE_SIZE)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	*zp = shm_zone;
+	if(shm_zone->data != NULL) {
+		return NGX_CONF_OK;
+	}
+
+	if( (ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_nonce_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	shm_zone->data = ctx;
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Requests are accepted with ts in [now - skew, now + skew]. A table must not be
+ * reused before its second has left that window, so the ring needs at least
+ * 2 * skew + 2 tables.
+ */
+ngx_int_t ngx_http_dlg_auth_nonce_set_skew(ngx_shm_zone_t *zone, ngx_uint_t allowed_clock_skew) {
+	ngx_http_dlg_auth_nonce_t *ctx;
+	ngx_uint_t n;
+
+	ctx = zone->data;
+	n = 2 * allowed_clock_skew + 2;
+	if(n > ctx->nbuckets) {
+		ctx->nbuckets = n;
+	}
+	return NGX_OK;
+}
+
+/*
+ * Set up the shared part of the zone, or take it over from the previous
+ * cycle on reload. The slot array takes all of the zone that the slab
+ * allocator can give us.
+ */
+static ngx_int_t ngx_http_dlg_auth_nonce_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_nonce_t *octx = data;
+	ngx_http_dlg_auth_nonce_t *ctx;
+	ngx_uint_t n;
+	ngx_uint_t i;
+	size_t len;
+
+	ctx = shm_zone->data;
+
+	if(ctx->nbuckets == 0) {
+		/* Zone defined, but not used by any location with dlg_auth enabled */
+		ctx->nbuckets = 4;
+	}
+
+	if(octx != NULL) {
+		ctx->sh = octx->sh;
+		ctx->shpool = octx->shpool;
+		if(ctx->sh->total / ctx->nbuckets == 0) {
+			ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "dlg_auth_nonce_cache zone \"%V\" is too small for the allowed clock skew",
+					&shm_zone->shm.name);
+			return NGX_ERROR;
+		}
+		if(ctx->sh->nbuckets != ctx->nbuckets) {
+			ngx_http_dlg_auth_nonce_repartition(shm_zone, ctx->sh, ctx->nbuckets);
+		}
+		return NGX_OK;
+	}
+
+	ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		ctx->sh = ctx->shpool->data;
+		return NGX_OK;
+	}
+
+	len = sizeof(" in dlg_auth_nonce_cache zone \"\"") + shm_zone->shm.name.len;
+	if( (ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_sprintf(ctx->shpool->log_ctx, " in dlg_auth_nonce_cache zone \"%V\"%Z", &shm_zone->shm.name);
+
+	/*
+	 * The slab allocator needs some of the zone for itself, try smaller sizes
+	 * until the allocation succeeds.
+	 */
+	n = (shm_zone->shm.size - shm_zone->shm.size / 8) / sizeof(ngx_atomic_t);
+	for(i = 0; i < 8 && ctx->sh == NULL; i++) {
+		ctx->sh = ngx_slab_alloc(ctx->shpool, offsetof(ngx_http_dlg_auth_nonce_sh_t, slots) + n * sizeof(ngx_atomic_t));
+		if(ctx->sh == NULL) {
+			n -= n / 8;
+		}
+	}
+	if(ctx->sh == NULL) {
+		return NGX_ERROR;
+	}
+	ctx->shpool->data = ctx->sh;
+
+	ctx->sh->total = n;
+	ctx->sh->overflows = 0;
+	if(n / ctx->nbuckets == 0) {
+		ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0, "dlg_auth_nonce_cache zone \"%V\" is too small for the allowed clock skew",
+				&shm_zone->shm.name);
+		return NGX_ERROR;
+	}
+	ngx_http_dlg_auth_nonce_partition(ctx->sh, ctx->nbuckets);
+
+	return NGX_OK;
+}
+
+static void ngx_http_dlg_auth_nonce_partition(ngx_http_dlg_auth_nonce_sh_t *sh, ngx_uint_t nbuckets) {
+	ngx_memzero((void *) sh->slots, sh->total * sizeof(ngx_atomic_t));
+	sh->nslots = sh->total / nbuckets;
+	sh->nbuckets = nbuckets;
+}
+
+/*
+ * Change the ring size on reload without opening a replay window: the nonces
+ * of requests that are still within the allowed clock skew are moved to the
+ * tables of the new ring. Slots only hold the low 16 bits of ts, the rest is
+ * taken from the current time, which is unambiguous for any skew that fits
+ * the tag. Entries whose ts does not match the table they were found in are
+ * left over from an earlier round of the ring and are dropped.
+ */
+static void ngx_http_dlg_auth_nonce_repartition(ngx_shm_zone_t *shm_zone, ngx_http_dlg_auth_nonce_sh_t *sh, ngx_uint_t nbuckets) {
+	ngx_atomic_uint_t *old;
+	ngx_atomic_uint_t entry;
+	ngx_uint_t onbuckets, onslots;
+	ngx_uint_t i;
+	ngx_uint_t dropped;
+	time_t now, ts, skew;
+
+	onbuckets = sh->nbuckets;
+	onslots = sh->nslots;
+	if( (old = ngx_alloc(onbuckets * onslots * sizeof(ngx_atomic_uint_t), shm_zone->shm.log)) == NULL) {
+		ngx_http_dlg_auth_nonce_partition(sh, nbuckets);
+		ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0, "dlg_auth_nonce_cache zone \"%V\" resized, remembered nonces dropped",
+				&shm_zone->shm.name);
+		return;
+	}
+	for(i = 0; i < onbuckets * onslots; i++) {
+		old[i] = sh->slots[i];
+	}
+	ngx_http_dlg_auth_nonce_partition(sh, nbuckets);
+
+	now = ngx_time();
+	skew = (time_t) (nbuckets - 2) / 2;
+	dropped = 0;
+	for(i = 0; i < onbuckets * onslots; i++) {
+		if( (entry = old[i]) == 0) {
+			continue;
+		}
+		ts = now + (int16_t) (uint16_t) ((entry & TAG_MASK) - ((ngx_atomic_uint_t) now & TAG_MASK));
+		if(ts < now - skew || ts > now + skew || (ngx_uint_t) ts % onbuckets != i / onslots) {
+			continue;
+		}
+		if(ngx_http_dlg_auth_nonce_insert(sh, ts, entry) == NGX_BUSY) {
+			dropped++;
+		}
+	}
+	ngx_free(old);
+
+	if(dropped > 0) {
+		ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0, "dlg_auth_nonce_cache zone \"%V\" resized, %ui remembered nonces did not fit and were dropped",
+				&shm_zone->shm.name, dropped);
+	}
+}
+
+/*
+ * Insert entry into the table of ts. Returns NGX_OK, NGX_DECLINED if the entry
+ * is there already or NGX_BUSY if the table is full.
+ */
+static ngx_int_t ngx_http_dlg_auth_nonce_insert(ngx_http_dlg_auth_nonce_sh_t *sh, time_t ts, ngx_atomic_uint_t entry) {
+	ngx_atomic_t *bucket;
+	ngx_atomic_uint_t old;
+	ngx_atomic_uint_t tag;
+	ngx_uint_t nslots;
+	ngx_uint_t i;
+	ngx_uint_t n;
+
+	nslots = sh->nslots;
+	tag = entry & TAG_MASK;
+	bucket = &(sh->slots[((ngx_uint_t) ts % sh->nbuckets) * nslots]);
+	i = (ngx_uint_t) (entry >> 16) % nslots;
+
+	for(n = 0; n < MAX_PROBES; n++) {
+		old = bucket[i];
+		if(old == entry) {
+			return NGX_DECLINED;
+		}
+		if(old == 0 || (old & TAG_MASK) != tag) {
+			if(ngx_atomic_cmp_set(&bucket[i], old, entry)) {
+				return NGX_OK;
+			}
+			/* Lost the race, maybe against the same request */
+			if(bucket[i] == entry) {
+				return NGX_DECLINED;
+			}
+		}
+		if(++i == nslots) {
+			i = 0;
+		}
+	}
+	return NGX_BUSY;
+}
+
+ngx_int_t ngx_http_dlg_auth_nonce_check(ngx_shm_zone_t *zone, HawkcString *id, HawkcString *nonce,
+		time_t ts, ngx_log_t *log) {
+	ngx_http_dlg_auth_nonce_t *ctx;
+	ngx_http_dlg_auth_nonce_sh_t *sh;
+	ngx_atomic_uint_t entry;
+	ngx_atomic_uint_t overflows;
+	ngx_int_t rc;
+	uint64_t h;
+
+	ctx = zone->data;
+	sh = ctx->sh;
+
+	h = fnv1a(0xcbf29ce484222325ULL, (u_char *) &(id->len), sizeof(id->len));
+	h = fnv1a(h, id->data, id->len);
+	h = fnv1a(h, (u_char *) &(nonce->len), sizeof(nonce->len));
+	h = fnv1a(h, nonce->data, nonce->len);
+	h = fnv1a(h, (u_char *) &ts, sizeof(ts));
+
+	entry = ((ngx_atomic_uint_t) h & ~TAG_MASK);
+	if(entry == 0) {
+		entry = TAG_MASK + 1;
+	}
+	entry |= (ngx_atomic_uint_t) ts & TAG_MASK;
+
+	if( (rc = ngx_http_dlg_auth_nonce_insert(sh, ts, entry)) != NGX_BUSY) {
+		return rc;
+	}
+
+	/*
+	 * The table is full. We rather let the request pass than rejecting valid requests,
+	 * but the zone should be made larger. Only log at 1, 2, 4, 8, ... overflows.
+	 */
+	overflows = ngx_atomic_fetch_add(&sh->overflows, 1) + 1;
+	if((overflows & (overflows - 1)) == 0) {
+		ngx_log_error(NGX_LOG_WARN, log, 0, "dlg_auth_nonce_cache zone \"%V\" is full, %uA nonces not recorded so far",
+				&zone->shm.name, overflows);
+	}
+	return NGX_OK;
+}
+
+/*
+ * 64 bit FNV-1a hash, chained through h.
+ */
+static uint64_t fnv1a(uint64_t h, u_char *p, size_t len) {
+	while(len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
@@ -0,0 +1,42 @@
+#ifndef NGX_HTTP_DLG_AUTH_NONCE_H
+#define NGX_HTTP_DLG_AUTH_NONCE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+
+/*
+ * Shared memory store of Hawk nonces for replay protection.
+ *
+ * A request is identified by (Hawk id, nonce, ts). Requests are only accepted
+ * if ts is within the allowed clock skew, so a nonce needs to be remembered for
+ * that long only. The store is a ring of hash tables, one per second of ts.
+ * A table is reused as a whole once its second has left the skew window, which
+ * makes expiry O(1) per table rather than per entry.
+ *
+ * Inserts are lock-free (compare and swap on 64 bit slots), there is no lock
+ * on the request path.
+ */
+
+/*
+ * Handler for the dlg_auth_nonce_cache directive. The directive value is
+ * stored as ngx_shm_zone_t pointer at cmd->offset in the location
+ * configuration ('off' stores NULL).
+ */
+char *ngx_http_dlg_auth_nonce_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Make the zone large enough for the given allowed clock skew. Must be called for
+ * every location that uses the zone, during configuration merge.
+ */
+ngx_int_t ngx_http_dlg_auth_nonce_set_skew(ngx_shm_zone_t *zone, ngx_uint_t allowed_clock_skew);
+
+/*
+ * Record the request. Returns NGX_OK if it has not been seen before and NGX_DECLINED
+ * for a replay. The caller must have checked that ts is within the allowed clock skew.
+ */
+ngx_int_t ngx_http_dlg_auth_nonce_check(ngx_shm_zone_t *zone, HawkcString *id, HawkcString *nonce,
+		time_t ts, ngx_log_t *log);
+
+#endif /* NGX_HTTP_DLG_AUTH_NONCE_H */
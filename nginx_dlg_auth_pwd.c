@@ -0,0 +1,238 @@
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ciron.h>
+#include "pwdindex.h"
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_file.h"
+#include "nginx_dlg_auth_pwd.h"
+
+static void *load_pwd_file(ngx_http_dlg_auth_file_t *file, ngx_pool_t *pool, ngx_log_t *log);
+static ngx_uint_t pwds_busy(void *data);
+static void free_pwds(void *data);
+static void swap_pwds(ngx_http_dlg_auth_file_t *file, void *data, ngx_log_t *log);
+static void *heap_alloc(void *log, size_t size);
+static void *pool_alloc(void *pool, size_t size);
+
+char *ngx_http_dlg_auth_iron_pwd_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_main_conf_t *mcf = conf;
+	ngx_http_dlg_auth_pwd_table_t *table, **tables;
+	ngx_http_dlg_auth_file_t *file;
+	ngx_str_t *value;
+
+	value = cf->args->elts;
+
+	if(ngx_http_dlg_auth_find_pwd_table(mcf, &(value[1])) != NULL) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "Duplicate password table \"%V\"", &(value[1]));
+		return NGX_CONF_ERROR;
+	}
+
+	if( (table = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_pwd_table_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	if( (file = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_file_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	table->name = value[1];
+	table->file = file;
+	file->kind = "password file";
+	file->load = load_pwd_file;
+	file->busy = pwds_busy;
+	file->free = free_pwds;
+	file->swap = swap_pwds;
+	file->data = table;
+
+	/*
+	 * Read the file right away, a broken file is a configuration error.
+	 */
+	if(ngx_http_dlg_auth_file_conf(cf, file, &(value[2]), (cf->args->nelts == 4) ? &(value[3]) : NULL) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+	table->pwds = file->current;
+
+	if( (tables = ngx_array_push(&(mcf->pwd_tables))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	*tables = table;
+
+	return NGX_CONF_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_pwds_init(ngx_http_dlg_auth_pwds_t *pwds, struct CironPwdTableEntry *entries,
+		ngx_uint_t nentries, PwdIndexAllocator alloc, void *alloc_ctx) {
+	uint32_t crc;
+	ngx_uint_t i;
+
+	ngx_crc32_init(crc);
+	for(i=0;i<nentries;i++) {
+		ngx_crc32_update(&crc, (u_char *) &(entries[i].password_id_len), sizeof(size_t));
+		ngx_crc32_update(&crc, entries[i].password_id, entries[i].password_id_len);
+		ngx_crc32_update(&crc, (u_char *) &(entries[i].password_len), sizeof(size_t));
+		ngx_crc32_update(&crc, entries[i].password, entries[i].password_len);
+	}
+	ngx_crc32_final(crc);
+
+	pwds->table.entries = entries;
+	pwds->table.nentries = nentries;
+	pwds->fingerprint = crc;
+	pwds->busy = 0;
+	if(pwd_index_build(&(pwds->index), &(pwds->table), alloc, alloc_ctx) != 0) {
+		return NGX_ERROR;
+	}
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_pwd_file_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_main_conf_t *mcf) {
+	ngx_http_dlg_auth_pwd_table_t **tables;
+	ngx_uint_t i;
+
+	tables = mcf->pwd_tables.elts;
+	for(i = 0; i < mcf->pwd_tables.nelts; i++) {
+		if(tables[i]->file == NULL) {
+			continue;
+		}
+		if(ngx_http_dlg_auth_file_init_worker(cycle, tables[i]->file) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+	return NGX_OK;
+}
+
+/*
+ * Replace the passwords of the table after a reload of its file.
+ */
+static void swap_pwds(ngx_http_dlg_auth_file_t *file, void *data, ngx_log_t *log) {
+	ngx_http_dlg_auth_pwd_table_t *table = file->data;
+	ngx_http_dlg_auth_pwds_t *pwds = data;
+
+	table->pwds = pwds;
+	ngx_log_error(NGX_LOG_NOTICE, log, 0, "Reloaded %ui passwords of table %V from \"%V\"",
+			pwds->table.nentries, &(table->name), &(file->path));
+}
+
+/*
+ * Read and parse the password file. Passwords, index and a copy of the file
+ * contents are allocated from pool or, if pool is NULL, from the heap.
+ */
+static void *load_pwd_file(ngx_http_dlg_auth_file_t *file, ngx_pool_t *pool, ngx_log_t *log) {
+	ngx_http_dlg_auth_pwds_t *pwds;
+	struct CironPwdTableEntry *entries, *e;
+	u_char *map, *text, *p, *end, *id, *pwd;
+	size_t size, nlines, n, line;
+	ngx_int_t rc;
+
+	if( (map = ngx_http_dlg_auth_file_map(file, MAP_PRIVATE, &size, log)) == NULL) {
+		return NULL;
+	}
+
+	/* One entry per line at most */
+	nlines = 1;
+	for(p = map, end = map + size; (p = ngx_strlchr(p, end, '\n')) != NULL; p++) {
+		nlines++;
+	}
+	n = sizeof(ngx_http_dlg_auth_pwds_t) + nlines * sizeof(struct CironPwdTableEntry) + size;
+	pwds = (pool != NULL) ? ngx_palloc(pool, n) : ngx_alloc(n, log);
+	if(pwds == NULL) {
+		munmap(map, size);
+		return NULL;
+	}
+	entries = (struct CironPwdTableEntry *) (pwds + 1);
+	text = (u_char *) (entries + nlines);
+	ngx_memcpy(text, map, size);
+	munmap(map, size);
+
+	/*
+	 * Parse '<passwordID> <password>' lines.
+	 */
+	n = 0;
+	line = 0;
+	p = text;
+	end = text + size;
+	while(p < end) {
+		line++;
+		while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+			p++;
+		}
+		if(p == end || *p == '\n' || *p == '#') {
+			while(p < end && *p != '\n') {
+				p++;
+			}
+			p++;
+			continue;
+		}
+		e = &(entries[n]);
+		id = p;
+		while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+			p++;
+		}
+		e->password_id = id;
+		e->password_id_len = p - id;
+		while(p < end && (*p == ' ' || *p == '\t')) {
+			p++;
+		}
+		pwd = p;
+		while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+			p++;
+		}
+		e->password = pwd;
+		e->password_len = p - pwd;
+		while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+			p++;
+		}
+		if(e->password_len == 0 || (p < end && *p != '\n')) {
+			ngx_log_error(NGX_LOG_EMERG, log, 0, "Invalid line %uz in password file \"%V\", expected <passwordID> <password>",
+					line, &(file->path));
+			if(pool == NULL) {
+				ngx_free(pwds);
+			}
+			return NULL;
+		}
+		p++;
+		n++;
+	}
+	if(n == 0) {
+		ngx_log_error(NGX_LOG_EMERG, log, 0, "No passwords in password file \"%V\"", &(file->path));
+		if(pool == NULL) {
+			ngx_free(pwds);
+		}
+		return NULL;
+	}
+
+	if(pool != NULL) {
+		rc = ngx_http_dlg_auth_pwds_init(pwds, entries, n, pool_alloc, pool);
+	} else {
+		rc = ngx_http_dlg_auth_pwds_init(pwds, entries, n, heap_alloc, log);
+	}
+	if(rc != NGX_OK) {
+		if(pool == NULL) {
+			ngx_free(pwds);
+		}
+		return NULL;
+	}
+
+	return pwds;
+}
+
+static ngx_uint_t pwds_busy(void *data) {
+	return ((ngx_http_dlg_auth_pwds_t *) data)->busy;
+}
+
+/*
+ * Free passwords read by a worker.
+ */
+static void free_pwds(void *data) {
+	ngx_http_dlg_auth_pwds_t *pwds = data;
+
+	ngx_free(pwds->index.slots);
+	ngx_free(pwds);
+}
+
+static void *heap_alloc(void *log, size_t size) {
+	return ngx_alloc(size, (ngx_log_t *) log);
+}
+
+static void *pool_alloc(void *pool, size_t size) {
+	return ngx_palloc((ngx_pool_t *) pool, size);
+}
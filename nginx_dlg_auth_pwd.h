@@ -0,0 +1,42 @@
+#ifndef NGX_HTTP_DLG_AUTH_PWD_H
+#define NGX_HTTP_DLG_AUTH_PWD_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "nginx_dlg_auth.h"
+
+/*
+ * Iron password tables read from a file, so passwords can be rotated without
+ * reloading nginx.
+ *
+ * The file holds one '<passwordID> <password>' pair per line, empty lines and
+ * lines starting with '#' are ignored. It is watched for changes like all files
+ * of the module (see nginx_dlg_auth_file.h), a reload replaces the passwords of
+ * the table. A file that cannot be read or parsed leaves the passwords as they are.
+ *
+ * The file is read through mmap and copied, so that rewriting the file in place
+ * cannot change passwords in use.
+ */
+
+/*
+ * Handler for the dlg_auth_iron_pwd_file directive:
+ *
+ *     dlg_auth_iron_pwd_file <name> <path> [<check interval>]
+ */
+char *ngx_http_dlg_auth_iron_pwd_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Fill pwds with the given entries: compute the fingerprint and build the password
+ * id index, allocated with alloc. Returns NGX_OK or NGX_ERROR.
+ */
+ngx_int_t ngx_http_dlg_auth_pwds_init(ngx_http_dlg_auth_pwds_t *pwds, struct CironPwdTableEntry *entries,
+		ngx_uint_t nentries, PwdIndexAllocator alloc, void *alloc_ctx);
+
+/*
+ * Start checking the password files of all tables for changes. Called from
+ * init_process.
+ */
+ngx_int_t ngx_http_dlg_auth_pwd_file_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_main_conf_t *mcf);
+
+#endif /* NGX_HTTP_DLG_AUTH_PWD_H */
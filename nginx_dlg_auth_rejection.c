@@ -0,0 +1,186 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_rejection.h"
+
+/*
+ * By default log one of 100 rejections of a reason.
+ */
+#define DEFAULT_SAMPLE 100
+
+/*
+ * Shared part of the zone.
+ */
+typedef struct ngx_http_dlg_auth_rejection_sh_s {
+	/* Rejections per reason since the zone was created */
+	ngx_atomic_t counts[DLG_AUTH_NREASONS];
+	/* Counts at the time of the last summary */
+	ngx_atomic_t reported[DLG_AUTH_NREASONS];
+	/* Time of the last summary, the worker that moves it on logs the next one */
+	ngx_atomic_t last;
+} ngx_http_dlg_auth_rejection_sh_t;
+
+static ngx_str_t reason_names[DLG_AUTH_NREASONS] = {
+	ngx_string("header"),
+	ngx_string("length"),
+	ngx_string("pwd"),
+	ngx_string("unseal"),
+	ngx_string("ticket"),
+	ngx_string("negative"),
+	ngx_string("revoked"),
+	ngx_string("expired"),
+	ngx_string("realm"),
+	ngx_string("signature"),
+	ngx_string("skew"),
+	ngx_string("replay"),
+	ngx_string("method"),
+	ngx_string("limit")
+};
+
+static ngx_int_t ngx_http_dlg_auth_rejection_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void log_summary(ngx_event_t *ev);
+
+
+char *ngx_http_dlg_auth_rejection_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_main_conf_t *mcf = conf;
+	ngx_http_dlg_auth_rejection_log_t *rlog;
+	ngx_str_t name = ngx_string("dlg_auth_rejections");
+	ngx_str_t *value;
+	ngx_int_t interval;
+	ngx_int_t sample;
+
+	if(mcf->rejection_log != NULL) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if( (interval = ngx_parse_time(&(value[1]), 1)) == NGX_ERROR || interval == 0) {
+		ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid summary interval \"%V\"", &(value[1]));
+		return NGX_CONF_ERROR;
+	}
+
+	sample = DEFAULT_SAMPLE;
+	if(cf->args->nelts == 3) {
+		if(value[2].len <= 7 || ngx_strncmp(value[2].data, "sample=", 7) != 0
+				|| (sample = ngx_atoi(value[2].data + 7, value[2].len - 7)) == NGX_ERROR) {
+			ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &(value[2]));
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if( (rlog = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_rejection_log_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	rlog->interval = (time_t) interval;
+	rlog->sample = (ngx_uint_t) sample;
+
+	if( (rlog->zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &nginx_dlg_auth_module)) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	rlog->zone->init = ngx_http_dlg_auth_rejection_init_zone;
+	rlog->zone->data = rlog;
+
+	mcf->rejection_log = rlog;
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Set up the shared part of the zone or take it over on reload.
+ */
+static ngx_int_t ngx_http_dlg_auth_rejection_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_rejection_log_t *orlog = data;
+	ngx_http_dlg_auth_rejection_log_t *rlog;
+	ngx_slab_pool_t *shpool;
+
+	rlog = shm_zone->data;
+
+	if(orlog != NULL) {
+		rlog->sh = orlog->sh;
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		rlog->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	if( (rlog->sh = ngx_slab_alloc(shpool, sizeof(ngx_http_dlg_auth_rejection_sh_t))) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_memzero(rlog->sh, sizeof(ngx_http_dlg_auth_rejection_sh_t));
+	rlog->sh->last = (ngx_atomic_uint_t) ngx_time();
+	shpool->data = rlog->sh;
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_rejection_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_rejection_log_t *rlog) {
+	ngx_event_t *ev;
+
+	if(rlog == NULL) {
+		return NGX_OK;
+	}
+	ev = &(rlog->summary_event);
+	ev->handler = log_summary;
+	ev->data = rlog;
+	ev->log = cycle->log;
+	/* Do not keep the worker from exiting on shutdown */
+	ngx_http_dlg_auth_timer_cancelable(ev);
+	ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll((ngx_msec_t) rlog->interval * 1000));
+	return NGX_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_rejection(ngx_http_dlg_auth_rejection_log_t *rlog, ngx_uint_t reason) {
+	ngx_atomic_uint_t n;
+
+	if(rlog == NULL) {
+		return 1;
+	}
+	n = ngx_atomic_fetch_add(&(rlog->sh->counts[reason]), 1);
+	return rlog->sample != 0 && n % rlog->sample == 0;
+}
+
+/*
+ * Timer handler, log the rejections since the last summary unless another
+ * worker has done so or the interval has not passed yet, as on the polls of
+ * nginx versions without cancelable timers.
+ */
+static void log_summary(ngx_event_t *ev) {
+	ngx_http_dlg_auth_rejection_log_t *rlog = ev->data;
+	ngx_http_dlg_auth_rejection_sh_t *sh = rlog->sh;
+	u_char line[NGX_MAX_ERROR_STR];
+	u_char *p;
+	ngx_atomic_uint_t last, now, n, total;
+	ngx_uint_t i;
+
+	if(ngx_exiting || ngx_quit || ngx_terminate) {
+		return;
+	}
+
+	now = (ngx_atomic_uint_t) ngx_time();
+	last = sh->last;
+	if(now - last >= (ngx_atomic_uint_t) rlog->interval && ngx_atomic_cmp_set(&(sh->last), last, now)) {
+		p = line;
+		total = 0;
+		for(i = 0; i < DLG_AUTH_NREASONS; i++) {
+			n = sh->counts[i] - sh->reported[i];
+			sh->reported[i] += n;
+			if(n > 0) {
+				p = ngx_slprintf(p, line + sizeof(line), " %V=%uA", &reason_names[i], n);
+				total += n;
+			}
+		}
+		if(total > 0) {
+			ngx_log_error(NGX_LOG_ERR, ev->log, 0, "Rejected %uA requests in the last %uAs:%*s", total, now - last,
+					p - line, line);
+		}
+	}
+
+	ngx_add_timer(ev, ngx_http_dlg_auth_timer_poll((ngx_msec_t) rlog->interval * 1000));
+}
@@ -0,0 +1,77 @@
+#ifndef NGX_HTTP_DLG_AUTH_REJECTION_H
+#define NGX_HTTP_DLG_AUTH_REJECTION_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Rejection logging.
+ *
+ * By default every rejected request is logged with its own error_log line.
+ * With dlg_auth_rejection_log, rejections are counted per reason in a shared
+ * memory zone and only one of every sample rejections of a reason is logged
+ * individually (the message is not even formatted for the others). Every
+ * interval one worker logs a summary line with the counts since the last one.
+ */
+
+/*
+ * Reasons of rejections.
+ */
+/* Authorization header cannot be parsed */
+#define DLG_AUTH_REJECT_HEADER 0
+/* Sealed ticket too long to be unsealed */
+#define DLG_AUTH_REJECT_LENGTH 1
+/* Password id of the ticket unknown */
+#define DLG_AUTH_REJECT_PWD 2
+/* Ticket cannot be unsealed */
+#define DLG_AUTH_REJECT_UNSEAL 3
+/* Ticket cannot be parsed or lacks a member */
+#define DLG_AUTH_REJECT_TICKET 4
+/* Ticket failed to unseal before */
+#define DLG_AUTH_REJECT_NEGATIVE 5
+#define DLG_AUTH_REJECT_REVOKED 6
+#define DLG_AUTH_REJECT_EXPIRED 7
+/* Ticket does not grant the realm */
+#define DLG_AUTH_REJECT_REALM 8
+/* Invalid request signature */
+#define DLG_AUTH_REJECT_SIGNATURE 9
+#define DLG_AUTH_REJECT_SKEW 10
+/* Nonce used before */
+#define DLG_AUTH_REJECT_REPLAY 11
+/* Unsafe method with a read-only ticket */
+#define DLG_AUTH_REJECT_METHOD 12
+/* Client over its rate limit */
+#define DLG_AUTH_REJECT_LIMIT 13
+#define DLG_AUTH_NREASONS 14
+
+typedef struct ngx_http_dlg_auth_rejection_log_s {
+	ngx_shm_zone_t *zone;
+	struct ngx_http_dlg_auth_rejection_sh_s *sh;
+	/* Summary interval in seconds */
+	time_t interval;
+	/* Log one of sample rejections per reason individually, 0 for none */
+	ngx_uint_t sample;
+	ngx_event_t summary_event;
+} ngx_http_dlg_auth_rejection_log_t;
+
+/*
+ * Handler for the dlg_auth_rejection_log directive:
+ *
+ *     dlg_auth_rejection_log <summary interval> [sample=<number>]
+ */
+char *ngx_http_dlg_auth_rejection_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Start logging summaries. Called from init_process.
+ */
+ngx_int_t ngx_http_dlg_auth_rejection_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_rejection_log_t *rlog);
+
+/*
+ * Count a rejection. Returns 1 if it is to be logged individually, which is
+ * always the case without dlg_auth_rejection_log (rlog is NULL). Only uses
+ * atomic operations, so it can be called from a thread.
+ */
+ngx_int_t ngx_http_dlg_auth_rejection(ngx_http_dlg_auth_rejection_log_t *rlog, ngx_uint_t reason);
+
+#endif /* NGX_HTTP_DLG_AUTH_REJECTION_H */
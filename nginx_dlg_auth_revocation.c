@@ -0,0 +1,122 @@
+#include <sys/mman.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "revocation.h"
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_file.h"
+#include "nginx_dlg_auth_revocation.h"
+
+static void *map_revocation_file(ngx_http_dlg_auth_file_t *file, ngx_pool_t *pool, ngx_log_t *log);
+static ngx_uint_t revocations_busy(void *data);
+static void unmap_revocations(void *data);
+static void swap_revocations(ngx_http_dlg_auth_file_t *file, void *data, ngx_log_t *log);
+
+char *ngx_http_dlg_auth_revocation_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_dlg_auth_main_conf_t *mcf = conf;
+	ngx_http_dlg_auth_file_t *file;
+	ngx_str_t *value;
+
+	if(mcf->revocation_file != NULL) {
+		return "is duplicate";
+	}
+
+	value = cf->args->elts;
+
+	if( (file = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_file_t))) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+	file->kind = "revocation file";
+	file->load = map_revocation_file;
+	file->busy = revocations_busy;
+	file->free = unmap_revocations;
+	file->swap = swap_revocations;
+
+	/*
+	 * Map the file right away, a broken file is a configuration error. The
+	 * mapping is shared with the workers and released with the cycle.
+	 */
+	if(ngx_http_dlg_auth_file_conf(cf, file, &(value[1]), (cf->args->nelts == 3) ? &(value[2]) : NULL) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->revocation_file = file;
+
+	return NGX_CONF_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_revocation_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_file_t *file) {
+	if(file == NULL) {
+		return NGX_OK;
+	}
+	return ngx_http_dlg_auth_file_init_worker(cycle, file);
+}
+
+ngx_int_t ngx_http_dlg_auth_revoked(ngx_http_dlg_auth_revocations_t *revocations, Ticket ticket, HawkcString *id) {
+	if(revocation_contains(&(revocations->set), REVOCATION_CLIENT, ticket->client.data, ticket->client.len)) {
+		return 1;
+	}
+	return revocation_contains(&(revocations->set), REVOCATION_TICKET, id->data, id->len);
+}
+
+/*
+ * Log the new set after a reload of the file, requests take it from file->current.
+ */
+static void swap_revocations(ngx_http_dlg_auth_file_t *file, void *data, ngx_log_t *log) {
+	ngx_http_dlg_auth_revocations_t *revocations = data;
+
+	ngx_log_error(NGX_LOG_NOTICE, log, 0, "Reloaded %uz revoked clients and %uz revoked tickets from \"%V\"",
+			revocations->set.nclients, revocations->set.ntickets, &(file->path));
+}
+
+/*
+ * Map and validate the revocation file. A set mapped during configuration is
+ * unmapped with pool.
+ */
+static void *map_revocation_file(ngx_http_dlg_auth_file_t *file, ngx_pool_t *pool, ngx_log_t *log) {
+	ngx_http_dlg_auth_revocations_t *revocations;
+	ngx_pool_cleanup_t *cln;
+	u_char *map;
+	size_t size;
+	const char *error;
+
+	cln = NULL;
+	if(pool != NULL && (cln = ngx_pool_cleanup_add(pool, 0)) == NULL) {
+		return NULL;
+	}
+	if( (map = ngx_http_dlg_auth_file_map(file, MAP_SHARED, &size, log)) == NULL) {
+		return NULL;
+	}
+
+	if( (revocations = ngx_alloc(sizeof(ngx_http_dlg_auth_revocations_t), log)) == NULL) {
+		munmap(map, size);
+		return NULL;
+	}
+	revocations->map = map;
+	revocations->len = size;
+	revocations->busy = 0;
+
+	if( (error = revocation_open(&(revocations->set), map, size)) != NULL) {
+		ngx_log_error(NGX_LOG_EMERG, log, 0, "Invalid revocation file \"%V\": %s", &(file->path), error);
+		unmap_revocations(revocations);
+		return NULL;
+	}
+
+	if(cln != NULL) {
+		cln->handler = unmap_revocations;
+		cln->data = revocations;
+	}
+	return revocations;
+}
+
+static ngx_uint_t revocations_busy(void *data) {
+	return ((ngx_http_dlg_auth_revocations_t *) data)->busy;
+}
+
+static void unmap_revocations(void *data) {
+	ngx_http_dlg_auth_revocations_t *revocations = data;
+
+	munmap(revocations->map, revocations->len);
+	ngx_free(revocations);
+}
@@ -0,0 +1,52 @@
+#ifndef NGX_HTTP_DLG_AUTH_REVOCATION_H
+#define NGX_HTTP_DLG_AUTH_REVOCATION_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <hawkc.h>
+#include "ticket.h"
+#include "revocation.h"
+#include "nginx_dlg_auth_file.h"
+
+/*
+ * Revoked client ids and tickets, read from a file built with
+ * bench/revocation_build (see revocation.h for the format).
+ *
+ * The file is mapped into memory and used in place. Like password files, it is
+ * watched for changes (see nginx_dlg_auth_file.h) and mapped again when it
+ * changed. A file that cannot be read or is invalid leaves the current set in
+ * use. The file must be replaced by renaming a new one over it, the mapping of
+ * the old one stays valid until it is unmapped.
+ */
+
+/*
+ * A mapped revocation file.
+ */
+typedef struct ngx_http_dlg_auth_revocations_s {
+	struct RevocationSet set;
+	u_char *map;
+	size_t len;
+	/* Number of thread tasks using the set, only changed by the event loop */
+	ngx_uint_t busy;
+} ngx_http_dlg_auth_revocations_t;
+
+/*
+ * Handler for the dlg_auth_revocation_file directive:
+ *
+ *     dlg_auth_revocation_file <path> [<check interval>]
+ */
+char *ngx_http_dlg_auth_revocation_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Start checking the revocation file for changes. Called from init_process.
+ */
+ngx_int_t ngx_http_dlg_auth_revocation_init_worker(ngx_cycle_t *cycle, ngx_http_dlg_auth_file_t *file);
+
+/*
+ * Returns 1 if the client of the ticket or the sealed ticket id is revoked.
+ * Does not touch anything but the set, so it can be called from a thread.
+ */
+ngx_int_t ngx_http_dlg_auth_revoked(ngx_http_dlg_auth_revocations_t *revocations, Ticket ticket, HawkcString *id);
+
+#endif /* NGX_HTTP_DLG_AUTH_REVOCATION_H */
@@ -0,0 +1,416 @@
+#include <time.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_stats.h"
+#include "nginx_dlg_auth_limit.h"
+
+/*
+ * Histogram bucket i counts durations below 2^i ns, the last bucket
+ * everything from 2^(NBUCKETS-2) ns, about a second, on.
+ */
+#define NBUCKETS 32
+
+/*
+ * Number of counter shards, workers use shard ngx_process_slot % NSHARDS.
+ */
+#define NSHARDS 8
+
+typedef struct {
+	ngx_atomic_t count;
+	ngx_atomic_t sum;
+	ngx_atomic_t buckets[NBUCKETS];
+} ngx_http_dlg_auth_histogram_t;
+
+typedef struct {
+	ngx_http_dlg_auth_histogram_t stages[DLG_AUTH_NSTAGES];
+	ngx_atomic_t outcomes[DLG_AUTH_NOUTCOMES];
+	ngx_atomic_t counters[DLG_AUTH_NCOUNTERS];
+} ngx_http_dlg_auth_realm_stats_t;
+
+/*
+ * Shared part of the zone. realms holds NSHARDS * nrealms entries, shard by shard.
+ */
+typedef struct {
+	/* Identifies the realm list the counters belong to */
+	uint32_t layout;
+	ngx_uint_t nrealms;
+	ngx_http_dlg_auth_realm_stats_t realms[1];
+} ngx_http_dlg_auth_stats_sh_t;
+
+typedef struct {
+	ngx_http_dlg_auth_stats_sh_t *sh;
+	ngx_uint_t nrealms;
+	uint32_t layout;
+} ngx_http_dlg_auth_stats_t;
+
+static ngx_str_t stage_names[DLG_AUTH_NSTAGES] = {
+	ngx_string("parse"),
+	ngx_string("cache"),
+	ngx_string("unseal"),
+	ngx_string("ticket"),
+	ngx_string("grants"),
+	ngx_string("hmac"),
+	ngx_string("nonce"),
+	ngx_string("total")
+};
+
+static ngx_str_t outcome_names[DLG_AUTH_NOUTCOMES] = {
+	ngx_string("ok"),
+	ngx_string("401"),
+	ngx_string("401_skew"),
+	ngx_string("400"),
+	ngx_string("403"),
+	ngx_string("429"),
+	ngx_string("error")
+};
+
+static ngx_str_t counter_names[DLG_AUTH_NCOUNTERS] = {
+	ngx_string("negative_hit"),
+	ngx_string("negative_store")
+};
+
+static ngx_int_t ngx_http_dlg_auth_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_dlg_auth_status_handler(ngx_http_request_t *r);
+static uint64_t ngx_http_dlg_auth_stats_ns(void);
+static void record(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t stage, uint64_t ns);
+
+
+char *ngx_http_dlg_auth_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+	ngx_http_core_loc_conf_t *clcf;
+	ngx_http_dlg_auth_main_conf_t *mcf;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+	mcf->status = 1;
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+	clcf->handler = ngx_http_dlg_auth_status_handler;
+
+	return NGX_CONF_OK;
+}
+
+ngx_int_t ngx_http_dlg_auth_stats_add_realm(ngx_conf_t *cf, ngx_str_t *realm) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+	ngx_str_t *realms;
+	ngx_str_t *s;
+	ngx_uint_t i;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+
+	realms = mcf->realms.elts;
+	for(i = 0; i < mcf->realms.nelts; i++) {
+		if(realms[i].len == realm->len && ngx_strncmp(realms[i].data, realm->data, realm->len) == 0) {
+			return i;
+		}
+	}
+	if( (s = ngx_array_push(&mcf->realms)) == NULL) {
+		return NGX_ERROR;
+	}
+	*s = *realm;
+	return mcf->realms.nelts - 1;
+}
+
+ngx_int_t ngx_http_dlg_auth_stats_init(ngx_conf_t *cf) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+	ngx_http_dlg_auth_stats_t *ctx;
+	ngx_str_t name = ngx_string("dlg_auth_status");
+	ngx_str_t *realms;
+	ngx_uint_t i;
+	size_t size;
+
+	mcf = ngx_http_conf_get_module_main_conf(cf, nginx_dlg_auth_module);
+	if(!mcf->status) {
+		return NGX_OK;
+	}
+
+	if( (ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_dlg_auth_stats_t))) == NULL) {
+		return NGX_ERROR;
+	}
+	/* Always have one realm, so that there is no zero sized array */
+	ctx->nrealms = mcf->realms.nelts > 0 ? mcf->realms.nelts : 1;
+
+	ngx_crc32_init(ctx->layout);
+	realms = mcf->realms.elts;
+	for(i = 0; i < mcf->realms.nelts; i++) {
+		ngx_crc32_update(&ctx->layout, (u_char *) &(realms[i].len), sizeof(realms[i].len));
+		ngx_crc32_update(&ctx->layout, realms[i].data, realms[i].len);
+	}
+	ngx_crc32_final(ctx->layout);
+
+	size = offsetof(ngx_http_dlg_auth_stats_sh_t, realms) + NSHARDS * ctx->nrealms * sizeof(ngx_http_dlg_auth_realm_stats_t);
+	size = ngx_align(size, ngx_pagesize) + 8 * ngx_pagesize;
+
+	if( (mcf->stats_zone = ngx_shared_memory_add(cf, &name, size, &nginx_dlg_auth_module)) == NULL) {
+		return NGX_ERROR;
+	}
+	mcf->stats_zone->init = ngx_http_dlg_auth_stats_init_zone;
+	mcf->stats_zone->data = ctx;
+
+	return NGX_OK;
+}
+
+/*
+ * Set up the shared part of the zone or take it over on reload. Counters
+ * are kept across reloads unless the realms have changed.
+ */
+static ngx_int_t ngx_http_dlg_auth_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+	ngx_http_dlg_auth_stats_t *octx = data;
+	ngx_http_dlg_auth_stats_t *ctx;
+	ngx_slab_pool_t *shpool;
+	size_t size;
+
+	ctx = shm_zone->data;
+	size = offsetof(ngx_http_dlg_auth_stats_sh_t, realms) + NSHARDS * ctx->nrealms * sizeof(ngx_http_dlg_auth_realm_stats_t);
+
+	if(octx != NULL) {
+		ctx->sh = octx->sh;
+		if(ctx->sh->layout != ctx->layout || ctx->sh->nrealms != ctx->nrealms) {
+			ngx_memzero(ctx->sh, size);
+			ctx->sh->layout = ctx->layout;
+			ctx->sh->nrealms = ctx->nrealms;
+		}
+		return NGX_OK;
+	}
+
+	shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+	if(shm_zone->shm.exists) {
+		ctx->sh = shpool->data;
+		return NGX_OK;
+	}
+
+	if( (ctx->sh = ngx_slab_alloc(shpool, size)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_memzero(ctx->sh, size);
+	ctx->sh->layout = ctx->layout;
+	ctx->sh->nrealms = ctx->nrealms;
+	shpool->data = ctx->sh;
+
+	return NGX_OK;
+}
+
+void ngx_http_dlg_auth_timer_start(ngx_http_request_t *r, ngx_uint_t realm, ngx_http_dlg_auth_timer_t *timer) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+
+	mcf = ngx_http_get_module_main_conf(r, nginx_dlg_auth_module);
+	timer->zone = mcf->stats_zone;
+	timer->realm = realm;
+	timer->outcome = DLG_AUTH_OUTCOME_OK;
+	if(timer->zone == NULL) {
+		return;
+	}
+	timer->start = ngx_http_dlg_auth_stats_ns();
+	timer->last = timer->start;
+}
+
+void ngx_http_dlg_auth_timer_stage(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t stage) {
+	uint64_t now;
+
+	if(timer->zone == NULL) {
+		return;
+	}
+	now = ngx_http_dlg_auth_stats_ns();
+	record(timer, stage, now - timer->last);
+	timer->last = now;
+}
+
+void ngx_http_dlg_auth_timer_finish(ngx_http_dlg_auth_timer_t *timer, ngx_int_t rc) {
+	ngx_http_dlg_auth_stats_t *ctx;
+	ngx_uint_t outcome;
+
+	if(timer->zone == NULL) {
+		return;
+	}
+	record(timer, DLG_AUTH_STAGE_TOTAL, ngx_http_dlg_auth_stats_ns() - timer->start);
+
+	switch(rc) {
+	case NGX_OK:
+		outcome = DLG_AUTH_OUTCOME_OK;
+		break;
+	case NGX_HTTP_UNAUTHORIZED:
+		outcome = (timer->outcome == DLG_AUTH_OUTCOME_401_SKEW) ? DLG_AUTH_OUTCOME_401_SKEW : DLG_AUTH_OUTCOME_401;
+		break;
+	case NGX_HTTP_BAD_REQUEST:
+		outcome = DLG_AUTH_OUTCOME_400;
+		break;
+	case NGX_HTTP_FORBIDDEN:
+		outcome = DLG_AUTH_OUTCOME_403;
+		break;
+	case NGX_HTTP_TOO_MANY_REQUESTS:
+		outcome = DLG_AUTH_OUTCOME_429;
+		break;
+	default:
+		outcome = DLG_AUTH_OUTCOME_ERROR;
+	}
+
+	ctx = timer->zone->data;
+	ngx_atomic_fetch_add(&(ctx->sh->realms[((ngx_uint_t) ngx_process_slot % NSHARDS) * ctx->nrealms + timer->realm].outcomes[outcome]), 1);
+}
+
+void ngx_http_dlg_auth_timer_count(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t counter) {
+	ngx_http_dlg_auth_stats_t *ctx;
+
+	if(timer->zone == NULL) {
+		return;
+	}
+	ctx = timer->zone->data;
+	ngx_atomic_fetch_add(&(ctx->sh->realms[((ngx_uint_t) ngx_process_slot % NSHARDS) * ctx->nrealms + timer->realm].counters[counter]), 1);
+}
+
+static void record(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t stage, uint64_t ns) {
+	ngx_http_dlg_auth_stats_t *ctx;
+	ngx_http_dlg_auth_histogram_t *h;
+	ngx_uint_t i;
+
+	ctx = timer->zone->data;
+	h = &(ctx->sh->realms[((ngx_uint_t) ngx_process_slot % NSHARDS) * ctx->nrealms + timer->realm].stages[stage]);
+
+	/* Index of the highest bit set plus one, i.e. the smallest i with ns < 2^i */
+#if defined(__GNUC__)
+	i = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+#else
+	for(i = 0; i < 64 && (ns >> i) != 0; i++) { /* void */ }
+#endif
+	if(i >= NBUCKETS) {
+		i = NBUCKETS - 1;
+	}
+
+	ngx_atomic_fetch_add(&h->count, 1);
+	ngx_atomic_fetch_add(&h->sum, (ngx_atomic_int_t) ns);
+	ngx_atomic_fetch_add(&h->buckets[i], 1);
+}
+
+static uint64_t ngx_http_dlg_auth_stats_ns(void) {
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	ngx_gettimeofday(&tv);
+	return (uint64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/*
+ * Serve the statistics as plain text, one line per realm with the outcome and
+ * event counters and one per realm and stage. Histogram buckets are given as <bound>:<count>,
+ * where bound is the exclusive upper bound in ns ('inf' for the last bucket).
+ * Empty buckets are left out.
+ *
+ *   realm=NEWS ok=10 401=2 401_skew=0 400=1 403=0 429=0 error=0 negative_hit=0 negative_store=1
+ *   realm=NEWS stage=parse count=13 sum_ns=20480 1024:3 2048:10
+ */
+static ngx_int_t ngx_http_dlg_auth_status_handler(ngx_http_request_t *r) {
+	ngx_http_dlg_auth_main_conf_t *mcf;
+	ngx_http_dlg_auth_stats_t *ctx;
+	ngx_http_dlg_auth_realm_stats_t *rs;
+	ngx_http_dlg_auth_histogram_t *h;
+	ngx_str_t *realms;
+	ngx_str_t realm;
+	ngx_atomic_uint_t counts[NBUCKETS + 2];
+	ngx_int_t rc;
+	ngx_uint_t i, j, k, n;
+	ngx_buf_t *b;
+	ngx_chain_t out;
+	size_t size;
+
+	if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+	if( (rc = ngx_http_discard_request_body(r)) != NGX_OK) {
+		return rc;
+	}
+
+	mcf = ngx_http_get_module_main_conf(r, nginx_dlg_auth_module);
+	ctx = mcf->stats_zone->data;
+	realms = mcf->realms.elts;
+
+	size = 0;
+	for(i = 0; i < mcf->realms.nelts; i++) {
+		size += (realms[i].len + sizeof("realm= stage= count= sum_ns=") + 2 * NGX_ATOMIC_T_LEN
+				+ NBUCKETS * (NGX_ATOMIC_T_LEN + 12)) * DLG_AUTH_NSTAGES;
+		size += realms[i].len + sizeof("realm=") + (DLG_AUTH_NOUTCOMES + DLG_AUTH_NCOUNTERS) * (NGX_ATOMIC_T_LEN + 16);
+	}
+
+	r->headers_out.status = NGX_HTTP_OK;
+	r->headers_out.content_length_n = 0;
+	ngx_str_set(&r->headers_out.content_type, "text/plain");
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+	if(size == 0 || r->method == NGX_HTTP_HEAD) {
+		r->header_only = 1;
+		return ngx_http_send_header(r);
+	}
+
+	if( (b = ngx_create_temp_buf(r->pool, size)) == NULL) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	for(i = 0; i < mcf->realms.nelts; i++) {
+		realm = realms[i];
+
+		ngx_memzero(counts, sizeof(counts));
+		for(k = 0; k < NSHARDS; k++) {
+			rs = &(ctx->sh->realms[k * ctx->nrealms + i]);
+			for(j = 0; j < DLG_AUTH_NOUTCOMES; j++) {
+				counts[j] += rs->outcomes[j];
+			}
+			for(j = 0; j < DLG_AUTH_NCOUNTERS; j++) {
+				counts[DLG_AUTH_NOUTCOMES + j] += rs->counters[j];
+			}
+		}
+		b->last = ngx_slprintf(b->last, b->end, "realm=%V", &realm);
+		for(j = 0; j < DLG_AUTH_NOUTCOMES; j++) {
+			b->last = ngx_slprintf(b->last, b->end, " %V=%uA", &outcome_names[j], counts[j]);
+		}
+		for(j = 0; j < DLG_AUTH_NCOUNTERS; j++) {
+			b->last = ngx_slprintf(b->last, b->end, " %V=%uA", &counter_names[j], counts[DLG_AUTH_NOUTCOMES + j]);
+		}
+		b->last = ngx_slprintf(b->last, b->end, "\n");
+
+		for(j = 0; j < DLG_AUTH_NSTAGES; j++) {
+			ngx_memzero(counts, sizeof(counts));
+			for(k = 0; k < NSHARDS; k++) {
+				h = &(ctx->sh->realms[k * ctx->nrealms + i].stages[j]);
+				counts[0] += h->count;
+				counts[1] += h->sum;
+				for(n = 0; n < NBUCKETS; n++) {
+					counts[n + 2] += h->buckets[n];
+				}
+			}
+			b->last = ngx_slprintf(b->last, b->end, "realm=%V stage=%V count=%uA sum_ns=%uA", &realm, &stage_names[j],
+					counts[0], counts[1]);
+			for(n = 0; n < NBUCKETS; n++) {
+				if(counts[n + 2] == 0) {
+					continue;
+				}
+				if(n == NBUCKETS - 1) {
+					b->last = ngx_slprintf(b->last, b->end, " inf:%uA", counts[n + 2]);
+				} else {
+					b->last = ngx_slprintf(b->last, b->end, " %uL:%uA", (uint64_t) 1 << n, counts[n + 2]);
+				}
+			}
+			b->last = ngx_slprintf(b->last, b->end, "\n");
+		}
+	}
+
+	r->headers_out.content_length_n = b->last - b->pos;
+	b->last_buf = (r == r->main) ? 1 : 0;
+	b->last_in_chain = 1;
+
+	out.buf = b;
+	out.next = NULL;
+
+	rc = ngx_http_send_header(r);
+	if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+
+	return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,102 @@
+#ifndef NGX_HTTP_DLG_AUTH_STATS_H
+#define NGX_HTTP_DLG_AUTH_STATS_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Request processing statistics, served by the dlg_auth_status handler.
+ *
+ * For every realm used with dlg_auth, the shared memory zone holds a log2 scale
+ * latency histogram per processing stage and a counter per request outcome.
+ * Updates are atomic additions only. To keep workers from contending for the
+ * same cache lines, counters are sharded by worker number and only summed up
+ * when the status is served.
+ *
+ * Statistics are only collected if dlg_auth_status is used in some location.
+ */
+
+/*
+ * Processing stages, see ngx_dlg_auth_authenticate.
+ */
+#define DLG_AUTH_STAGE_PARSE 0
+#define DLG_AUTH_STAGE_CACHE 1
+#define DLG_AUTH_STAGE_UNSEAL 2
+#define DLG_AUTH_STAGE_TICKET 3
+#define DLG_AUTH_STAGE_GRANTS 4
+#define DLG_AUTH_STAGE_HMAC 5
+#define DLG_AUTH_STAGE_NONCE 6
+#define DLG_AUTH_STAGE_TOTAL 7
+#define DLG_AUTH_NSTAGES 8
+
+/*
+ * Request outcomes.
+ */
+#define DLG_AUTH_OUTCOME_OK 0
+#define DLG_AUTH_OUTCOME_401 1
+#define DLG_AUTH_OUTCOME_401_SKEW 2
+#define DLG_AUTH_OUTCOME_400 3
+#define DLG_AUTH_OUTCOME_403 4
+#define DLG_AUTH_OUTCOME_429 5
+#define DLG_AUTH_OUTCOME_ERROR 6
+#define DLG_AUTH_NOUTCOMES 7
+
+/*
+ * Event counters.
+ */
+/* Requests answered from the negative cache, i.e. unseals avoided */
+#define DLG_AUTH_COUNTER_NEGATIVE_HIT 0
+/* Unseal failures stored in the negative cache */
+#define DLG_AUTH_COUNTER_NEGATIVE_STORE 1
+#define DLG_AUTH_NCOUNTERS 2
+
+/*
+ * Per request timing state. Lives on the stack of the access handler.
+ */
+typedef struct {
+	/* Statistics zone, NULL if statistics are not collected */
+	ngx_shm_zone_t *zone;
+	ngx_uint_t realm;
+	uint64_t start;
+	uint64_t last;
+	/* Set to DLG_AUTH_OUTCOME_401_SKEW to tell a skew 401 from others */
+	ngx_uint_t outcome;
+} ngx_http_dlg_auth_timer_t;
+
+/*
+ * Handler for the dlg_auth_status directive.
+ */
+char *ngx_http_dlg_auth_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Register a realm during configuration merge. Returns the index to pass to
+ * ngx_http_dlg_auth_timer_start or NGX_ERROR.
+ */
+ngx_int_t ngx_http_dlg_auth_stats_add_realm(ngx_conf_t *cf, ngx_str_t *realm);
+
+/*
+ * Add the statistics zone if dlg_auth_status is used. Must be called from
+ * postconfiguration, when all realms are known.
+ */
+ngx_int_t ngx_http_dlg_auth_stats_init(ngx_conf_t *cf);
+
+void ngx_http_dlg_auth_timer_start(ngx_http_request_t *r, ngx_uint_t realm, ngx_http_dlg_auth_timer_t *timer);
+
+/*
+ * Record the time since the previous stage (or start) as time of the given stage.
+ */
+void ngx_http_dlg_auth_timer_stage(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t stage);
+
+/*
+ * Record the total time and the outcome of the request, derived from the
+ * access handler's return code.
+ */
+void ngx_http_dlg_auth_timer_finish(ngx_http_dlg_auth_timer_t *timer, ngx_int_t rc);
+
+/*
+ * Count an event for the realm of the request.
+ */
+void ngx_http_dlg_auth_timer_count(ngx_http_dlg_auth_timer_t *timer, ngx_uint_t counter);
+
+#endif /* NGX_HTTP_DLG_AUTH_STATS_H */
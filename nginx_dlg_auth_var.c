@@ -8,24 +8,37 @@
 */
 
 #include "nginx_dlg_auth.h"
+#include "nginx_dlg_auth_cache.h"
 
 /*
- * Fill client variable from module per request context.
+ * Identifies the counter a ticket cache variable reports.
  */
-static ngx_int_t ngx_http_dlg_auth_client_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+#define CACHE_WORKER_HITS 0
+#define CACHE_WORKER_MISSES 1
+#define CACHE_ZONE_HITS 2
+#define CACHE_ZONE_MISSES 3
+
+/*
+ * Fill client, user, owner and scopes variables from the ticket retained in the
+ * module per request context. data is the offset of the string in the context.
+ * The value points into the context, nothing is copied.
+ */
+static ngx_int_t ngx_http_dlg_auth_string_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
 	ngx_http_dlg_auth_ctx_t *ctx;
+	ngx_str_t *s;
 
-	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL) {
+	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL || !ctx->has_ticket) {
 		v->not_found = 1;
 		return NGX_OK;
 	}
-	if(ctx->client.len == 0) {
+	s = (ngx_str_t *) ((char *) ctx + data);
+	if(s->len == 0) {
 		v->not_found = 1;
 		return NGX_OK;
 	}
 
-	v->data = ctx->client.data;
-	v->len = ctx->client.len;
+	v->data = s->data;
+	v->len = s->len;
 	v->valid = 1;
 	v->no_cacheable = 0;
 	v->not_found = 0;
@@ -34,22 +47,22 @@ static ngx_int_t ngx_http_dlg_auth_client_variable(ngx_http_request_t *r, ngx_ht
 }
 
 /*
- * Fill expires variable from module per request context.
+ * Fill expires variable, the expiry time of the ticket in seconds since the epoch.
  */
 static ngx_int_t ngx_http_dlg_auth_expires_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
 	ngx_http_dlg_auth_ctx_t *ctx;
+	u_char *p;
 
-	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL) {
+	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL || !ctx->has_ticket) {
 		v->not_found = 1;
 		return NGX_OK;
 	}
-	if(ctx->expires.len == 0) {
-		v->not_found = 1;
-		return NGX_OK;
+	if( (p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN)) == NULL) {
+		return NGX_ERROR;
 	}
 
-	v->data = ctx->expires.data;
-	v->len = ctx->expires.len;
+	v->data = p;
+	v->len = ngx_sprintf(p, "%T", ctx->expires) - p;
 	v->valid = 1;
 	v->no_cacheable = 0;
 	v->not_found = 0;
@@ -58,22 +71,48 @@ static ngx_int_t ngx_http_dlg_auth_expires_variable(ngx_http_request_t *r, ngx_h
 }
 
 /*
- * Fill clockskew variable from module per request context.
+ * Fill clockskew variable, our time minus the request timestamp in seconds. Only
+ * set for requests with a valid signature.
  */
 static ngx_int_t ngx_http_dlg_auth_clockskew_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
 	ngx_http_dlg_auth_ctx_t *ctx;
+	u_char *p;
 
-	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL) {
+	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL || !ctx->has_clockskew) {
 		v->not_found = 1;
 		return NGX_OK;
 	}
-	if(ctx->clockskew.len == 0) {
+	if( (p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN)) == NULL) {
+		return NGX_ERROR;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%T", ctx->clockskew) - p;
+	v->valid = 1;
+	v->no_cacheable = 0;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
+
+/*
+ * Fill rw variable, 'true' if the ticket grants access with unsafe methods.
+ */
+static ngx_int_t ngx_http_dlg_auth_rw_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+	ngx_http_dlg_auth_ctx_t *ctx;
+
+	if( (ctx = ngx_http_get_module_ctx(r, nginx_dlg_auth_module)) == NULL || !ctx->has_ticket) {
 		v->not_found = 1;
 		return NGX_OK;
 	}
 
-	v->data = ctx->clockskew.data;
-	v->len = ctx->clockskew.len;
+	if(ctx->rw) {
+		v->data = (u_char *) "true";
+		v->len = sizeof("true") - 1;
+	} else {
+		v->data = (u_char *) "false";
+		v->len = sizeof("false") - 1;
+	}
 	v->valid = 1;
 	v->no_cacheable = 0;
 	v->not_found = 0;
@@ -81,6 +120,43 @@ static ngx_int_t ngx_http_dlg_auth_clockskew_variable(ngx_http_request_t *r, ngx
 	return NGX_OK;
 }
 
+/*
+ * Fill ticket cache counter variables. Worker cache counters are those of the
+ * worker process handling the request, zone counters are those of the ticket
+ * cache zone of the current location.
+ */
+static ngx_int_t ngx_http_dlg_auth_cache_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+	ngx_http_dlg_auth_loc_conf_t *conf;
+	ngx_uint_t hits, misses;
+	ngx_atomic_uint_t zone_hits, zone_misses;
+	ngx_atomic_uint_t n;
+	u_char *p;
+
+	if(data == CACHE_WORKER_HITS || data == CACHE_WORKER_MISSES) {
+		ngx_http_dlg_auth_cache_worker_stats(&hits, &misses);
+		n = (data == CACHE_WORKER_HITS) ? hits : misses;
+	} else {
+		conf = ngx_http_get_module_loc_conf(r, nginx_dlg_auth_module);
+		if(conf->ticket_cache == NULL) {
+			v->not_found = 1;
+			return NGX_OK;
+		}
+		ngx_http_dlg_auth_cache_zone_stats(conf->ticket_cache, &zone_hits, &zone_misses);
+		n = (data == CACHE_ZONE_HITS) ? zone_hits : zone_misses;
+	}
+
+	if( (p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN)) == NULL) {
+		return NGX_ERROR;
+	}
+
+	v->data = p;
+	v->len = ngx_sprintf(p, "%uA", n) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+
+	return NGX_OK;
+}
 
 /*
  * This array defines our variables. They will be added to the global set of
@@ -90,7 +166,23 @@ static ngx_int_t ngx_http_dlg_auth_clockskew_variable(ngx_http_request_t *r, ngx
 static ngx_http_variable_t  ngx_dlg_auth_vars[] = {
 
     { ngx_string("dlg_auth_client"), NULL,
-      ngx_http_dlg_auth_client_variable, 0,
+      ngx_http_dlg_auth_string_variable, offsetof(ngx_http_dlg_auth_ctx_t, client),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_user"), NULL,
+      ngx_http_dlg_auth_string_variable, offsetof(ngx_http_dlg_auth_ctx_t, user),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_owner"), NULL,
+      ngx_http_dlg_auth_string_variable, offsetof(ngx_http_dlg_auth_ctx_t, owner),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_scopes"), NULL,
+      ngx_http_dlg_auth_string_variable, offsetof(ngx_http_dlg_auth_ctx_t, scopes),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_rw"), NULL,
+      ngx_http_dlg_auth_rw_variable, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("dlg_auth_expires"), NULL,
@@ -101,6 +193,22 @@ static ngx_http_variable_t  ngx_dlg_auth_vars[] = {
       ngx_http_dlg_auth_clockskew_variable, 0,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("dlg_auth_worker_cache_hits"), NULL,
+      ngx_http_dlg_auth_cache_variable, CACHE_WORKER_HITS,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_worker_cache_misses"), NULL,
+      ngx_http_dlg_auth_cache_variable, CACHE_WORKER_MISSES,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_zone_cache_hits"), NULL,
+      ngx_http_dlg_auth_cache_variable, CACHE_ZONE_HITS,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("dlg_auth_zone_cache_misses"), NULL,
+      ngx_http_dlg_auth_cache_variable, CACHE_ZONE_MISSES,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
 
@@ -0,0 +1,78 @@
+#include <string.h>
+#include "pwdindex.h"
+
+/*
+ * FNV-1a, as used for ticket realms.
+ */
+uint32_t pwd_index_hash(const unsigned char *id, size_t id_len) {
+	uint32_t h = 2166136261U;
+	size_t i;
+	for(i = 0; i < id_len; i++) {
+		h ^= id[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+int pwd_index_build(PwdIndex index, CironPwdTable table, PwdIndexAllocator alloc, void *alloc_ctx) {
+	size_t size, i, k;
+	uint32_t h;
+	CironPwdTableEntry e;
+
+	size = 16;
+	while(size < 2 * table->nentries) {
+		size *= 2;
+	}
+	if( (index->slots = alloc(alloc_ctx, size * sizeof(struct PwdIndexSlot))) == NULL) {
+		return -1;
+	}
+	memset(index->slots, 0, size * sizeof(struct PwdIndexSlot));
+	index->table = table;
+	index->mask = size - 1;
+
+	for(i = 0; i < table->nentries; i++) {
+		e = &(table->entries[i]);
+		if(pwd_index_lookup(index, e->password_id, e->password_id_len) != NULL) {
+			continue;
+		}
+		h = pwd_index_hash(e->password_id, e->password_id_len);
+		for(k = h & index->mask; index->slots[k].entry != 0; k = (k + 1) & index->mask) {
+			;
+		}
+		index->slots[k].hash = h;
+		index->slots[k].entry = (uint32_t)(i + 1);
+	}
+	return 0;
+}
+
+CironPwdTableEntry pwd_index_lookup(PwdIndex index, const unsigned char *id, size_t id_len) {
+	uint32_t h = pwd_index_hash(id, id_len);
+	size_t k;
+	CironPwdTableEntry e;
+
+	for(k = h & index->mask; index->slots[k].entry != 0; k = (k + 1) & index->mask) {
+		if(index->slots[k].hash != h) {
+			continue;
+		}
+		e = &(index->table->entries[index->slots[k].entry - 1]);
+		if(e->password_id_len == id_len && memcmp(e->password_id, id, id_len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+int pwd_index_sealed_id(const unsigned char *sealed, size_t len, const unsigned char **id, size_t *id_len) {
+	const unsigned char *p, *q, *end = sealed + len;
+
+	if( (p = memchr(sealed, '*', len)) == NULL) {
+		return -1;
+	}
+	p++;
+	if( (q = memchr(p, '*', end - p)) == NULL) {
+		return -1;
+	}
+	*id = p;
+	*id_len = q - p;
+	return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef NGX_DLG_AUTH_PWDINDEX_H
+#define NGX_DLG_AUTH_PWDINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ciron.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hash index over the password ids of an iron password table.
+ *
+ * ciron_unseal looks up the password id of a sealed ticket by scanning the
+ * password table, which gets expensive for tables with one password per tenant.
+ * With an index, the caller resolves the password id from the sealed ticket
+ * beforehand and passes a table with just the matching entry to ciron_unseal.
+ *
+ * The index is an open addressing table with linear probing, at most half full.
+ * Slots hold the id hash, so probing rarely has to compare ids.
+ */
+typedef struct PwdIndexSlot {
+	/* Hash of the password id, see pwd_index_hash */
+	uint32_t hash;
+	/* Position of the entry in the password table plus one, 0 for empty slots */
+	uint32_t entry;
+} *PwdIndexSlot;
+
+typedef struct PwdIndex {
+	CironPwdTable table;
+	PwdIndexSlot slots;
+	size_t mask;
+} *PwdIndex;
+
+/*
+ * Allocator for the slots, same as TicketAllocator.
+ */
+typedef void *(*PwdIndexAllocator)(void *ctx, size_t size);
+
+/*
+ * Build the index over the entries of table. The table must not change while
+ * the index is in use. Returns 0 on success, -1 if allocation fails. If ids occur
+ * more than once, the first entry wins, as with ciron's own lookup.
+ */
+int pwd_index_build(PwdIndex index, CironPwdTable table, PwdIndexAllocator alloc, void *alloc_ctx);
+
+/*
+ * Returns the entry with the given password id or NULL.
+ */
+CironPwdTableEntry pwd_index_lookup(PwdIndex index, const unsigned char *id, size_t id_len);
+
+/*
+ * Extract the password id from a sealed iron ticket ('Fe26.2*<id>*...').
+ * Returns 0 and points id into the ticket on success, -1 if the ticket is
+ * malformed. The id is empty for tickets sealed with a single password.
+ */
+int pwd_index_sealed_id(const unsigned char *sealed, size_t len, const unsigned char **id, size_t *id_len);
+
+uint32_t pwd_index_hash(const unsigned char *id, size_t id_len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,189 @@
+#include <string.h>
+#include <stdlib.h>
+#include "revocation.h"
+
+/*
+ * Bloom filter bits per key, before rounding the number of blocks up to a power
+ * of two. Blocked filters need some more bits than classic ones for the same
+ * false positive rate.
+ */
+#define BITS_PER_KEY 16
+#define NPROBES REVOCATION_MAX_PROBES
+
+static uint32_t nblocks_for(size_t nkeys);
+static size_t sort_unique(uint64_t *hashes, size_t n);
+static int cmp_hash(const void *a, const void *b);
+static int find_hash(const uint64_t *hashes, size_t n, uint64_t h);
+
+/*
+ * FNV-1a, 64 bit, over the type and the key.
+ */
+uint64_t revocation_hash(int type, const unsigned char *key, size_t key_len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+
+	h ^= (unsigned char) type;
+	h *= 1099511628211ULL;
+	for(i = 0; i < key_len; i++) {
+		h ^= key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * The block is taken from the upper half of the hash, the bits within the block
+ * from 9 bit slices of the mixed hash.
+ */
+#define BLOCK_OF(h, nblocks) ((uint32_t) ((h) >> 32) & ((nblocks) - 1))
+#define MIX(h) ((h) * 0x9E3779B97F4A7C15ULL)
+
+const char *revocation_open(RevocationSet set, const unsigned char *data, size_t len) {
+	const struct RevocationHeader *hdr = (const struct RevocationHeader *) data;
+	size_t n;
+
+	if(len < sizeof(struct RevocationHeader) || memcmp(hdr->magic, REVOCATION_MAGIC, sizeof(hdr->magic)) != 0) {
+		return "not a revocation file";
+	}
+	if(hdr->byte_order != 1) {
+		return "revocation file built on a machine with different byte order";
+	}
+	if(hdr->nblocks == 0 || (hdr->nblocks & (hdr->nblocks - 1)) != 0 || hdr->nprobes == 0
+			|| hdr->nprobes > REVOCATION_MAX_PROBES) {
+		return "invalid Bloom filter parameters";
+	}
+	n = (len - sizeof(struct RevocationHeader)) / 8;
+	if(hdr->nclients > n || hdr->ntickets > n
+			|| len != sizeof(struct RevocationHeader) + (size_t) hdr->nblocks * 64 + (hdr->nclients + hdr->ntickets) * 8) {
+		return "revocation file size does not match its header";
+	}
+
+	set->bloom = (const uint64_t *) (data + sizeof(struct RevocationHeader));
+	set->nblocks = hdr->nblocks;
+	set->nprobes = hdr->nprobes;
+	set->clients = set->bloom + (size_t) hdr->nblocks * 8;
+	set->nclients = (size_t) hdr->nclients;
+	set->tickets = set->clients + set->nclients;
+	set->ntickets = (size_t) hdr->ntickets;
+
+	/*
+	 * Lookups rely on the order.
+	 */
+	for(n = 1; n < set->nclients; n++) {
+		if(set->clients[n - 1] >= set->clients[n]) {
+			return "client hashes not sorted";
+		}
+	}
+	for(n = 1; n < set->ntickets; n++) {
+		if(set->tickets[n - 1] >= set->tickets[n]) {
+			return "ticket hashes not sorted";
+		}
+	}
+	return NULL;
+}
+
+int revocation_contains(RevocationSet set, int type, const unsigned char *key, size_t key_len) {
+	uint64_t h, m;
+	const uint64_t *block;
+	uint32_t i, bit;
+
+	h = revocation_hash(type, key, key_len);
+	block = set->bloom + (size_t) BLOCK_OF(h, set->nblocks) * 8;
+	m = MIX(h);
+	for(i = 0; i < set->nprobes; i++) {
+		bit = (uint32_t) (m >> (9 * i)) & (REVOCATION_BLOCK_BITS - 1);
+		if( (block[bit >> 6] & ((uint64_t) 1 << (bit & 63))) == 0) {
+			return 0;
+		}
+	}
+
+	if(type == REVOCATION_CLIENT) {
+		return find_hash(set->clients, set->nclients, h);
+	}
+	return find_hash(set->tickets, set->ntickets, h);
+}
+
+size_t revocation_file_size(size_t nclients, size_t ntickets) {
+	return sizeof(struct RevocationHeader) + (size_t) nblocks_for(nclients + ntickets) * 64 + (nclients + ntickets) * 8;
+}
+
+size_t revocation_build(unsigned char *buf, uint64_t *clients, size_t nclients, uint64_t *tickets, size_t ntickets) {
+	RevocationHeader hdr = (RevocationHeader) buf;
+	uint64_t *bloom, *block, *p, m;
+	uint32_t nblocks, i, bit;
+	size_t k;
+
+	nblocks = nblocks_for(nclients + ntickets);
+	nclients = sort_unique(clients, nclients);
+	ntickets = sort_unique(tickets, ntickets);
+
+	memset(hdr, 0, sizeof(struct RevocationHeader));
+	memcpy(hdr->magic, REVOCATION_MAGIC, sizeof(hdr->magic));
+	hdr->byte_order = 1;
+	hdr->nblocks = nblocks;
+	hdr->nprobes = NPROBES;
+	hdr->nclients = nclients;
+	hdr->ntickets = ntickets;
+
+	bloom = (uint64_t *) (buf + sizeof(struct RevocationHeader));
+	memset(bloom, 0, (size_t) nblocks * 64);
+	p = bloom + (size_t) nblocks * 8;
+	memcpy(p, clients, nclients * 8);
+	memcpy(p + nclients, tickets, ntickets * 8);
+
+	for(k = 0; k < nclients + ntickets; k++) {
+		block = bloom + (size_t) BLOCK_OF(p[k], nblocks) * 8;
+		m = MIX(p[k]);
+		for(i = 0; i < NPROBES; i++) {
+			bit = (uint32_t) (m >> (9 * i)) & (REVOCATION_BLOCK_BITS - 1);
+			block[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+		}
+	}
+
+	return sizeof(struct RevocationHeader) + (size_t) nblocks * 64 + (nclients + ntickets) * 8;
+}
+
+static uint32_t nblocks_for(size_t nkeys) {
+	uint32_t nblocks = 1;
+
+	while(nblocks < (nkeys * BITS_PER_KEY + REVOCATION_BLOCK_BITS - 1) / REVOCATION_BLOCK_BITS && nblocks < 0x80000000U) {
+		nblocks *= 2;
+	}
+	return nblocks;
+}
+
+static size_t sort_unique(uint64_t *hashes, size_t n) {
+	size_t i, k;
+
+	if(n == 0) {
+		return 0;
+	}
+	qsort(hashes, n, sizeof(uint64_t), cmp_hash);
+	for(i = 1, k = 1; i < n; i++) {
+		if(hashes[i] != hashes[k - 1]) {
+			hashes[k++] = hashes[i];
+		}
+	}
+	return k;
+}
+
+static int cmp_hash(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static int find_hash(const uint64_t *hashes, size_t n, uint64_t h) {
+	size_t lo = 0, hi = n, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(hashes[mid] < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < n && hashes[lo] == h;
+}
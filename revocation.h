@@ -0,0 +1,101 @@
+#ifndef NGX_DLG_AUTH_REVOCATION_H
+#define NGX_DLG_AUTH_REVOCATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set of revoked client ids and sealed tickets, prebuilt into a file that is
+ * used as is through mmap.
+ *
+ * Keys are 64 bit FNV-1a hashes of the client id or of the sealed ticket (the
+ * Hawk id), see revocation_hash. The file consists of
+ *
+ *   64 bytes   header, see RevocationHeader
+ *   64 bytes   per Bloom filter block, nblocks blocks
+ *   8 bytes    per revoked client hash, sorted
+ *   8 bytes    per revoked ticket hash, sorted
+ *
+ * all in the byte order of the machine that built the file.
+ *
+ * The Bloom filter is blocked: a key sets nprobes bits within a single block of
+ * 512 bits, so a lookup of a key that is not in the set reads one cache line of
+ * the filter in almost every case. Only keys passing the filter are searched in
+ * the sorted arrays.
+ */
+
+#define REVOCATION_MAGIC "DLGREV1\n"
+
+/*
+ * Key types, hashed along with the key so that a client id never matches a
+ * ticket and vice versa.
+ */
+#define REVOCATION_CLIENT 'c'
+#define REVOCATION_TICKET 't'
+
+#define REVOCATION_BLOCK_BITS 512
+#define REVOCATION_MAX_PROBES 7
+
+typedef struct RevocationHeader {
+	unsigned char magic[8];
+	/* 1 in the byte order of the file */
+	uint32_t byte_order;
+	/* Number of Bloom filter blocks, a power of two */
+	uint32_t nblocks;
+	/* Number of bits set per key, 1 to REVOCATION_MAX_PROBES */
+	uint32_t nprobes;
+	uint32_t reserved0;
+	uint64_t nclients;
+	uint64_t ntickets;
+	unsigned char reserved[24];
+} *RevocationHeader;
+
+/*
+ * A revocation set pointing into the file data.
+ */
+typedef struct RevocationSet {
+	const uint64_t *bloom;
+	uint32_t nblocks;
+	uint32_t nprobes;
+	const uint64_t *clients;
+	size_t nclients;
+	const uint64_t *tickets;
+	size_t ntickets;
+} *RevocationSet;
+
+/*
+ * Set up set from the contents of a revocation file. The data must be 8 byte
+ * aligned and stay unchanged while set is used. Returns NULL on success or a
+ * message describing why the data is not a valid revocation file.
+ */
+const char *revocation_open(RevocationSet set, const unsigned char *data, size_t len);
+
+/*
+ * Returns 1 if the key of the given type is in the set, 0 otherwise.
+ */
+int revocation_contains(RevocationSet set, int type, const unsigned char *key, size_t key_len);
+
+uint64_t revocation_hash(int type, const unsigned char *key, size_t key_len);
+
+/*
+ * Number of bytes of a revocation file for the given numbers of hashes.
+ */
+size_t revocation_file_size(size_t nclients, size_t ntickets);
+
+/*
+ * Write a revocation file for the given client and ticket hashes to buf, which
+ * must be 8 byte aligned and have room for revocation_file_size bytes. The hash
+ * arrays are sorted and duplicates removed in place. Returns the number of bytes
+ * written, which is less than revocation_file_size if there were duplicates.
+ */
+size_t revocation_build(unsigned char *buf, uint64_t *clients, size_t nclients, uint64_t *tickets, size_t ntickets);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
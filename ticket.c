@@ -5,62 +5,57 @@
 #include <time.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
 #include "ticket.h"
-#include "jsmn.h"
-
-
-/*
- * This max number of tokens must be large enough to handle usual tickets.
- * The number of tokens varies with the number of realms in the scope.
- * MAX_TOKENS has been calculated like this:
- * 1 Token for the overall object
- * 16 Tokens for the 8 fields (2 tokens each)
- * MAX_SCOPE (see ticket.h) tokens for the scope
- * => 27 tokens.
- *
- */
-#define MAX_TOKENS 27
 
 
 /*
  * Structure to hold state while parsing.
+ *
+ * The parser is specialised to the ticket schema: it reads the JSON in a single
+ * pass, dispatches on the member names as it meets them and stores the values
+ * directly in the ticket. Strings are not copied, the ticket's strings point
+ * into the input. As before, escape sequences are passed through as they are.
  */
-typedef struct Builder {
-	jsmn_parser parser;
-	jsmntok_t tokens[MAX_TOKENS];
-	size_t i;
+typedef struct Parser {
+	char *p;
+	char *end;
 	Ticket ticket;
-	size_t ntokens;
-	char *input;
-} *Builder;
-
-static void ticket_init(Ticket t);
-static TicketError do_algo(Builder builder);
-static TicketError do_string(Builder builder, HawkcString *s);
-static TicketError do_rw(Builder builder, int *v);
-static TicketError do_time(Builder builder, time_t *tp);
-static TicketError do_scope(Builder builder);
+} *Parser;
 
 /*
- * digittoint was missing in some compile environments, so we supply
- * our own.
+ * The ticket members.
  */
-static int my_digittoint(char ch) {
-  int d = ch - '0';
-  if ((unsigned) d < 10) {
-    return d;
-  }
-  d = ch - 'a';
-  if ((unsigned) d < 6) {
-    return d + 10;
-  }
-  d = ch - 'A';
-  if ((unsigned) d < 6) {
-    return d + 10;
-  }
-  return -1;
-}
+typedef enum {
+	FIELD_UNKNOWN,
+	FIELD_CLIENT,
+	FIELD_USER,
+	FIELD_OWNER,
+	FIELD_PWD,
+	FIELD_SCOPE,
+	FIELD_RW,
+	FIELD_EXP,
+	FIELD_ALGO
+} Field;
+
+static void ticket_reset(Ticket t);
+static Field do_name(Parser parser);
+static TicketError do_value(Parser parser, Field field);
+static TicketError do_algo(Parser parser);
+static TicketError do_string(Parser parser, HawkcString *s);
+static TicketError do_primitive(Parser parser, HawkcString *s);
+static TicketError do_rw(Parser parser, int *v);
+static TicketError do_time(Parser parser, time_t *tp);
+static TicketError do_scope(Parser parser);
+static TicketError unexpected(Parser parser);
+static TicketError do_binary_string(unsigned char **pp, unsigned char *end, HawkcString *s);
+static unsigned char *put_binary_string(unsigned char *p, unsigned char *end, HawkcString *s);
 
+#define SKIP_WHITESPACE(parser) \
+	while((parser)->p < (parser)->end && \
+			(*(parser)->p == ' ' || *(parser)->p == '\t' || *(parser)->p == '\r' || *(parser)->p == '\n')) { \
+		(parser)->p++; \
+	}
 
 
 /** Error strings used by ticket_strerror
@@ -77,6 +72,8 @@ static char *error_strings[] = {
 		"Unable to parse time value", /* ERROR_PARSE_TIME_VALUE */
 		"Too many realms in ticket", /* ERROR_NREALMS */
 		"Unknown Hawk algorithm", /* ERROR_UNKNOWN_HAWK_ALGORITHM */
+		"Unsupported binary ticket version", /* ERROR_BINARY_VERSION */
+		"Binary ticket is truncated", /* ERROR_BINARY_TRUNCATED */
 		"Error" , /* ERROR */
 		NULL
 };
@@ -88,200 +85,470 @@ char* ticket_strerror(TicketError e) {
 
 TicketError ticket_from_string(Ticket ticket, char *json_string,size_t len) {
 	TicketError e;
-	jsmnerr_t jsmn_error;
-	struct Builder builder;
+	struct Parser parser;
+	HawkcString name;
+	Field field;
 
-	/* Initialize builder */
-	memset(&builder,0,sizeof(builder));
+	if(len > 0 && (unsigned char)json_string[0] == TICKET_BINARY_MAGIC) {
+		return ticket_from_binary(ticket, (unsigned char*)json_string, len);
+	}
 
-	/* Initialize parser */
-	jsmn_init(&(builder.parser));
-	builder.ticket = ticket;
-	builder.input = json_string;
+	parser.p = json_string;
+	parser.end = json_string + len;
+	parser.ticket = ticket;
 	/* Initialize ticket */
-	ticket_init(builder.ticket);
+	ticket_reset(ticket);
 
-	if( (jsmn_error = jsmn_parse(&(builder.parser), builder.input, len, builder.tokens, MAX_TOKENS)) != JSMN_SUCCESS) {
-		switch(jsmn_error) {
-		case JSMN_ERROR_INVAL:
-			return ERROR_JSON_INVAL;
-		case JSMN_ERROR_NOMEM:
-			return ERROR_JSON_NTOKENS;
-		case JSMN_ERROR_PART:
-			return ERROR_JSON_PART;
-		default:
-			/* Should never be reached */
-			return OK;
+	SKIP_WHITESPACE(&parser);
+	if(parser.p == parser.end || *parser.p != '{') {
+		return unexpected(&parser);
+	}
+	parser.p++;
+	SKIP_WHITESPACE(&parser);
+
+	if(parser.p < parser.end && *parser.p == '}') {
+		parser.p++;
+	} else {
+		for(;;) {
+			/* Member name */
+			if(parser.p == parser.end) {
+				return ERROR_JSON_PART;
+			}
+			if(*parser.p != '"') {
+				return ERROR_UNEXPECTED_TOKEN_TYPE;
+			}
+			if( (field = do_name(&parser)) == FIELD_UNKNOWN) {
+				/* Tell truncated input from unknown names */
+				if( (e = do_string(&parser,&name)) != OK) {
+					return e;
+				}
+				return ERROR_UNEXPECTED_TOKEN_NAME;
+			}
+			SKIP_WHITESPACE(&parser);
+			if(parser.p == parser.end || *parser.p != ':') {
+				return unexpected(&parser);
+			}
+			parser.p++;
+			SKIP_WHITESPACE(&parser);
+			if(parser.p == parser.end) {
+				return ERROR_MISSING_EXPECTED_TOKEN;
+			}
+
+			/* Member value */
+			if( (e = do_value(&parser,field)) != OK) {
+				return e;
+			}
+
+			SKIP_WHITESPACE(&parser);
+			if(parser.p == parser.end) {
+				return ERROR_JSON_PART;
+			}
+			if(*parser.p == '}') {
+				parser.p++;
+				break;
+			}
+			if(*parser.p != ',') {
+				return ERROR_JSON_INVAL;
+			}
+			parser.p++;
+			SKIP_WHITESPACE(&parser);
 		}
-		/* Should never be reached */
-		return ERROR;
 	}
 
-	/* Make number of tokens accessible more conveniently */
-	builder.ntokens = builder.parser.toknext;
-
-	/* Build ticket from parsed JSON tokens */
-	for (builder.i = 0; builder.i< (size_t)builder.parser.toknext;builder.i++) {
-        jsmntok_t *t = &(builder.tokens[builder.i]);
-        unsigned int length = t->end - t->start;
-        char *s = builder.input + t->start;
-
-        if (t->type == JSMN_STRING) {
-        	if(length == 6 && strncmp(s,"client",length) == 0) {
-        		if( (e = do_string(&builder,&(ticket->client))) != OK) {
-        			return e;
-        		}
-        	} else if(length == 3 && strncmp(s,"pwd",length) == 0) {
-        		if( (e = do_string(&builder,&(ticket->pwd))) != OK) {
-        			return e;
-        		}
-        	} else if(length == 13 && strncmp(s,"hawkAlgorithm",length) == 0) {
-        		if( (e = do_algo(&builder)) != OK) {
-        			return e;
-        		}
-        	} else if(length == 5 && strncmp(s,"owner",length) == 0) {
-        		if( (e = do_string(&builder,&(ticket->owner))) != OK) {
-        			return e;
-        		}
-        	} else if(length == 5 && strncmp(s,"scope",length) == 0) {
-        		if( (e = do_scope(&builder)) != OK) {
-        			return e;
-        		}
-        	} else if(length == 6 && strncmp(s,"scopes",length) == 0) {
-        		if( (e = do_scope(&builder)) != OK) {
-        			return e;
-        		}
-        	} else if(length == 4 && strncmp(s,"user",length) == 0) {
-        		if( (e = do_string(&builder,&(ticket->user))) != OK) {
-        			return e;
-        		}
-        	} else if(length == 3 && strncmp(s,"exp",length) == 0) {
-        		if( (e = do_time(&builder,&(ticket->exp))) != OK) {
-        			return e;
-        		}
-           	} else if(length == 2 && strncmp(s,"rw",length) == 0) {
-           		if( (e = do_rw(&builder,&(ticket->rw))) != OK) {
-           			return e;
-           		}
-        	} else {
-        		return ERROR_UNEXPECTED_TOKEN_NAME;
-        	}
-        } else if (t->type == JSMN_PRIMITIVE) {
-        	/* Primitives are handled in dedicated functions */
-        	return ERROR_UNEXPECTED_TOKEN_TYPE;
-        } else if (t->type == JSMN_ARRAY) {
-        	/* Scopes array is handled by dedicated function. Should never come here */
-        	return ERROR_UNEXPECTED_TOKEN_TYPE;
-        } else if (t->type == JSMN_OBJECT) {
-        	/* Only object we should encounter is the ticket itself, which is at i=0 */
-        	if(builder.i != 0) {
-        		return ERROR_UNEXPECTED_TOKEN_TYPE;
-        	}
-        } else {
-       		return ERROR_UNEXPECTED_TOKEN_TYPE;
-        }
-    }
+	/* Nothing must follow the ticket object */
+	SKIP_WHITESPACE(&parser);
+	if(parser.p != parser.end) {
+		return ERROR_JSON_INVAL;
+	}
 	return OK;
 }
 
-TicketError do_string(Builder builder, HawkcString *s) {
-	jsmntok_t *t;
-	builder->i++;
-	if(builder->i >= builder->ntokens) {
-		return ERROR_MISSING_EXPECTED_TOKEN;
+/*
+ * Match the member name at parser->p, including the closing quote, against
+ * a known name. Names are compared in place, they are never scanned for
+ * their end or copied.
+ */
+#define MATCH_NAME(parser,s,f) \
+	if((size_t)((parser)->end - (parser)->p) > sizeof(s) && memcmp((parser)->p + 1, s "\"", sizeof(s)) == 0) { \
+		(parser)->p += sizeof(s) + 1; \
+		return (f); \
 	}
-	t = &(builder->tokens[builder->i]);
-	if(t->type != JSMN_STRING) {
-		return ERROR_UNEXPECTED_TOKEN_TYPE;
+
+/*
+ * Identify the member name at parser->p by its first byte, then confirm
+ * the full name. Returns FIELD_UNKNOWN if it is none of the ticket members.
+ */
+static Field do_name(Parser parser) {
+	if(parser->end - parser->p < 2) {
+		return FIELD_UNKNOWN;
 	}
-	/* FIXME Cast implies data is only ascii - maybe I need to rewrite jsmn at some point */
-   s->data = (unsigned char*)builder->input+t->start;
-   s->len = t->end - t->start;
-   return OK;
+	switch(parser->p[1]) {
+	case 'c':
+		MATCH_NAME(parser,"client",FIELD_CLIENT);
+		break;
+	case 'e':
+		MATCH_NAME(parser,"exp",FIELD_EXP);
+		break;
+	case 'h':
+		MATCH_NAME(parser,"hawkAlgorithm",FIELD_ALGO);
+		break;
+	case 'o':
+		MATCH_NAME(parser,"owner",FIELD_OWNER);
+		break;
+	case 'p':
+		MATCH_NAME(parser,"pwd",FIELD_PWD);
+		break;
+	case 'r':
+		MATCH_NAME(parser,"rw",FIELD_RW);
+		break;
+	case 's':
+		MATCH_NAME(parser,"scope",FIELD_SCOPE);
+		MATCH_NAME(parser,"scopes",FIELD_SCOPE);
+		break;
+	case 'u':
+		MATCH_NAME(parser,"user",FIELD_USER);
+		break;
+	}
+	return FIELD_UNKNOWN;
 }
 
-TicketError do_time(Builder builder, time_t *tp) {
-	time_t x = 0;
+static TicketError do_value(Parser parser, Field field) {
+	Ticket ticket = parser->ticket;
+
+	switch(field) {
+	case FIELD_CLIENT:
+		return do_string(parser,&(ticket->client));
+	case FIELD_USER:
+		return do_string(parser,&(ticket->user));
+	case FIELD_OWNER:
+		return do_string(parser,&(ticket->owner));
+	case FIELD_PWD:
+		return do_string(parser,&(ticket->pwd));
+	case FIELD_SCOPE:
+		return do_scope(parser);
+	case FIELD_RW:
+		return do_rw(parser,&(ticket->rw));
+	case FIELD_EXP:
+		return do_time(parser,&(ticket->exp));
+	case FIELD_ALGO:
+		return do_algo(parser);
+	default:
+		return ERROR_UNEXPECTED_TOKEN_NAME;
+	}
+}
+
+/*
+ * Parse a string, parser->p must point to the opening quote.
+ */
+static TicketError do_string(Parser parser, HawkcString *s) {
 	char *p;
-	int i;
-	jsmntok_t *t;
-	builder->i++;
-	if(builder->i >= builder->ntokens) {
+
+	if(parser->p == parser->end) {
 		return ERROR_MISSING_EXPECTED_TOKEN;
 	}
-	t = &(builder->tokens[builder->i]);
-	if(t->type != JSMN_PRIMITIVE) {
+	if(*parser->p != '"') {
 		return ERROR_UNEXPECTED_TOKEN_TYPE;
 	}
-	p = builder->input+t->start;
-	i = t->start;
-	while(i < t->end) {
-		if(!isdigit(*p)) {
-			return ERROR_PARSE_TIME_VALUE;
+	/*
+	 * Find the closing quote with memchr, which is a lot faster than looking
+	 * at every byte ourselves. A quote preceded by an odd number of backslashes
+	 * is escaped and does not end the string.
+	 */
+	p = parser->p + 1;
+	for(;;) {
+		char *q;
+		if( (p = memchr(p,'"',parser->end - p)) == NULL) {
+			return ERROR_JSON_PART;
+		}
+		for(q = p; q[-1] == '\\'; q--) {
+			/* void */
+		}
+		if(((p - q) & 1) == 0) {
+			break;
+		}
+		p++;
+	}
+	/* FIXME Cast implies data is only ascii */
+	s->data = (unsigned char*)parser->p + 1;
+	s->len = p - (parser->p + 1);
+	parser->p = p + 1;
+	return OK;
+}
+
+/*
+ * Parse a primitive (number, true, false, null). Anything up to the
+ * next delimiter is taken as the primitive.
+ */
+static TicketError do_primitive(Parser parser, HawkcString *s) {
+	char *p;
+
+	switch(*parser->p) {
+	case '"':
+	case '[':
+	case '{':
+	case ']':
+	case '}':
+	case ',':
+	case ':':
+		return ERROR_UNEXPECTED_TOKEN_TYPE;
+	}
+	p = parser->p;
+	while(p < parser->end && *p != ',' && *p != '}' && *p != ']' && *p != ':'
+			&& *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+		if(*p < 32 || *p >= 127) {
+			return ERROR_JSON_INVAL;
 		}
-		x = (x * 10) + my_digittoint(*p);
 		p++;
-		i++;
+	}
+	if(p == parser->end) {
+		return ERROR_JSON_PART;
+	}
+	s->data = (unsigned char*)parser->p;
+	s->len = p - parser->p;
+	parser->p = p;
+	return OK;
+}
+
+static TicketError do_time(Parser parser, time_t *tp) {
+	HawkcString s;
+	TicketError e;
+	time_t x = 0;
+	size_t i;
+
+	if( (e = do_primitive(parser,&s)) != OK) {
+		return e;
+	}
+	for(i=0;i<s.len;i++) {
+		if(!isdigit(s.data[i])) {
+			return ERROR_PARSE_TIME_VALUE;
+		}
+		x = (x * 10) + (s.data[i] - '0');
 	}
 	*tp = x;
 	return OK;
 }
 
-TicketError do_rw(Builder builder, int *v) {
-	jsmntok_t *t;
+static TicketError do_rw(Parser parser, int *v) {
+	HawkcString s;
+	TicketError e;
+
 	*v = 0; /* Use rw=false as a safe default */
-	builder->i++;
-	if(builder->i >= builder->ntokens) {
-		return ERROR_MISSING_EXPECTED_TOKEN;
+	if(*parser->p == '"') {
+		return do_string(parser,&s);
+	}
+	if( (e = do_primitive(parser,&s)) != OK) {
+		return e;
 	}
-	t = &(builder->tokens[builder->i]);
 	/* check for 'true' only, false is safe default for rw */
-	if( (t->type == JSMN_PRIMITIVE) && (t->end - t->start == 4) && (strncmp(builder->input+t->start,"true",4) == 0)) {
+	if(s.len == 4 && memcmp(s.data,"true",4) == 0) {
 		*v = 1;
 	}
 	return OK;
 }
 
-TicketError do_scope(Builder builder) {
-	jsmntok_t *t;
-	int i;
-	builder->i++;
-	if(builder->i >= builder->ntokens) {
-		return ERROR_MISSING_EXPECTED_TOKEN;
-	}
-	t = &(builder->tokens[builder->i]);
-	if(t->type != JSMN_ARRAY) {
+static TicketError do_scope(Parser parser) {
+	Ticket ticket = parser->ticket;
+	HawkcString realm;
+	TicketError e;
+
+	if(*parser->p != '[') {
 		return ERROR_UNEXPECTED_TOKEN_TYPE;
 	}
-	if(t->size > MAX_REALMS) {
-		return ERROR_NREALMS;
+	parser->p++;
+	ticket->nrealms = 0;
+	SKIP_WHITESPACE(parser);
+	if(parser->p < parser->end && *parser->p == ']') {
+		parser->p++;
+		return OK;
 	}
-	for(i=0;i<t->size;i++) {
-		do_string(builder,&(builder->ticket->realms[i]));
+	for(;;) {
+		if( (e = do_string(parser,&realm)) != OK) {
+			return e;
+		}
+		if( (e = ticket_add_realm(ticket,realm.data,realm.len,ticket_realm_hash(realm.data,realm.len))) != OK) {
+			return e;
+		}
+		SKIP_WHITESPACE(parser);
+		if(parser->p == parser->end) {
+			return ERROR_JSON_PART;
+		}
+		if(*parser->p == ']') {
+			parser->p++;
+			return OK;
+		}
+		if(*parser->p != ',') {
+			return ERROR_JSON_INVAL;
+		}
+		parser->p++;
+		SKIP_WHITESPACE(parser);
 	}
-	builder->ticket->nrealms = t->size;
-	return OK;
 }
 
-TicketError do_algo(Builder builder) {
+static TicketError do_algo(Parser parser) {
 	HawkcString algo;
 	HawkcAlgorithm a;
 	TicketError e;
-	if( (e = do_string(builder,&algo)) != OK) {
+	if( (e = do_string(parser,&algo)) != OK) {
 		return e;
 	}
-	/* FIXME Cast implies data is only ascii - maybe I need to rewrite jsmn at some point */
+	/* FIXME Cast implies data is only ascii */
 	if( (a = hawkc_algorithm_by_name((char*)algo.data, algo.len)) == NULL) {
 		return ERROR_UNKNOWN_HAWK_ALGORITHM;
 	}
-	builder->ticket->hawkAlgorithm = a;
+	parser->ticket->hawkAlgorithm = a;
+	return OK;
+}
+
+/*
+ * Error for an unexpected character at parser->p or end of input.
+ */
+static TicketError unexpected(Parser parser) {
+	return (parser->p == parser->end) ? ERROR_JSON_PART : ERROR_JSON_INVAL;
+}
+
+/*
+ * Hawk algorithm names by binary algorithm code.
+ */
+static struct {
+	char *name;
+	size_t len;
+} algorithms[] = {
+	{ NULL, 0 },
+	{ "sha1", 4 }, /* TICKET_ALGORITHM_SHA1 */
+	{ "sha256", 6 } /* TICKET_ALGORITHM_SHA256 */
+};
+
+#define NALGORITHMS (sizeof(algorithms) / sizeof(algorithms[0]))
+
+/*
+ * Read a length-prefixed string.
+ */
+static TicketError do_binary_string(unsigned char **pp, unsigned char *end, HawkcString *s) {
+	unsigned char *p = *pp;
+	if(p >= end || (size_t)(end - p - 1) < *p) {
+		return ERROR_BINARY_TRUNCATED;
+	}
+	s->len = *p;
+	s->data = p + 1;
+	*pp = p + 1 + s->len;
+	return OK;
+}
+
+TicketError ticket_from_binary(Ticket ticket, unsigned char *b, size_t len) {
+	unsigned char *p = b;
+	unsigned char *end = b + len;
+	HawkcString realm;
+	TicketError e;
+	size_t n;
+	size_t i;
+
+	ticket_reset(ticket);
+
+	if(len < 12) {
+		return ERROR_BINARY_TRUNCATED;
+	}
+	if(b[0] != TICKET_BINARY_MAGIC || b[1] != TICKET_BINARY_VERSION) {
+		return ERROR_BINARY_VERSION;
+	}
+	ticket->rw = (b[2] & TICKET_BINARY_RW) ? 1 : 0;
+	if(b[3] == 0 || b[3] >= NALGORITHMS) {
+		return ERROR_UNKNOWN_HAWK_ALGORITHM;
+	}
+	if( (ticket->hawkAlgorithm = hawkc_algorithm_by_name(algorithms[b[3]].name, algorithms[b[3]].len)) == NULL) {
+		return ERROR_UNKNOWN_HAWK_ALGORITHM;
+	}
+	ticket->exp = 0;
+	for(i = 4; i < 12; i++) {
+		ticket->exp = (ticket->exp << 8) | b[i];
+	}
+	p = b + 12;
+
+	if( (e = do_binary_string(&p, end, &(ticket->client))) != OK
+			|| (e = do_binary_string(&p, end, &(ticket->user))) != OK
+			|| (e = do_binary_string(&p, end, &(ticket->owner))) != OK
+			|| (e = do_binary_string(&p, end, &(ticket->pwd))) != OK) {
+		return e;
+	}
+
+	if(p >= end) {
+		return ERROR_BINARY_TRUNCATED;
+	}
+	n = *p++;
+	for(i = 0; i < n; i++) {
+		if( (e = do_binary_string(&p, end, &realm)) != OK) {
+			return e;
+		}
+		if( (e = ticket_add_realm(ticket, realm.data, realm.len, ticket_realm_hash(realm.data, realm.len))) != OK) {
+			return e;
+		}
+	}
+
+	/* Nothing must follow the last realm */
+	if(p != end) {
+		return ERROR;
+	}
 	return OK;
 }
 
+static unsigned char *put_binary_string(unsigned char *p, unsigned char *end, HawkcString *s) {
+	if(p == NULL || s->len > 255 || (size_t)(end - p) < 1 + s->len) {
+		return NULL;
+	}
+	*p++ = (unsigned char)s->len;
+	memcpy(p, s->data, s->len);
+	return p + s->len;
+}
+
+size_t ticket_to_binary(Ticket ticket, unsigned char *b, size_t size) {
+	unsigned char *p;
+	unsigned char *end = b + size;
+	size_t i;
+
+	if(size < 12 || ticket->nrealms > 255) {
+		return 0;
+	}
+	b[0] = TICKET_BINARY_MAGIC;
+	b[1] = TICKET_BINARY_VERSION;
+	b[2] = ticket->rw ? TICKET_BINARY_RW : 0;
+	b[3] = 0;
+	for(i = 1; i < NALGORITHMS; i++) {
+		if(ticket->hawkAlgorithm != NULL
+				&& hawkc_algorithm_by_name(algorithms[i].name, algorithms[i].len) == ticket->hawkAlgorithm) {
+			b[3] = (unsigned char)i;
+		}
+	}
+	if(b[3] == 0) {
+		return 0;
+	}
+	for(i = 0; i < 8; i++) {
+		b[4 + i] = (unsigned char)((unsigned long long)ticket->exp >> (8 * (7 - i)));
+	}
+	p = b + 12;
+	p = put_binary_string(p, end, &(ticket->client));
+	p = put_binary_string(p, end, &(ticket->user));
+	p = put_binary_string(p, end, &(ticket->owner));
+	p = put_binary_string(p, end, &(ticket->pwd));
+	if(p == NULL || p == end) {
+		return 0;
+	}
+	*p++ = (unsigned char)ticket->nrealms;
+	for(i = 0; i < ticket->nrealms; i++) {
+		p = put_binary_string(p, end, &(ticket->realms[i]));
+	}
+	if(p == NULL) {
+		return 0;
+	}
+	return p - b;
+}
+
 int ticket_has_realm(Ticket ticket, unsigned char *realm, size_t realm_len) {
+	return ticket_has_realm_hash(ticket, realm, realm_len, ticket_realm_hash(realm, realm_len));
+}
+
+int ticket_has_realm_hash(Ticket ticket, unsigned char *realm, size_t realm_len, uint32_t hash) {
 	size_t i;
 	for(i=0;i<ticket->nrealms;i++) {
-		if(ticket->realms[i].len == realm_len) {
+		if(ticket->realm_hashes[i] == hash && ticket->realms[i].len == realm_len) {
 			if(memcmp(ticket->realms[i].data,realm,realm_len) == 0) {
 				return 1;
 			}
@@ -290,8 +557,71 @@ int ticket_has_realm(Ticket ticket, unsigned char *realm, size_t realm_len) {
 	return 0;
 }
 
-void ticket_init(Ticket t) {
-	memset(t,0,sizeof(struct Ticket));
-	t->rw = 0; /* false is default */
+/*
+ * 32 bit FNV-1a.
+ */
+uint32_t ticket_realm_hash(unsigned char *realm, size_t realm_len) {
+	uint32_t h = 2166136261U;
+	while(realm_len--) {
+		h ^= *realm++;
+		h *= 16777619U;
+	}
+	return h;
 }
 
+TicketError ticket_add_realm(Ticket ticket, unsigned char *realm, size_t realm_len, uint32_t hash) {
+	HawkcString *realms;
+	uint32_t *hashes;
+	size_t n;
+
+	if(ticket->nrealms == ticket->max_realms) {
+		/* Grow by doubling, up to MAX_REALMS */
+		if(ticket->alloc == NULL || ticket->max_realms == MAX_REALMS) {
+			return ERROR_NREALMS;
+		}
+		n = ticket->max_realms * 2;
+		if(n > MAX_REALMS) {
+			n = MAX_REALMS;
+		}
+		if( (realms = ticket->alloc(ticket->alloc_ctx, n * sizeof(HawkcString))) == NULL) {
+			return ERROR;
+		}
+		if( (hashes = ticket->alloc(ticket->alloc_ctx, n * sizeof(uint32_t))) == NULL) {
+			return ERROR;
+		}
+		memcpy(realms, ticket->realms, ticket->nrealms * sizeof(HawkcString));
+		memcpy(hashes, ticket->realm_hashes, ticket->nrealms * sizeof(uint32_t));
+		ticket->realms = realms;
+		ticket->realm_hashes = hashes;
+		ticket->max_realms = n;
+	}
+	ticket->realms[ticket->nrealms].data = realm;
+	ticket->realms[ticket->nrealms].len = realm_len;
+	ticket->realm_hashes[ticket->nrealms] = hash;
+	ticket->nrealms++;
+	return OK;
+}
+
+void ticket_init(Ticket t, TicketAllocator alloc, void *alloc_ctx) {
+	t->alloc = alloc;
+	t->alloc_ctx = alloc_ctx;
+	t->realms = NULL;
+	ticket_reset(t);
+}
+
+/*
+ * Clear all ticket fields, but keep the allocator and any realm arrays
+ * allocated before.
+ */
+static void ticket_reset(Ticket t) {
+	memset(t,0,offsetof(struct Ticket,realms));
+	t->rw = 0; /* false is default */
+	if(t->realms == NULL || t->max_realms < TICKET_INLINE_REALMS) {
+		t->realms = t->inline_realms;
+		t->realm_hashes = t->inline_realm_hashes;
+		t->max_realms = TICKET_INLINE_REALMS;
+	}
+	t->nrealms = 0;
+	t->exp = 0;
+	t->hawkAlgorithm = NULL;
+}
@@ -3,13 +3,29 @@
 
 #include <hawkc.h>
 #include <time.h>
+#include <stdint.h>
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define MAX_REALMS 10
+/*
+ * Upper bound of the number of realms in a ticket.
+ */
+#define MAX_REALMS 1024
+
+/*
+ * Number of realms a ticket can hold without allocating memory. Tickets
+ * with more realms need an allocator, see ticket_init.
+ */
+#define TICKET_INLINE_REALMS 16
+
+/*
+ * Allocator for the realm arrays of tickets with many realms. Memory is never
+ * freed by the ticket functions, the allocator is expected to be pool-like.
+ */
+typedef void *(*TicketAllocator)(void *ctx, size_t size);
 
 typedef struct Ticket {
 	HawkcString client;
@@ -17,10 +33,17 @@ typedef struct Ticket {
 	HawkcString owner;
 	HawkcString pwd;
 	int rw;
-	HawkcString realms[MAX_REALMS];
+	/* Realms and their hashes (see ticket_realm_hash), nrealms entries each */
+	HawkcString *realms;
+	uint32_t *realm_hashes;
 	size_t nrealms;
+	size_t max_realms;
 	time_t exp;
 	HawkcAlgorithm hawkAlgorithm;
+	TicketAllocator alloc;
+	void *alloc_ctx;
+	HawkcString inline_realms[TICKET_INLINE_REALMS];
+	uint32_t inline_realm_hashes[TICKET_INLINE_REALMS];
 } *Ticket;
 
 /*
@@ -37,6 +60,8 @@ typedef enum {
 	ERROR_PARSE_TIME_VALUE,
 	ERROR_NREALMS,
 	ERROR_UNKNOWN_HAWK_ALGORITHM,
+	ERROR_BINARY_VERSION,
+	ERROR_BINARY_TRUNCATED,
 	ERROR
 } TicketError;
 
@@ -46,7 +71,28 @@ typedef enum {
 char* ticket_strerror(TicketError e);
 
 /*
- * Parse a ticket from a json string. Allocation of the ticket is the
+ * Initialize a ticket. Must be called before any of the functions below is used
+ * with the ticket. alloc may be NULL, tickets are then limited to
+ * TICKET_INLINE_REALMS realms.
+ *
+ * A ticket points into itself and must not be copied by value.
+ */
+void ticket_init(Ticket ticket, TicketAllocator alloc, void *alloc_ctx);
+
+/*
+ * Append a realm with its precomputed hash.
+ */
+TicketError ticket_add_realm(Ticket ticket, unsigned char *realm, size_t realm_len, uint32_t hash);
+
+/*
+ * Hash of a realm name. Realm checks compare hashes first, so hashing the configured
+ * realm once at configuration time makes the check a scan over integers.
+ */
+uint32_t ticket_realm_hash(unsigned char *realm, size_t realm_len);
+
+/*
+ * Parse a ticket from a json string or from the binary format described below.
+ * The format is detected by the first byte. Allocation of the ticket is the
  * responsibility of the caller. Usually, you should declare a local struct Ticket and
  * pass a pointer to that.
  *
@@ -66,6 +112,37 @@ char* ticket_strerror(TicketError e);
  */
 TicketError ticket_from_string(Ticket ticket, char *b, size_t len);
 
+/*
+ * Binary ticket format, version 1. Tickets issued in this format save the
+ * JSON parsing and make for smaller sealed tickets. All integers are unsigned,
+ * multi-byte integers big endian.
+ *
+ *   1 byte   magic, TICKET_BINARY_MAGIC (never the first byte of a JSON ticket)
+ *   1 byte   version, TICKET_BINARY_VERSION
+ *   1 byte   flags, bit 0 is rw
+ *   1 byte   Hawk algorithm, TICKET_ALGORITHM_SHA1 or TICKET_ALGORITHM_SHA256
+ *   8 bytes  exp
+ *   client, user, owner, pwd: each as 1 byte length followed by the bytes
+ *   1 byte   number of realms, followed by the realms as 1 byte length and bytes
+ */
+#define TICKET_BINARY_MAGIC 0xD1
+#define TICKET_BINARY_VERSION 1
+#define TICKET_BINARY_RW 0x01
+#define TICKET_ALGORITHM_SHA1 1
+#define TICKET_ALGORITHM_SHA256 2
+
+/*
+ * Parse a ticket in binary format. Strings of the ticket point into b.
+ */
+TicketError ticket_from_binary(Ticket ticket, unsigned char *b, size_t len);
+
+/*
+ * Encode a ticket in binary format. Returns the number of bytes written to b or
+ * 0 if b is too small or the ticket cannot be encoded (strings longer than 255
+ * bytes or an unknown algorithm).
+ */
+size_t ticket_to_binary(Ticket ticket, unsigned char *b, size_t size);
+
 
 /*
  * Returns 1 if the ticket contains a realm that matches the realm.
@@ -73,6 +150,12 @@ TicketError ticket_from_string(Ticket ticket, char *b, size_t len);
  */
 int ticket_has_realm(Ticket ticket, unsigned char *realm, size_t realm_len) ;
 
+/*
+ * Same as ticket_has_realm, with the hash of realm computed by the caller
+ * beforehand.
+ */
+int ticket_has_realm_hash(Ticket ticket, unsigned char *realm, size_t realm_len, uint32_t hash);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif